@@ -0,0 +1,890 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "wfs.h"
+
+// bench.wfs makes a fresh image for each configuration, mounts it with ./mount.wfs and times
+// the metadata and data hot paths through the mount point. A configuration is a log size (the
+// image is first filled with that much live file data) and a tree depth (where the files the
+// metadata workloads use live). Results go to stdout as CSV, one line per workload:
+//
+//   workload,image,log_mb,depth,ops,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us
+//
+// Progress and errors go to stderr. -d benchmarks an existing directory instead, e.g. to
+// compare with another filesystem. -c and -D run every configuration again on an image made
+// with mkfs.wfs -c (compression, for which text is written rather than random bytes) or -d
+// (deduplication), and each run prints how much log the file data took. -u runs them again
+// on plain images mounted with -o io=uring, to compare the ways commits are synced, and -b
+// on plain images mounted with -o backend=direct, to compare the storage backends.
+//
+// Before any image is made, dir_lookup and dir_lookup_prefix time wfs_dir_lookup() in the
+// driver itself on a full inline directory, one sample per pass over all of its names: names
+// of mixed lengths, then names of one length that share a prefix.
+//
+// stat_storm stats names missing from the deepest directory, which FUSE never caches, so
+// every one resolves the whole path in the mount; the mount's resident memory before and
+// after is printed to stderr.
+//
+// Each log size then writes two files in alternate 128 KB pieces, as two writers at once
+// would leave them in the log, and times reading one of them back sequentially from a fresh
+// mount of the image out of the page cache: cold_read_noprefetch with -o readahead_bytes=0,
+// then cold_read with the mount's log prefetching as configured.
+//
+// Each log size then times cold mounts: the image is unmounted, dropped from the page cache
+// and mounted again, once loading the checkpoint the unmount wrote (mount_checkpoint) and
+// once with the checkpoint cleared from the superblock, so the whole log is scanned
+// (mount_scan).
+//
+// Each log size also ends with a crash: the mount is killed, the free space past head that
+// a crash could have left torn bytes in is filled with garbage, and the time to mount the
+// image again is reported as crash_mount. The driver fails if the recovered mount then
+// makes entries that come back wrong.
+//
+// After the data workloads the driver fails unless a write may end at the maximum file size
+// and one that would end past it fails with EFBIG.
+#define IO_SIZE (128 * 1024)
+#define OVERWRITE_SIZE 4096
+#define READDIR_PASSES 20
+#define MOUNT_TIMEOUT_MS 10000
+#define GARBAGE_BYTE 0xa5
+#define LOOKUP_PASSES 100000
+
+const unsigned int log_sizes_mb[] = {0, 256};
+const unsigned int depths[] = {1, 8, 16};
+
+unsigned int scale = 1;
+const char *mount_options = NULL;
+const char *work_dir = "bench_work";
+int text_data = 0;
+
+// Kinds of image every configuration runs on: plain ones, and those -c, -D, -u and -b ask for
+struct image_kind {
+    const char *name;
+    char *mkfs_flag;
+    const char *mount_option;
+    int wanted;
+};
+
+struct image_kind images[] = {
+    {"plain", NULL, NULL, 1},
+    {"compress", "-c", NULL, 0},
+    {"dedup", "-d", NULL, 0},
+    {"uring", NULL, "io=uring", 0},
+    {"direct", NULL, "backend=direct", 0},
+};
+struct image_kind *image = &images[0];
+
+char disk_path[256];
+char mount_path[256];
+pid_t mount_pid = -1;
+const char *extra_option = NULL;    // added to the options of the next mount_image()
+
+double *samples = NULL;     // latency of each operation of the current workload, in us
+unsigned int sample_count = 0;
+
+double now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+int compare_samples(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Print one result line from the samples taken since begin_workload()
+void report(const char *workload, unsigned int log_mb, unsigned int depth, double seconds, uint64_t bytes) {
+    qsort(samples, sample_count, sizeof(double), compare_samples);
+    double p50 = sample_count ? samples[sample_count / 2] : 0;
+    double p99 = sample_count ? samples[(uint64_t)sample_count * 99 / 100] : 0;
+    printf("%s,%s,%u,%u,%u,%.3f,%.0f,%.1f,%.1f,%.1f\n", workload, image->name, log_mb, depth, sample_count, seconds,
+           seconds > 0 ? sample_count / seconds : 0, seconds > 0 ? bytes / seconds / 1e6 : 0, p50, p99);
+    fflush(stdout);
+}
+
+void begin_workload(unsigned int ops) {
+    free(samples);
+    samples = malloc(ops * sizeof(double));
+    sample_count = 0;
+    if (!samples) {
+        perror("Error allocating samples");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Run a program to completion with its output discarded
+int run(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error starting process");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int is_mounted() {
+    struct stat work, mnt;
+    return stat(work_dir, &work) == 0 && stat(mount_path, &mnt) == 0 && work.st_dev != mnt.st_dev;
+}
+
+// Mount the image in the foreground, with its chatter sent to mount.log
+int mount_image() {
+    mount_pid = fork();
+    if (mount_pid == -1) {
+        perror("Error starting mount.wfs");
+        return -1;
+    }
+    if (mount_pid == 0) {
+        char log_path[300];
+        snprintf(log_path, sizeof(log_path), "%s/mount.log", work_dir);
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        // Later options win, so extra_option overrides the same option in -o
+        const char *parts[] = {image->mount_option, mount_options, extra_option};
+        char options[512] = "";
+        for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+            if (parts[i]) {
+                size_t len = strlen(options);
+                snprintf(options + len, sizeof(options) - len, "%s%s", len ? "," : "", parts[i]);
+            }
+        }
+        if (options[0]) {
+            execl("./mount.wfs", "mount.wfs", "-f", "-o", options, disk_path, mount_path, (char *)NULL);
+        } else {
+            execl("./mount.wfs", "mount.wfs", "-f", disk_path, mount_path, (char *)NULL);
+        }
+        _exit(127);
+    }
+
+    for (int waited = 0; waited < MOUNT_TIMEOUT_MS; waited++) {
+        if (is_mounted()) {
+            return 0;
+        }
+        if (waitpid(mount_pid, NULL, WNOHANG) == mount_pid) {
+            fprintf(stderr, "mount.wfs exited; see %s/mount.log\n", work_dir);
+            mount_pid = -1;
+            return -1;
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "Timed out waiting for the mount\n");
+    kill(mount_pid, SIGTERM);
+    waitpid(mount_pid, NULL, 0);
+    mount_pid = -1;
+    return -1;
+}
+
+// mkfs a fresh image and mount it
+int mount_fresh() {
+    char *mkfs_argv[] = {"./mkfs.wfs", disk_path, NULL};
+    char *mkfs_flag_argv[] = {"./mkfs.wfs", image->mkfs_flag, disk_path, NULL};
+    if (run(image->mkfs_flag ? mkfs_flag_argv : mkfs_argv) != 0) {
+        return -1;
+    }
+    return mount_image();
+}
+
+void unmount() {
+    if (mount_pid == -1) {
+        return;
+    }
+    char *umount_argv[] = {"fusermount", "-u", mount_path, NULL};
+    if (run(umount_argv) != 0) {
+        kill(mount_pid, SIGTERM);
+    }
+    waitpid(mount_pid, NULL, 0);
+    mount_pid = -1;
+}
+
+// A chain of depth directories under the mount point; path gets the deepest one
+int make_tree(unsigned int depth, char *path, size_t size) {
+    snprintf(path, size, "%s", mount_path);
+    for (unsigned int i = 1; i < depth; i++) {
+        size_t len = strlen(path);
+        snprintf(path + len, size - len, "/d%u", i);
+        if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+            perror("Error creating directory");
+            return -1;
+        }
+    }
+    size_t len = strlen(path);
+    snprintf(path + len, size - len, "/files");
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating directory");
+        return -1;
+    }
+    return 0;
+}
+
+// Grow the log with log_mb of live data: distinct files written in IO_SIZE pieces
+// Number every 4 KB of buf before it is written, so no two writes hold the same bytes and
+// deduplication does not find them over and over
+unsigned int stamped_pages = 0;
+
+void stamp(char *buf, size_t len) {
+    for (size_t i = 0; i + sizeof(stamped_pages) <= len; i += OVERWRITE_SIZE) {
+        memcpy(buf + i, &stamped_pages, sizeof(stamped_pages));
+        stamped_pages++;
+    }
+}
+
+int fill_log(unsigned int log_mb, char *buf) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/fill", mount_path);
+    if (log_mb && mkdir(path, 0755) == -1) {
+        perror("Error creating fill directory");
+        return -1;
+    }
+    for (unsigned int mb = 0; mb < log_mb; mb++) {
+        snprintf(path, sizeof(path), "%s/fill/f%u", mount_path, mb);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd == -1) {
+            perror("Error creating fill file");
+            return -1;
+        }
+        for (unsigned int i = 0; i < 1024 * 1024 / IO_SIZE; i++) {
+            stamp(buf, IO_SIZE);
+            if (write(fd, buf, IO_SIZE) != IO_SIZE) {
+                perror("Error writing fill file");
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int bench_creates(const char *dir, unsigned int files, unsigned int log_mb, unsigned int depth) {
+    char path[512];
+    begin_workload(files);
+    double begin = now_us();
+    for (unsigned int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/f%u", dir, i);
+        double start = now_us();
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd == -1) {
+            perror("Error creating file");
+            return -1;
+        }
+        close(fd);
+        samples[sample_count++] = now_us() - start;
+    }
+    report("create", log_mb, depth, (now_us() - begin) / 1e6, 0);
+    return 0;
+}
+
+int bench_stats(const char *dir, unsigned int files, unsigned int ops, unsigned int log_mb, unsigned int depth) {
+    char path[512];
+    struct stat st;
+    begin_workload(ops);
+    double begin = now_us();
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(path, sizeof(path), "%s/f%u", dir, rand() % files);
+        double start = now_us();
+        if (stat(path, &st) == -1) {
+            perror("Error stating file");
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    report("stat", log_mb, depth, (now_us() - begin) / 1e6, 0);
+    return 0;
+}
+
+// Resident memory of the mount process in KB, 0 if it cannot be read
+unsigned long mount_rss_kb() {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)mount_pid);
+    FILE *status = fopen(path, "r");
+    if (!status) {
+        return 0;
+    }
+    char line[256];
+    unsigned long rss = 0;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmRSS: %lu kB", &rss) == 1) {
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+int bench_stat_storm(const char *dir, unsigned int ops, unsigned int log_mb, unsigned int depth) {
+    char path[512];
+    struct stat st;
+    unsigned long rss_before = mount_rss_kb();
+    begin_workload(ops);
+    double begin = now_us();
+    for (unsigned int i = 0; i < ops; i++) {
+        snprintf(path, sizeof(path), "%s/missing%u", dir, i);
+        double start = now_us();
+        if (stat(path, &st) == 0 || errno != ENOENT) {
+            fprintf(stderr, "Stating %s did not fail with ENOENT\n", path);
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    report("stat_storm", log_mb, depth, (now_us() - begin) / 1e6, 0);
+    if (mount_pid != -1) {
+        fprintf(stderr, "Log %u MB, depth %u: mount RSS %lu KB before %u stats of missing names, %lu KB after\n", log_mb,
+                depth, rss_before, ops, mount_rss_kb());
+    }
+    return 0;
+}
+
+int bench_readdir(const char *dir, unsigned int log_mb, unsigned int depth) {
+    begin_workload(READDIR_PASSES);
+    double begin = now_us();
+    for (unsigned int i = 0; i < READDIR_PASSES; i++) {
+        double start = now_us();
+        DIR *listing = opendir(dir);
+        if (!listing) {
+            perror("Error opening directory");
+            return -1;
+        }
+        while (readdir(listing)) {
+        }
+        closedir(listing);
+        samples[sample_count++] = now_us() - start;
+    }
+    report("readdir", log_mb, depth, (now_us() - begin) / 1e6, 0);
+    return 0;
+}
+
+// Sequential writes and reads of one file, random overwrites of it, then a copy of it
+int bench_data(char *buf, unsigned int log_mb, unsigned int depth) {
+    char path[512];
+    unsigned int chunks = 512 * scale;     // 64 MiB per unit of scale
+    snprintf(path, sizeof(path), "%s/data", mount_path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error creating data file");
+        return -1;
+    }
+
+    begin_workload(chunks);
+    double begin = now_us();
+    for (unsigned int i = 0; i < chunks; i++) {
+        stamp(buf, IO_SIZE);
+        double start = now_us();
+        if (pwrite(fd, buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE) {
+            perror("Error writing data file");
+            close(fd);
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    fsync(fd);
+    report("seq_write", log_mb, depth, (now_us() - begin) / 1e6, (uint64_t)chunks * IO_SIZE);
+
+    // Drop the kernel's cached pages so reads reach the filesystem
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    begin_workload(chunks);
+    begin = now_us();
+    for (unsigned int i = 0; i < chunks; i++) {
+        double start = now_us();
+        if (pread(fd, buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE) {
+            perror("Error reading data file");
+            close(fd);
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    report("seq_read", log_mb, depth, (now_us() - begin) / 1e6, (uint64_t)chunks * IO_SIZE);
+
+    unsigned int overwrites = 5000 * scale;
+    unsigned int blocks = chunks * (IO_SIZE / OVERWRITE_SIZE);
+    begin_workload(overwrites);
+    begin = now_us();
+    for (unsigned int i = 0; i < overwrites; i++) {
+        stamp(buf, OVERWRITE_SIZE);
+        double start = now_us();
+        if (pwrite(fd, buf, OVERWRITE_SIZE, (off_t)(rand() % blocks) * OVERWRITE_SIZE) != OVERWRITE_SIZE) {
+            perror("Error overwriting data file");
+            close(fd);
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    fsync(fd);
+    report("rand_overwrite", log_mb, depth, (now_us() - begin) / 1e6, (uint64_t)overwrites * OVERWRITE_SIZE);
+
+    // What cp does, the case deduplication is for
+    snprintf(path, sizeof(path), "%s/data_copy", mount_path);
+    int copy_fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (copy_fd == -1) {
+        perror("Error creating copy");
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    begin_workload(chunks);
+    begin = now_us();
+    for (unsigned int i = 0; i < chunks; i++) {
+        double start = now_us();
+        if (pread(fd, buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE || pwrite(copy_fd, buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE) {
+            perror("Error copying data file");
+            close(copy_fd);
+            close(fd);
+            return -1;
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    fsync(copy_fd);
+    report("copy", log_mb, depth, (now_us() - begin) / 1e6, (uint64_t)chunks * IO_SIZE);
+
+    close(copy_fd);
+    close(fd);
+    return 0;
+}
+
+// A write may end at WFS_MAX_FILE_SIZE but not past it, where inode.size would wrap
+int check_size_limit() {
+    char path[512];
+    char bytes[20] = "end of a sparse file";
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/largest", mount_path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error creating largest file");
+        return -1;
+    }
+    int ret = 0;
+    if (pwrite(fd, bytes, 10, (off_t)WFS_MAX_FILE_SIZE - 10) != 10 || fstat(fd, &st) == -1 ||
+        st.st_size != (off_t)WFS_MAX_FILE_SIZE) {
+        fprintf(stderr, "Writing up to the maximum file size failed\n");
+        ret = -1;
+    } else if (pwrite(fd, bytes, sizeof(bytes), (off_t)WFS_MAX_FILE_SIZE - 10) != -1 || errno != EFBIG ||
+               fstat(fd, &st) == -1 || st.st_size != (off_t)WFS_MAX_FILE_SIZE) {
+        fprintf(stderr, "Writing past the maximum file size did not fail with EFBIG\n");
+        ret = -1;
+    }
+    close(fd);
+    unlink(path);
+    return ret;
+}
+
+// Look up every name of a full inline directory, over and over
+int bench_lookup(const char *workload, int shared_prefix) {
+    static char dir_bytes[sizeof(struct wfs_log_entry) + WFS_DIR_INLINE_MAX * sizeof(struct wfs_dentry) * 2 +
+                          WFS_DIR_INLINE_MAX * MAX_FILE_NAME_LEN];
+    struct wfs_log_entry *dir = (struct wfs_log_entry *)dir_bytes;
+    char names[WFS_DIR_INLINE_MAX][MAX_FILE_NAME_LEN];
+    char *pos = dir->data;
+    for (unsigned int i = 0; i < WFS_DIR_INLINE_MAX; i++) {
+        if (shared_prefix) {
+            snprintf(names[i], sizeof(names[i]), "file_%07u", i);
+        } else {
+            // Two to 31 bytes, the first two unique to the name
+            unsigned int len = 2 + i * 7 % (MAX_FILE_NAME_LEN - 2);
+            names[i][0] = 'a' + i % 26;
+            names[i][1] = 'a' + i / 26;
+            for (unsigned int j = 2; j < len; j++) {
+                names[i][j] = 'a' + (i * 13 + j * 7) % 26;
+            }
+            names[i][len] = '\0';
+        }
+        pos += wfs_put_dentry((struct wfs_dentry *)pos, names[i], i + 1);
+    }
+    dir->inode.mode = S_IFDIR | 0755;
+    dir->inode.size = pos - dir->data;
+
+    begin_workload(LOOKUP_PASSES);
+    double begin = now_us();
+    for (unsigned int pass = 0; pass < LOOKUP_PASSES; pass++) {
+        double start = now_us();
+        for (unsigned int i = 0; i < WFS_DIR_INLINE_MAX; i++) {
+            uint32_t inode;
+            if (wfs_dir_lookup(NULL, dir, names[i], &inode) != 0 || inode != i + 1) {
+                fprintf(stderr, "Looking up %s found the wrong name\n", names[i]);
+                return -1;
+            }
+        }
+        samples[sample_count++] = now_us() - start;
+    }
+    report(workload, 0, 0, (now_us() - begin) / 1e6, 0);
+    return 0;
+}
+
+// Drop the image's pages from the page cache, so the next mount reads it from the disk.
+// Unless clear_checkpoint is set, that mount loads the checkpoint the unmount wrote.
+int cool_image(int clear_checkpoint) {
+    int fd = open(disk_path, O_RDWR);
+    if (fd == -1) {
+        perror("Error opening image");
+        return -1;
+    }
+    if (clear_checkpoint) {
+        struct wfs_sb sb;
+        if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+            perror("Error reading superblock");
+            close(fd);
+            return -1;
+        }
+        sb.checkpoint = 0;
+        if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+            perror("Error writing superblock");
+            close(fd);
+            return -1;
+        }
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return 0;
+}
+
+// Read back one of two files whose writes were interleaved, on a fresh mount of the image out
+// of the page cache, without and then with the mount prefetching the log behind it
+int bench_cold_reads(char *buf, unsigned int log_mb, unsigned int depth) {
+    char paths[2][512];
+    int fds[2];
+    unsigned int chunks = 512 * scale;     // 64 MiB each per unit of scale
+    for (int f = 0; f < 2; f++) {
+        snprintf(paths[f], sizeof(paths[f]), "%s/interleaved%d", mount_path, f);
+        fds[f] = open(paths[f], O_WRONLY | O_CREAT, 0644);
+        if (fds[f] == -1) {
+            perror("Error creating interleaved file");
+            if (f == 1) {
+                close(fds[0]);
+            }
+            return -1;
+        }
+    }
+    int ret = 0;
+    for (unsigned int i = 0; i < chunks && ret == 0; i++) {
+        for (int f = 0; f < 2 && ret == 0; f++) {
+            stamp(buf, IO_SIZE);
+            if (pwrite(fds[f], buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE) {
+                perror("Error writing interleaved file");
+                ret = -1;
+            }
+        }
+    }
+    for (int f = 0; f < 2; f++) {
+        fsync(fds[f]);
+        close(fds[f]);
+    }
+
+    const char *workloads[] = {"cold_read_noprefetch", "cold_read"};
+    const char *options[] = {"readahead_bytes=0", NULL};
+    for (int pass = 0; pass < 2 && ret == 0; pass++) {
+        unmount();
+        extra_option = options[pass];
+        ret = cool_image(0) == 0 ? mount_image() : -1;
+        extra_option = NULL;
+        if (ret != 0) {
+            break;
+        }
+        int fd = open(paths[0], O_RDONLY);
+        if (fd == -1) {
+            perror("Error opening interleaved file");
+            return -1;
+        }
+        begin_workload(chunks);
+        double begin = now_us();
+        for (unsigned int i = 0; i < chunks; i++) {
+            double start = now_us();
+            if (pread(fd, buf, IO_SIZE, (off_t)i * IO_SIZE) != IO_SIZE) {
+                perror("Error reading interleaved file");
+                close(fd);
+                return -1;
+            }
+            samples[sample_count++] = now_us() - start;
+        }
+        report(workloads[pass], log_mb, depth, (now_us() - begin) / 1e6, (uint64_t)chunks * IO_SIZE);
+        close(fd);
+    }
+    return ret;
+}
+
+// Unmount, cool the image and time mounting it again
+int bench_mount(const char *workload, int clear_checkpoint, unsigned int log_mb, unsigned int depth) {
+    unmount();
+    if (cool_image(clear_checkpoint) != 0) {
+        return -1;
+    }
+    begin_workload(1);
+    double begin = now_us();
+    if (mount_image() != 0) {
+        return -1;
+    }
+    samples[sample_count++] = now_us() - begin;
+    report(workload, log_mb, depth, (now_us() - begin) / 1e6, 0);
+    return 0;
+}
+
+// Fill the image from head to dirty_end, the furthest a transaction in flight could have
+// written, with garbage; an image from before dirty_end was kept gets it up to its end
+int plant_garbage() {
+    char garbage[OVERWRITE_SIZE];
+    int fd = open(disk_path, O_RDWR);
+    struct wfs_sb sb;
+    if (fd == -1 || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        perror("Error reading superblock");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint64_t end = sb.dirty_end && sb.dirty_end < sb.disk_size ? sb.dirty_end : sb.disk_size;
+    memset(garbage, GARBAGE_BYTE, sizeof(garbage));
+    for (uint64_t offset = sb.head; offset < end; offset += sizeof(garbage)) {
+        size_t len = end - offset < sizeof(garbage) ? end - offset : sizeof(garbage);
+        if (pwrite(fd, garbage, len, offset) != (ssize_t)len) {
+            perror("Error writing garbage");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Kill the mount as a crash would, plant garbage past head and time mounting the image
+// again. New entries are written over that free space, so make some and check them.
+int bench_crash(unsigned int log_mb, unsigned int depth) {
+    kill(mount_pid, SIGKILL);
+    waitpid(mount_pid, NULL, 0);
+    mount_pid = -1;
+    char *umount_argv[] = {"fusermount", "-u", mount_path, NULL};
+    if (run(umount_argv) != 0 || plant_garbage() != 0) {
+        return -1;
+    }
+
+    begin_workload(1);
+    double begin = now_us();
+    if (mount_image() != 0) {
+        return -1;
+    }
+    samples[sample_count++] = now_us() - begin;
+    report("crash_mount", log_mb, depth, (now_us() - begin) / 1e6, 0);
+
+    char path[512];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/crash", mount_path);
+    if (mkdir(path, 0755) == -1 || stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Directory made after recovery is broken\n");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/crash/file", mount_path);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != 0) {
+        fprintf(stderr, "File made after recovery is broken\n");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Print how many bytes of log the file data written so far took, from the mount's statistics
+void report_capacity(unsigned int log_mb) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/.wfs_stats", mount_path);
+    FILE *stats = fopen(path, "r");
+    if (!stats) {
+        return;
+    }
+    char name[64];
+    double value, written = 0, stored = 0, chunks = 0, shared = 0, dedup_ms = 0;
+    while (fscanf(stats, "%63s %lf", name, &value) == 2) {
+        if (strcmp(name, "data_written") == 0) {
+            written = value;
+        } else if (strcmp(name, "data_stored") == 0) {
+            stored = value;
+        } else if (strcmp(name, "dedup_chunks") == 0) {
+            chunks = value;
+        } else if (strcmp(name, "dedup_shared") == 0) {
+            shared = value;
+        } else if (strcmp(name, "dedup_ms") == 0) {
+            dedup_ms = value;
+        }
+    }
+    fclose(stats);
+    if (written > 0) {
+        fprintf(stderr, "Log %u MB, %s image: %.1f MB of file data took %.1f MB of log (%.0f%%)", log_mb, image->name,
+                written / 1e6, stored / 1e6, 100.0 * stored / written);
+        if (chunks > 0) {
+            fprintf(stderr, ", %.0f of %.0f chunks shared, %.1f ms fingerprinting", shared, chunks, dedup_ms);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+int bench_config(unsigned int log_mb, unsigned int depth, char *buf) {
+    unsigned int files = 2000 * scale;
+    char dir[512];
+    fprintf(stderr, "Log %u MB, depth %u\n", log_mb, depth);
+
+    if (fill_log(log_mb, buf) != 0 || make_tree(depth, dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    if (bench_creates(dir, files, log_mb, depth) != 0 ||
+        bench_stats(dir, files, 20000 * scale, log_mb, depth) != 0 ||
+        bench_stat_storm(dir, 100000 * scale, log_mb, depth) != 0 ||
+        bench_readdir(dir, log_mb, depth) != 0) {
+        return -1;
+    }
+    // Data paths do not depend on the tree, so they run once per log size
+    if (depth == depths[0]) {
+        if (bench_data(buf, log_mb, depth) != 0 || (mount_pid != -1 && check_size_limit() != 0)) {
+            return -1;
+        }
+        report_capacity(log_mb);
+    }
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s scale] [-c] [-D] [-u] [-b] [-o mount_options] [-w work_dir] [-d existing_dir]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *existing_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:cDubo:w:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            scale = atoi(optarg);
+            break;
+        case 'c':
+            images[1].wanted = 1;
+            text_data = 1;
+            break;
+        case 'D':
+            images[2].wanted = 1;
+            break;
+        case 'u':
+            images[3].wanted = 1;
+            break;
+        case 'b':
+            images[4].wanted = 1;
+            break;
+        case 'o':
+            mount_options = optarg;
+            break;
+        case 'w':
+            work_dir = optarg;
+            break;
+        case 'd':
+            existing_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (scale == 0 || optind != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *buf = malloc(IO_SIZE);
+    if (!buf) {
+        perror("Error allocating buffer");
+        return EXIT_FAILURE;
+    }
+    // Compression is compared on text made of common words, as random bytes never compress
+    static const char *words[] = {"the", "of", "and", "log", "file", "data", "entry", "write", "read", "block", "inode", "directory", "\n"};
+    for (unsigned int i = 0; i < IO_SIZE; i++) {
+        buf[i] = rand();
+    }
+    for (unsigned int i = 0; text_data && i < IO_SIZE;) {
+        const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+        for (unsigned int j = 0; word[j] && i < IO_SIZE; j++) {
+            buf[i++] = word[j];
+        }
+        if (i < IO_SIZE) {
+            buf[i++] = ' ';
+        }
+    }
+
+    printf("workload,image,log_mb,depth,ops,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us\n");
+    int ret = 0;
+
+    // Against another filesystem there is no image to size, so only the depths vary
+    if (existing_dir) {
+        for (unsigned int d = 0; d < sizeof(depths) / sizeof(depths[0]) && ret == 0; d++) {
+            snprintf(mount_path, sizeof(mount_path), "%s/bench_%u", existing_dir, depths[d]);
+            if (mkdir(mount_path, 0755) == -1) {
+                perror("Error creating benchmark directory");
+                ret = -1;
+                break;
+            }
+            ret = bench_config(0, depths[d], buf);
+        }
+        free(buf);
+        free(samples);
+        return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    snprintf(disk_path, sizeof(disk_path), "%s/disk", work_dir);
+    snprintf(mount_path, sizeof(mount_path), "%s/mnt", work_dir);
+    if ((mkdir(work_dir, 0755) == -1 && errno != EEXIST) || (mkdir(mount_path, 0755) == -1 && errno != EEXIST)) {
+        perror("Error creating work directory");
+        free(buf);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_lookup("dir_lookup", 0) != 0 || bench_lookup("dir_lookup_prefix", 1) != 0) {
+        ret = -1;
+    }
+    for (image = images; image < images + sizeof(images) / sizeof(images[0]) && ret == 0; image++) {
+        if (!image->wanted) {
+            continue;
+        }
+        for (unsigned int l = 0; l < sizeof(log_sizes_mb) / sizeof(log_sizes_mb[0]) && ret == 0; l++) {
+            for (unsigned int d = 0; d < sizeof(depths) / sizeof(depths[0]) && ret == 0; d++) {
+                if (mount_fresh() != 0) {
+                    ret = -1;
+                    break;
+                }
+                ret = bench_config(log_sizes_mb[l] * scale, depths[d], buf);
+                if (ret == 0 && d == sizeof(depths) / sizeof(depths[0]) - 1) {
+                    unsigned int log_mb = log_sizes_mb[l] * scale;
+                    if (bench_cold_reads(buf, log_mb, depths[d]) != 0 ||
+                        bench_mount("mount_checkpoint", 0, log_mb, depths[d]) != 0 ||
+                        bench_mount("mount_scan", 1, log_mb, depths[d]) != 0 ||
+                        bench_crash(log_mb, depths[d]) != 0) {
+                        ret = -1;
+                    }
+                }
+                unmount();
+            }
+        }
+    }
+
+    unlink(disk_path);
+    free(buf);
+    free(samples);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "wfs.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s disk_path\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd == -1) {
+        perror("Error opening disk file");
+        return EXIT_FAILURE;
+    }
+
+    // Maps the image and completes a compaction that a crash interrupted
+    size_t disk_size;
+    struct wfs_sb *superblock = wfs_map(fd, &disk_size, 0);
+    if (!superblock) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    struct wfs_compact_stats stats;
+    if (wfs_compact(superblock, disk_size, &stats) != 0) {
+        fprintf(stderr, "Compaction failed\n");
+        munmap(superblock, disk_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    printf("Compacted log from %lu to %lu bytes (%u live entries, %u dead) in %.3f ms, %.1f MB/s\n",
+           stats.bytes_before, stats.bytes_after, stats.live_entries, stats.dead_entries,
+           stats.seconds * 1e3, stats.seconds > 0 ? stats.bytes_before / stats.seconds / 1e6 : 0.0);
+
+    munmap(superblock, disk_size);
+    close(fd);
+    return EXIT_SUCCESS;
+}
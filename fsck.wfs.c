@@ -1,7 +1,617 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wfs.h"
+
+// fsck.wfs checks an image without changing it. A single sequential pass over the log checks
+// that every entry lies within head, verifies the transactions and rebuilds the inode table.
+// Worker threads then validate inodes in chunks: extent chains, directory pages, dentries that
+// name missing inodes and duplicate names. Last, every live inode must be reachable from the
+// root through the parents the workers recorded.
+#define MAX_ERRORS_SHOWN 100
+#define INODE_CHUNK 1024
+#define NO_PARENT UINT32_MAX
+
+struct wfs_sb *sb = NULL;
+size_t disk_size = 0;
+
+uint64_t *latest = NULL;        // inode -> offset of its latest version, 0 if none
+uint64_t *entries = NULL;       // offset of every entry but commit records, in log order
+uint64_t entry_count = 0;
+uint32_t *parents = NULL;       // inode -> directory that names it
+unsigned int inode_count = 0;
+
+unsigned int next_chunk = 0;    // next INODE_CHUNK of inodes a worker takes
+unsigned int errors = 0;
+unsigned int live_files = 0;
+unsigned int live_dirs = 0;
+uint64_t names = 0;
+
+void report(const char *format, ...) {
+    if (__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED) > MAX_ERRORS_SHOWN) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+double seconds_since(struct timespec *begin) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+// Pass 1: parse the log front to back. Anything past a damaged entry cannot be parsed, so
+// the pass stops there.
+// The checkpoint's table must be what the log below it says, which latest[] holds when the
+// scan reaches its head
+void check_checkpoint(struct wfs_checkpoint *checkpoint) {
+    unsigned int wrong = 0;
+    for (uint32_t inode = 0; inode < checkpoint->count || inode < inode_count; inode++) {
+        uint64_t saved = inode < checkpoint->count ? checkpoint->offsets[inode] : 0;
+        uint64_t actual = inode < inode_count ? latest[inode] : 0;
+        wrong += saved != actual;
+    }
+    if (wrong > 0) {
+        report("Checkpoint at %lu disagrees with the log about %u inodes\n", sb->checkpoint, wrong);
+    }
+}
+
+int scan_log(uint64_t *transactions) {
+    uint64_t offset = wfs_log_start(sb);
+    struct wfs_checkpoint *checkpoint = wfs_checkpoint_at(sb, sb->head);
+    if (sb->checkpoint != 0 && !checkpoint) {
+        report("The checkpoint at %lu is damaged\n", sb->checkpoint);
+    }
+    uint64_t base = wfs_compact_base(sb);
+    uint64_t txn_end = sb->txn_start > base ? sb->txn_start : base;   // end of the transaction being read
+    uint64_t pinned_end = 0;            // likewise below base, where snapshots keep old transactions
+    size_t entries_size = 0;
+
+    while (offset < sb->head) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)sb + offset);
+        __builtin_prefetch((char *)entry + WFS_SCAN_AHEAD);
+        if (checkpoint && offset == checkpoint->head) {
+            check_checkpoint(checkpoint);
+            checkpoint = NULL;
+        }
+        if (sb->head - offset < sizeof(struct wfs_log_entry)) {
+            report("Entry at %lu runs past head %lu\n", offset, sb->head);
+            return -EINVAL;
+        }
+        if (entry->inode.flags & ~(WFS_INODE_EXTENTS | WFS_INODE_DATA | WFS_INODE_PAGED | WFS_INODE_COMMIT | WFS_INODE_COMPRESSED | WFS_INODE_CHECKPOINT)) {
+            report("Entry at %lu has unknown flags %#x\n", offset, entry->inode.flags);
+            return -EINVAL;
+        }
+        if ((entry->inode.flags & WFS_INODE_COMPRESSED) &&
+            (entry->inode.flags != (WFS_INODE_DATA | WFS_INODE_COMPRESSED) || entry->inode.size < sizeof(struct wfs_block))) {
+            report("Compressed record at %lu is malformed\n", offset);
+        }
+        uint64_t len = wfs_entry_len(entry);
+        if (len > sb->head - offset) {
+            report("Entry at %lu (%lu bytes) runs past head %lu\n", offset, len, sb->head);
+            return -EINVAL;
+        }
+        if (len < sizeof(struct wfs_log_entry) || len % WFS_ALIGN != 0 || len != wfs_content_len(entry)) {
+            report("Entry at %lu records a length of %lu bytes, not the %u it holds\n", offset, len, wfs_content_len(entry));
+            return -EINVAL;
+        }
+
+        if (entry->inode.flags & WFS_INODE_COMMIT) {
+            struct wfs_commit *commit = (struct wfs_commit *)entry->data;
+            if (offset < base ? offset < pinned_end : offset != txn_end) {
+                report("Commit record at %lu is not at a transaction boundary\n", offset);
+                return -EINVAL;
+            }
+            if (entry->inode.size != sizeof(struct wfs_commit) || commit->magic != WFS_COMMIT_MAGIC ||
+                commit->len > sb->head - offset - WFS_COMMIT_LEN) {
+                report("Commit record at %lu is damaged\n", offset);
+                return -EINVAL;
+            }
+            if (wfs_checksum((char *)entry + WFS_COMMIT_LEN, commit->len, wfs_commit_seed(commit)) != commit->checksum) {
+                report("Transaction at %lu fails its checksum\n", offset);
+            }
+            if (offset >= base) {
+                txn_end = offset + WFS_COMMIT_LEN + commit->len;
+            } else if ((pinned_end = offset + WFS_COMMIT_LEN + commit->len) > base) {
+                report("Transaction at %lu runs past the end of the newest snapshot\n", offset);
+            }
+            (*transactions)++;
+            offset += len;
+            continue;
+        }
+        uint64_t end = offset < base ? pinned_end : txn_end;
+        if (offset >= sb->txn_start && offset >= end) {
+            report("Entry at %lu is outside any transaction\n", offset);
+            return -EINVAL;
+        }
+        if (offset < end && offset + len > end) {
+            report("Entry at %lu crosses the end of its transaction\n", offset);
+            return -EINVAL;
+        }
+
+        if (entry_count == entries_size) {
+            entries_size = entries_size ? entries_size * 2 : 65536;
+            uint64_t *grown = realloc(entries, entries_size * sizeof(uint64_t));
+            if (!grown) {
+                perror("Error allocating entry list");
+                return -ENOMEM;
+            }
+            entries = grown;
+        }
+        entries[entry_count++] = offset;
+
+        if (wfs_is_version(entry)) {
+            if (entry->inode.inode_number >= inode_count) {
+                report("Entry at %lu is for inode %u, past the allocation mark %u\n", offset, entry->inode.inode_number, inode_count);
+            } else {
+                latest[entry->inode.inode_number] = offset;
+            }
+        }
+        offset += len;
+    }
+
+    if (txn_end > sb->head) {
+        report("Transaction ending at %lu runs past head %lu\n", txn_end, sb->head);
+    }
+    if (checkpoint) {
+        report("The checkpoint at %lu covers the log below %lu, where no entry starts\n", sb->checkpoint, checkpoint->head);
+    }
+    return 0;
+}
+
+// The entry that holds the image offset, or NULL
+struct wfs_log_entry *entry_at(uint64_t offset) {
+    uint64_t low = 0;
+    uint64_t high = entry_count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (entries[mid] <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)sb + entries[low - 1]);
+    return offset < entries[low - 1] + wfs_entry_len(entry) ? entry : NULL;
+}
+
+// A compressed extent must point at a whole block record of the file that decompresses to at
+// least the bytes it covers. *scratch is a block-sized buffer allocated on first use.
+void check_block(unsigned int inode, struct wfs_extent *extent, struct wfs_log_entry *holder, char **scratch) {
+    uint64_t start = extent->block & ~WFS_EXTENT_COMPRESSED;
+    if (!holder || holder->inode.inode_number != inode || (uint64_t)((char *)holder - (char *)sb) != extent->log_offset ||
+        holder->inode.flags != (WFS_INODE_DATA | WFS_INODE_COMPRESSED) || holder->inode.size < sizeof(struct wfs_block)) {
+        report("Inode %u: compressed extent at file offset %lu does not point at a block of the file\n", inode, extent->file_offset);
+        return;
+    }
+    struct wfs_block *block = (struct wfs_block *)holder->data;
+    if (block->length > WFS_BLOCK_SIZE || start + extent->length > block->length) {
+        report("Inode %u: compressed extent at file offset %lu runs past its block\n", inode, extent->file_offset);
+        return;
+    }
+    if (!*scratch && !(*scratch = malloc(WFS_BLOCK_SIZE))) {
+        return;
+    }
+    if (wfs_decompress(block->bytes, holder->inode.size - sizeof(struct wfs_block), *scratch, block->length) != (int)block->length) {
+        report("Inode %u: compressed block at %lu does not decompress\n", inode, extent->log_offset);
+    }
+}
+
+void check_file(struct wfs_log_entry *file) {
+    unsigned int inode = file->inode.inode_number;
+    if (!(file->inode.flags & WFS_INODE_EXTENTS)) {
+        return;
+    }
+
+    struct wfs_extent *extents;
+    uint32_t count;
+    if (wfs_collect_extents(sb, file, &extents, &count) != 0) {
+        report("Inode %u: damaged extent chain\n", inode);
+        return;
+    }
+
+    // Each extent must lie in the data of one entry of this file, or in what a compressed block
+    // of it decompresses to. With deduplication it may lie in a data record of another file.
+    int dedup = (sb->features & WFS_FEATURE_DEDUP) != 0;
+    char *block_bytes = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        struct wfs_extent *extent = &extents[i];
+        struct wfs_log_entry *holder = entry_at(extent->log_offset);
+        if (extent->file_offset + extent->length > file->inode.size) {
+            report("Inode %u: extent at file offset %lu runs past the file size %u\n", inode, extent->file_offset, file->inode.size);
+        }
+        if (extent->block & WFS_EXTENT_COMPRESSED) {
+            check_block(inode, extent, holder, &block_bytes);
+        } else if (!holder || (holder->inode.inode_number != inode && !(dedup && holder->inode.flags == WFS_INODE_DATA)) ||
+            extent->log_offset < (uint64_t)(holder->data - (char *)sb) ||
+            extent->log_offset + extent->length > (uint64_t)((char *)holder - (char *)sb) + wfs_entry_len(holder)) {
+            report("Inode %u: extent at file offset %lu points outside the file's data\n", inode, extent->file_offset);
+        }
+    }
+    free(block_bytes);
+    free(extents);
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp((*(struct wfs_dentry *const *)a)->name, (*(struct wfs_dentry *const *)b)->name);
+}
+
+// Set *dentries to the dentries packed into bytes bytes at start, and *count to how many there
+// are. Returns -EINVAL if they do not fill exactly those bytes or one is malformed.
+int collect_dentries(char *start, uint32_t bytes, struct wfs_dentry ***dentries, uint32_t *count) {
+    *count = 0;
+    *dentries = malloc((bytes / WFS_ALIGN + 1) * sizeof(struct wfs_dentry *));
+    if (!*dentries) {
+        return -ENOMEM;
+    }
+    for (uint32_t pos = 0; pos < bytes;) {
+        struct wfs_dentry *dentry = (struct wfs_dentry *)(start + pos);
+        if (bytes - pos < offsetof(struct wfs_dentry, name) + 1 || dentry->name_len == 0 || dentry->name_len >= MAX_FILE_NAME_LEN ||
+            wfs_dentry_len(dentry->name_len) > bytes - pos || dentry->name[dentry->name_len] != '\0' ||
+            memchr(dentry->name, '\0', dentry->name_len) != NULL) {
+            free(*dentries);
+            *dentries = NULL;
+            return -EINVAL;
+        }
+        (*dentries)[(*count)++] = dentry;
+        pos += wfs_dentry_len(dentry->name_len);
+    }
+    return 0;
+}
+
+void check_dentries(unsigned int dir, struct wfs_dentry **dentries, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        struct wfs_dentry *dentry = dentries[i];
+        uint32_t child = dentry->inode_number;
+        if (child >= inode_count || latest[child] == 0 || ((struct wfs_log_entry *)((char *)sb + latest[child]))->inode.deleted) {
+            report("Directory %u: %s names inode %u, which does not exist\n", dir, dentry->name, child);
+            continue;
+        }
+        if (child == 0) {
+            report("Directory %u: %s names the root\n", dir, dentry->name);
+            continue;
+        }
+
+        uint32_t expected = NO_PARENT;
+        if (!__atomic_compare_exchange_n(&parents[child], &expected, dir, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && expected != dir) {
+            report("Inode %u is named by both directory %u and directory %u\n", child, expected, dir);
+        }
+    }
+
+    // Lookups only ever find the last of two dentries with the same name
+    qsort(dentries, count, sizeof(struct wfs_dentry *), compare_names);
+    for (uint32_t i = 1; i < count; i++) {
+        if (compare_names(&dentries[i - 1], &dentries[i]) == 0) {
+            report("Directory %u: %s appears more than once\n", dir, dentries[i]->name);
+        }
+    }
+}
+
+void check_dir(struct wfs_log_entry *dir) {
+    unsigned int inode = dir->inode.inode_number;
+    struct wfs_dentry **dentries;
+    uint32_t count;
+
+    if (!(dir->inode.flags & WFS_INODE_PAGED)) {
+        int ret = collect_dentries(dir->data, dir->inode.size, &dentries, &count);
+        if (ret == -ENOMEM) {
+            report("Directory %u: out of memory\n", inode);
+            return;
+        }
+        if (ret != 0) {
+            report("Directory %u: size %u does not hold whole, well-formed dentries\n", inode, dir->inode.size);
+            return;
+        }
+        __atomic_add_fetch(&names, count, __ATOMIC_RELAXED);
+        check_dentries(inode, dentries, count);
+        free(dentries);
+        return;
+    }
+
+    struct wfs_dir_index *index = (struct wfs_dir_index *)dir->data;
+    if (index->global_depth > WFS_DIR_MAX_GLOBAL_DEPTH) {
+        report("Directory %u: damaged index\n", inode);
+        return;
+    }
+    __atomic_add_fetch(&names, index->entries, __ATOMIC_RELAXED);
+    uint32_t slots = 1u << index->global_depth;
+    uint64_t *pages = calloc(slots, sizeof(uint64_t));
+    if (!pages) {
+        report("Directory %u: out of memory\n", inode);
+        return;
+    }
+    if (wfs_dir_slots(sb, dir, pages) != 0) {
+        report("Directory %u: damaged index chain\n", inode);
+        free(pages);
+        return;
+    }
+
+    // Visit every page once, from the first slot it serves
+    uint32_t found = 0;
+    uint64_t found_bytes = 0;
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        if (pages[slot] == 0) {
+            continue;
+        }
+        struct wfs_log_entry *page_entry = entry_at(pages[slot]);
+        if (!page_entry || (char *)page_entry - (char *)sb != pages[slot] || !(page_entry->inode.flags & WFS_INODE_DATA) ||
+            page_entry->inode.inode_number != inode) {
+            report("Directory %u: slot %u points at %lu, which is not one of its pages\n", inode, slot, pages[slot]);
+            continue;
+        }
+        struct wfs_dir_page *page = (struct wfs_dir_page *)page_entry->data;
+        uint32_t mask = (1u << page->local_depth) - 1;
+        if (page->local_depth > index->global_depth || page_entry->inode.size < sizeof(struct wfs_dir_page)) {
+            report("Directory %u: page at %lu is damaged\n", inode, pages[slot]);
+            continue;
+        }
+        if (pages[slot & mask] != pages[slot]) {
+            report("Directory %u: slots %u and %u should share page %lu\n", inode, slot & mask, slot, pages[slot]);
+        }
+        if (slot > mask) {
+            continue;
+        }
+
+        uint32_t bytes = page_entry->inode.size - sizeof(struct wfs_dir_page);
+        int ret = collect_dentries(page->dentries, bytes, &dentries, &count);
+        if (ret == 0 && count != page->count) {
+            free(dentries);
+            ret = -EINVAL;
+        }
+        if (ret != 0) {
+            report("Directory %u: page at %lu is damaged\n", inode, pages[slot]);
+            continue;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if ((wfs_name_hash(dentries[i]->name) & mask) != slot) {
+                report("Directory %u: %s is in the page for slot %u but hashes elsewhere\n", inode, dentries[i]->name, slot);
+            }
+        }
+        check_dentries(inode, dentries, count);
+        free(dentries);
+        found += count;
+        found_bytes += bytes;
+    }
+    free(pages);
+
+    if (found != index->entries) {
+        report("Directory %u: pages hold %u names, index says %u\n", inode, found, index->entries);
+    }
+    if (found_bytes != dir->inode.size) {
+        report("Directory %u: pages hold %lu bytes of dentries, size says %u\n", inode, found_bytes, dir->inode.size);
+    }
+}
+
+// Pass 2: validate the latest version of every inode, INODE_CHUNK inodes at a time
+void *check_inodes(void *arg) {
+    while (1) {
+        unsigned int first = __atomic_fetch_add(&next_chunk, INODE_CHUNK, __ATOMIC_RELAXED);
+        if (first >= inode_count) {
+            return NULL;
+        }
+        unsigned int last = first + INODE_CHUNK < inode_count ? first + INODE_CHUNK : inode_count;
+
+        for (unsigned int inode = first; inode < last; inode++) {
+            if (latest[inode] == 0) {
+                continue;
+            }
+            struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)sb + latest[inode]);
+            if (entry->inode.deleted) {
+                continue;
+            }
+
+            if (S_ISDIR(entry->inode.mode)) {
+                __atomic_add_fetch(&live_dirs, 1, __ATOMIC_RELAXED);
+                check_dir(entry);
+            } else if (S_ISREG(entry->inode.mode)) {
+                __atomic_add_fetch(&live_files, 1, __ATOMIC_RELAXED);
+                check_file(entry);
+            } else {
+                report("Inode %u has unknown mode %o\n", inode, entry->inode.mode);
+            }
+        }
+    }
+}
+
+// Pass 3: follow parents up to the root. state is 0 unvisited, 1 on the current path,
+// 2 reachable, 3 not.
+void check_reachable() {
+    unsigned char *state = calloc(inode_count, 1);
+    unsigned int *path = malloc(inode_count * sizeof(unsigned int));
+    if (!state || !path) {
+        perror("Error allocating reachability state");
+        free(state);
+        free(path);
+        return;
+    }
+    if (inode_count > 0) {
+        state[0] = 2;
+    }
+
+    for (unsigned int inode = 1; inode < inode_count; inode++) {
+        if (latest[inode] == 0 || ((struct wfs_log_entry *)((char *)sb + latest[inode]))->inode.deleted || state[inode]) {
+            continue;
+        }
+
+        unsigned int length = 0;
+        unsigned int current = inode;
+        while (state[current] == 0) {
+            state[current] = 1;
+            path[length++] = current;
+            if (parents[current] == NO_PARENT) {
+                break;
+            }
+            current = parents[current];
+        }
+        // Stopping on the path means a cycle or an inode no directory names
+        unsigned char result = state[current] == 2 ? 2 : 3;
+
+        for (unsigned int i = 0; i < length; i++) {
+            state[path[i]] = result;
+            if (result == 3) {
+                report("Inode %u is not reachable from the root\n", path[i]);
+            }
+        }
+    }
+    free(state);
+    free(path);
+}
+
+// A snapshot must end inside the log, after the version of the root directory it names
+void check_snapshots() {
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        struct wfs_snapshot *snapshot = &sb->snapshots[i];
+        if (snapshot->id == 0) {
+            continue;
+        }
+        if (snapshot->head < wfs_log_start(sb) || snapshot->head > sb->head) {
+            report("Snapshot %u ends at %lu, outside the log\n", snapshot->id, snapshot->head);
+            continue;
+        }
+        struct wfs_log_entry *root = entry_at(snapshot->root);
+        if (!root || (uint64_t)((char *)root - (char *)sb) != snapshot->root || snapshot->root >= snapshot->head ||
+            !wfs_is_version(root) || root->inode.inode_number != 0 || !S_ISDIR(root->inode.mode)) {
+            report("Snapshot %u: %lu is not a version of the root directory before its end\n", snapshot->id, snapshot->root);
+        }
+    }
+}
 
 int main(int argc, char *argv[]) {
-    exit(1);
-}
\ No newline at end of file
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-j threads] disk_path\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-j threads] disk_path\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening disk file");
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading disk size");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    disk_size = st.st_size;
+    if (disk_size < WFS_SB_SIZE) {
+        fprintf(stderr, "Disk file too small to hold a superblock\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    sb = mmap(NULL, disk_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (sb == MAP_FAILED) {
+        perror("Error mapping disk file");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    madvise(sb, disk_size, MADV_SEQUENTIAL);
+
+    // Older images are upgraded when they are opened for writing; this only reads
+    if (sb->magic != WFS_MAGIC || sb->version > WFS_VERSION) {
+        fprintf(stderr, "Not a WFS image or unsupported version\n");
+        munmap(sb, disk_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->version < WFS_VERSION) {
+        fprintf(stderr, "Version %u image; mount or compact it once to upgrade it before checking\n", sb->version);
+        munmap(sb, disk_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->head < wfs_log_start(sb) || sb->head > disk_size || sb->txn_start < wfs_log_start(sb) || sb->txn_start > sb->head) {
+        fprintf(stderr, "Superblock is damaged: head %lu, transactions from %lu, image %lu bytes\n", sb->head, sb->txn_start, disk_size);
+        munmap(sb, disk_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->compact_src != 0) {
+        printf("A compaction is pending; it completes the next time the image is opened\n");
+    }
+
+    inode_count = sb->next_inode;
+    latest = calloc(inode_count, sizeof(uint64_t));
+    parents = malloc(inode_count * sizeof(uint32_t));
+    if (!latest || !parents) {
+        perror("Error allocating inode table");
+        munmap(sb, disk_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    memset(parents, 0xff, inode_count * sizeof(uint32_t));
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t transactions = 0;
+    int ret = scan_log(&transactions);
+    double scan_seconds = seconds_since(&begin);
+    uint64_t log_bytes = sb->head - wfs_log_start(sb);
+    printf("Scanned %lu entries in %lu transactions (%.1f MB) in %.3f ms, %.1f MB/s\n", entry_count, transactions,
+           log_bytes / 1e6, scan_seconds * 1e3, scan_seconds > 0 ? log_bytes / scan_seconds / 1e6 : 0.0);
+
+    if (ret == 0) {
+        if (inode_count == 0 || latest[0] == 0 || !S_ISDIR(((struct wfs_log_entry *)((char *)sb + latest[0]))->inode.mode)) {
+            report("The root directory is missing\n");
+        }
+        check_snapshots();
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        pthread_t *workers = malloc(threads * sizeof(pthread_t));
+        int started = 0;
+        while (workers && started < threads && pthread_create(&workers[started], NULL, check_inodes, NULL) == 0) {
+            started++;
+        }
+        if (started == 0) {
+            check_inodes(NULL);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+        check_reachable();
+        printf("Checked %u files and %u directories holding %lu names with %d threads in %.3f ms\n",
+               live_files, live_dirs, names, started ? started : 1, seconds_since(&begin) * 1e3);
+    }
+
+    if (errors > MAX_ERRORS_SHOWN) {
+        fprintf(stderr, "... and %u more\n", errors - MAX_ERRORS_SHOWN);
+    }
+    if (errors == 0) {
+        printf("%s: clean\n", argv[optind]);
+    } else {
+        printf("%s: %u errors\n", argv[optind], errors);
+    }
+
+    free(latest);
+    free(parents);
+    free(entries);
+    munmap(sb, disk_size);
+    close(fd);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -8,18 +8,63 @@
 #include <sys/stat.h>
 #include "wfs.h"
 
-#define DISK_SIZE 1048576  // Example size, e.g., 1MB
+#define DISK_SIZE 1048576  // Default size, 1MB; mount.wfs grows the image as the log fills
+
+// Parse a size such as 1048576, 512K, 64M or 20G
+size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        // fall through
+    case 'M': case 'm':
+        size *= 1024;
+        // fall through
+    case 'K': case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : 0;
+}
 
 int main(int argc, char *argv[]) {
     printf("Program started.\n");
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s disk_path\n", argv[0]);
+    // -c: compress file data (see WFS_FEATURE_COMPRESS), -d: share identical chunks of it (see
+    // WFS_FEATURE_DEDUP); fixed for the life of the image
+    uint64_t features = 0;
+    int bad_option = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "cd")) != -1) {
+        if (opt == 'c') {
+            features |= WFS_FEATURE_COMPRESS;
+        } else if (opt == 'd') {
+            features |= WFS_FEATURE_DEDUP;
+        } else {
+            bad_option = 1;
+        }
+    }
+
+    if (bad_option || (argc - optind != 1 && argc - optind != 2)) {
+        fprintf(stderr, "Usage: %s [-c | -d] disk_path [size]\n", argv[0]);
         return EXIT_FAILURE;
     }
+    if ((features & WFS_FEATURE_COMPRESS) && (features & WFS_FEATURE_DEDUP)) {
+        fprintf(stderr, "Compression and deduplication cannot be combined\n");
+        return EXIT_FAILURE;
+    }
+
+    const char *disk_path = argv[optind];
+    printf("Disk path provided: %s\n", disk_path);
 
-    const char *disk_path = argv[1];
-    printf("Disk path provided: %s\n", argv[1]);
+    const char *size_arg = argc - optind == 2 ? argv[optind + 1] : NULL;
+    size_t disk_size = size_arg ? parse_size(size_arg) : DISK_SIZE;
+    if (disk_size < sizeof(struct wfs_sb) + sizeof(struct wfs_log_entry)) {
+        fprintf(stderr, "Invalid disk size: %s\n", size_arg);
+        return EXIT_FAILURE;
+    }
 
     int fd = open(disk_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
     if (fd == -1) {
@@ -27,13 +72,15 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (ftruncate(fd, DISK_SIZE) == -1) {
+    // Start from a zeroed image so nothing stale is mistaken for log data. Truncating to zero
+    // first does that without writing every page of a large image.
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, disk_size) == -1) {
         perror("Error setting disk size");
         close(fd);
         return EXIT_FAILURE;
     }
 
-    void *disk = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *disk = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (disk == MAP_FAILED) {
         perror("Error mapping disk file");
         close(fd);
@@ -43,6 +90,10 @@ int main(int argc, char *argv[]) {
     struct wfs_sb *superblock = (struct wfs_sb *)disk;
     superblock->magic = WFS_MAGIC;
     superblock->head = sizeof(struct wfs_sb);
+    superblock->disk_size = disk_size;
+    superblock->version = WFS_VERSION;
+    superblock->next_inode = 1; // Root directory is inode 0
+    superblock->features = features;
 
     struct wfs_log_entry *emptyDirectory = (struct wfs_log_entry *)((char *)disk + sizeof(struct wfs_sb));
     emptyDirectory->inode.mode = S_IFDIR | 0755;
@@ -54,19 +105,22 @@ int main(int argc, char *argv[]) {
     emptyDirectory->inode.mtime = time(NULL);
     emptyDirectory->inode.ctime = time(NULL);
     emptyDirectory->inode.size = 0;
+    emptyDirectory->length = wfs_record_len(0);
 
-    superblock->head += sizeof(struct wfs_inode);
+    superblock->head += emptyDirectory->length;
+    superblock->txn_start = superblock->head;  // Appends from here on are transactions
+    superblock->dirty_end = superblock->head;  // and the rest of the image is zero
 
     // Synchronize the memory-mapped region with the file
-    if (msync(disk, DISK_SIZE, MS_SYNC) == -1) {
+    if (msync(disk, disk_size, MS_SYNC) == -1) {
         perror("Error syncing changes");
-        munmap(disk, DISK_SIZE);
+        munmap(disk, disk_size);
         close(fd);
         return EXIT_FAILURE;
     }
 
     // Unmap the file
-    if (munmap(disk, DISK_SIZE) == -1) {
+    if (munmap(disk, disk_size) == -1) {
         perror("Error unmapping disk file");
         close(fd);
         return EXIT_FAILURE;
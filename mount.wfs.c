@@ -1,4 +1,5 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE     // mremap
 
 #include <fuse.h>
 #include <errno.h>
@@ -7,505 +8,3904 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <linux/io_uring.h>
 #include "wfs.h"
 
-#define DISK_SIZE 1048576  // Example size, e.g., 1MB
-#define MAX_PATH_LEN 128
-
 // Forward declarations of functions that will handle filesystem operations
 static int wfs_getattr(const char *path, struct stat *stbuf);
 static int wfs_mknod(const char *path, mode_t mode, dev_t rdev);
 static int wfs_mkdir(const char *path, mode_t mode);
 static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
 static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
 static int wfs_unlink(const char *path);
+static int write_extents(struct wfs_log_entry *file_entry, struct fuse_bufvec *buf, off_t offset);
+int write_checkpoint();
 
 // Global file descriptor for the disk file
 int disk_fd = -1;
 struct wfs_sb *global_superblock = NULL;
+size_t disk_size = 0;   // bytes mapped at global_superblock, always the whole image
+int compression = 0;    // the image has WFS_FEATURE_COMPRESS, which mkfs.wfs fixes for its life
+int deduplication = 0;  // the image has WFS_FEATURE_DEDUP, likewise
+int read_only = 0;      // mounted with -o ro; the image file is never written
+int splice_reads = 0;   // the log bytes in the file never move and match the mapping (see add_reply_buf())
+
+static int locked_getattr(const char *path, struct stat *stbuf);
+static int locked_mknod(const char *path, mode_t mode, dev_t rdev);
+static int locked_mkdir(const char *path, mode_t mode);
+static int locked_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int locked_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+static int locked_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+static int locked_unlink(const char *path);
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static int wfs_flush(const char *path, struct fuse_file_info *fi);
+static int wfs_release(const char *path, struct fuse_file_info *fi);
+static int wfs_open(const char *path, struct fuse_file_info *fi);
+static void *wfs_init(struct fuse_conn_info *conn);
+static void wfs_destroy(void *private_data);
 
 // Initialize fuse_operations structure
 static struct fuse_operations ops = {
-    .getattr	= wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .read	    = wfs_read,
-    .write      = wfs_write,
-    .readdir	= wfs_readdir,
-    .unlink    	= wfs_unlink,
+    .getattr	= locked_getattr,
+    .mknod      = locked_mknod,
+    .mkdir      = locked_mkdir,
+    .open       = wfs_open,
+    .read	    = locked_read,
+    .write      = locked_write,
+    .read_buf   = locked_read_buf,
+    .write_buf  = locked_write_buf,
+    .readdir	= locked_readdir,
+    .unlink    	= locked_unlink,
+    .fsync      = wfs_fsync,
+    .flush      = wfs_flush,
+    .release    = wfs_release,
+    .init       = wfs_init,
+    .destroy    = wfs_destroy,
 };
 
-int find_new_inode() {
-    int newInode = 0;
+// Concurrency. FUSE calls in from many threads at once.
+// - Every callback holds map_lock shared. Only compaction and image growth, which move
+//   entries or the whole mapping, take it exclusively, so reads take no other lock.
+// - Appends claim their space with reserve_log(), a compare-and-swap on the superblock head,
+//   and fill it in without holding anything else.
+// - namespace_lock serializes operations that append a new directory version, and a striped
+//   inode lock serializes writes to one file, since both build on the version before.
+// - An entry becomes visible once index_entry() stores its offset into the inode table with
+//   release ordering, which happens only after the entry has been written. Entries a thread
+//   depends on (a new inode before the dentry that names it) are indexed first.
+// - Write-back buffers (see struct open_file) are appended under the inode lock, so
+//   open_files_lock comes before a handle's lock, which comes before the inode lock.
+#define INODE_LOCKS 64
+
+pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t namespace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t inode_locks[INODE_LOCKS];
+__thread size_t room_needed = 0;    // bytes the last failed reserve_log() on this thread asked for
+
+// Instrumentation. TRACE() messages follow an operation through path lookup and the log.
+// They are compiled in with -DWFS_TRACE (make TRACE=1) and printed only when the mount has
+// the trace option, so normal builds pay nothing for them. Counters are always kept: calls,
+// errors and a latency histogram for every callback and for msync, and totals for the log.
+// A running mount shows them in the read-only file /.wfs_stats, and prints them to stderr
+// on SIGUSR1.
+#ifdef WFS_TRACE
+#define TRACE(...) do { if (trace_enabled) printf(__VA_ARGS__); } while (0)
+#else
+#define TRACE(...) do { if (0) printf(__VA_ARGS__); } while (0)
+#endif
+
+#define STATS_PATH "/.wfs_stats"
+#define STATS_BUCKETS 40            // bucket b counts latencies below 2^b ns
+#define STATS_MAX_LEN 8192
+
+enum stat_kind {
+    STAT_GETATTR,
+    STAT_MKNOD,
+    STAT_MKDIR,
+    STAT_OPEN,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_READDIR,
+    STAT_UNLINK,
+    STAT_FSYNC,
+    STAT_FLUSH,
+    STAT_RELEASE,
+    STAT_MSYNC,
+    STAT_IO_SYNC,
+    STAT_KINDS,
+};
 
-    struct wfs_log_entry *start_of_log = (struct wfs_log_entry *)((char *)global_superblock + sizeof(struct wfs_sb));
-    struct wfs_log_entry *end_of_log = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    struct wfs_log_entry *current_entry = start_of_log;
+const char *stat_names[STAT_KINDS] = {
+    "getattr", "mknod", "mkdir", "open", "read", "write", "readdir", "unlink", "fsync", "flush", "release", "msync",
+    "io_sync",
+};
 
-    while (current_entry < end_of_log) {
-        // Check if the current entry is a directory or file with the correct name and inode
-        if ((current_entry->inode.inode_number > newInode)) {
-            newInode = current_entry->inode.inode_number;
+struct latency_stats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+int trace_enabled = 0;
+struct latency_stats latencies[STAT_KINDS];
+uint64_t bytes_appended = 0;        // by reserve_log(), commit records included
+uint64_t lookups = 0;               // paths resolved by looper()
+uint64_t lookup_components = 0;     // path components those walked
+uint64_t dcache_hits = 0;           // components answered by the dentry cache
+uint64_t index_rebuilds = 0;        // full log scans by build_inode_table()
+uint64_t scanned_entries = 0;       // log entries those read
+uint64_t checkpoints = 0;           // inode table checkpoints written
+uint64_t disk_grows = 0;
+uint64_t data_written = 0;          // file bytes written
+uint64_t data_stored = 0;           // log bytes the data records holding them take up
+uint64_t dedup_chunks = 0;          // whole chunks written to a WFS_FEATURE_DEDUP image
+uint64_t dedup_shared = 0;          // those that were found in the log and not stored again
+uint64_t dedup_ns = 0;              // time spent fingerprinting, looking up and comparing them
+uint64_t writeback_writes = 0;      // writes held in a write-back buffer
+uint64_t writeback_appends = 0;     // appends of buffered writes
+uint64_t readahead_bytes = 0;       // log bytes prefetched for sequential readers
+uint64_t read_cache_hits = 0;       // blocks the direct backend's read cache held
+uint64_t read_cache_misses = 0;     // and those it read from the file
+uint64_t mount_ns = 0;
+pthread_t stats_thread;
+int stats_running = 0;
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void count(uint64_t *counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// Record one call that started at start (monotonic_ns()) and returned ret
+void stats_end(enum stat_kind kind, uint64_t start, int ret) {
+    struct latency_stats *stats = &latencies[kind];
+    uint64_t ns = monotonic_ns() - start;
+    unsigned int bucket = 64 - __builtin_clzll(ns | 1);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    count(&stats->calls, 1);
+    count(&stats->total_ns, ns);
+    count(&stats->buckets[bucket], 1);
+    if (ret < 0) {
+        count(&stats->errors, 1);
+    }
+    uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Upper bound in us of the bucket holding the given fraction of calls, at most the slowest call
+double stats_percentile(struct latency_stats *stats, uint64_t calls, double fraction) {
+    uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+        seen += __atomic_load_n(&stats->buckets[b], __ATOMIC_RELAXED);
+        if (seen > 0 && seen >= calls * fraction) {
+            return ((1ull << b) < max ? (1ull << b) : max) / 1e3;
         }
-        current_entry = (struct wfs_log_entry *)((char *)current_entry + sizeof(struct wfs_log_entry) + current_entry->inode.size);
     }
+    return 0;
+}
 
-    return newInode + 1;
+int is_stats_path(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
 }
 
-struct wfs_log_entry* find_entry_by_inode(int inode) {
-    struct wfs_log_entry *start_of_log = (struct wfs_log_entry *)((char *)global_superblock + sizeof(struct wfs_sb));
-    struct wfs_log_entry *end_of_log = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    struct wfs_log_entry *current_entry = start_of_log;
-    struct wfs_log_entry *found_entry = NULL;
+// In-memory inode table: inode number -> offset of the latest log entry for that inode.
+// Built with a single log scan at mount time and kept current by index_entry() on every
+// append, so inode lookups never have to walk the log. Offset 0 is the superblock, so it
+// doubles as the "no entry" marker. Lookups read it without locks; a table that is outgrown
+// is replaced by a copy and kept on the retired list until no reader can still hold it.
+struct inode_table {
+    unsigned int len;
+    struct inode_table *retired;
+    uint64_t offsets[];
+};
+
+struct inode_table *inode_table = NULL;
+struct inode_table *retired_tables = NULL;
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;    // serializes index_entry()
+unsigned int next_inode = 1;
+uint64_t dead_bytes = 0;    // bytes of superseded entries above compact_base, reclaimable by compaction
+uint64_t compact_base = 0;  // wfs_compact_base(): snapshots pin the log below it
+
+// Offset of the latest entry for inode, 0 if there is none
+uint64_t inode_offset(unsigned int inode) {
+    struct inode_table *table = __atomic_load_n(&inode_table, __ATOMIC_ACQUIRE);
+    if (!table || inode >= table->len) {
+        return 0;
+    }
+    return __atomic_load_n(&table->offsets[inode], __ATOMIC_ACQUIRE);
+}
 
-    int found = 0;
+// Record entry as the latest version of its inode. Data and commit records are not versions.
+int index_entry(struct wfs_log_entry *entry) {
+    unsigned int inode = entry->inode.inode_number;
 
-    printf("find_entry_by_inode: %d\n", inode);
-    while (current_entry < end_of_log) {
-        // Check if the current entry is a directory or file with the correct name and inode
-        if ((current_entry->inode.inode_number == inode)) {
-            
-            found_entry = current_entry;
-            found = 1;
+    if (!wfs_is_version(entry)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    struct inode_table *table = inode_table;
+    if (!table || inode >= table->len) {
+        unsigned int new_len = table ? table->len : 64;
+        while (new_len <= inode) {
+            new_len *= 2;
+        }
+
+        struct inode_table *new_table = calloc(1, sizeof(struct inode_table) + new_len * sizeof(uint64_t));
+        if (!new_table) {
+            pthread_mutex_unlock(&index_lock);
+            perror("Error growing inode table");
+            return -ENOMEM;
+        }
+        new_table->len = new_len;
+        if (table) {
+            memcpy(new_table->offsets, table->offsets, table->len * sizeof(uint64_t));
+            table->retired = retired_tables;
+            retired_tables = table;
         }
-        // Move to the next log entry
-        current_entry = (struct wfs_log_entry *)((char *)current_entry + sizeof(struct wfs_log_entry) + current_entry->inode.size);
+        __atomic_store_n(&inode_table, new_table, __ATOMIC_RELEASE);
+        table = new_table;
     }
 
-    if (!found || found_entry->inode.deleted == 1) { // also check if deleted
-        // Token not found in the log, path  does not exist
-        printf("Inode %d not found or deleted\n", inode);
-        return NULL;
+    // A version that extends an extent or directory index chain still needs the one before it
+    uint64_t old_offset = table->offsets[inode];
+    int chained = ((entry->inode.flags & WFS_INODE_EXTENTS) && ((struct wfs_extent_list *)entry->data)->prev == old_offset) ||
+                  ((entry->inode.flags & WFS_INODE_PAGED) && ((struct wfs_dir_index *)entry->data)->prev == old_offset);
+    if (old_offset != 0 && old_offset >= compact_base && !chained) {
+        struct wfs_log_entry *old_entry = (struct wfs_log_entry *)((char *)global_superblock + old_offset);
+        dead_bytes += wfs_entry_len(old_entry);
     }
 
-    printf("Found entry by inode %d\n", found_entry->inode.inode_number);
-    return found_entry;
+    __atomic_store_n(&table->offsets[inode], (char *)entry - (char *)global_superblock, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&index_lock);
+    return 0;
 }
 
-struct wfs_log_entry* looper(const char *path, mode_t mode) {
-    printf("Get looper: %s\n", path);
-    // Check if the global superblock has been mapped
-    if (!global_superblock) {
-        fprintf(stderr, "Disk file not mapped\n");
-        return NULL;
+// Only safe before FUSE starts, after it stops, or with map_lock held exclusively
+void free_retired_tables() {
+    while (retired_tables) {
+        struct inode_table *table = retired_tables;
+        retired_tables = table->retired;
+        free(table);
     }
+}
 
-    // Start from the root node
-    struct wfs_log_entry *start_of_log = (struct wfs_log_entry *)((char *)global_superblock + sizeof(struct wfs_sb));
+// Index the log from start to head, later entries for an inode replacing earlier ones
+static int index_log(uint64_t start) {
     struct wfs_log_entry *end_of_log = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    struct wfs_log_entry *current_entry;
-    struct wfs_log_entry *found_entry = NULL;
+    struct wfs_log_entry *current_entry = (struct wfs_log_entry *)((char *)global_superblock + start);
 
-    char *token;
-    if (strcmp(path, "/") != 0) {
-        char *rest = strdup(path);
-        token = strtok(rest, "/");
-    } else {
-        char *rest = strdup(path);
-        token = rest;
+    while (current_entry < end_of_log) {
+        if (index_entry(current_entry) != 0) {
+            return -ENOMEM;
+        }
+        if (current_entry->inode.inode_number >= next_inode) {
+            next_inode = current_entry->inode.inode_number + 1;
+        }
+        current_entry = wfs_scan_next(current_entry);
+        count(&scanned_entries, 1);
     }
 
-    unsigned int current_inode = 0; // Start with root inode    
+    if (global_superblock->next_inode > next_inode) {
+        next_inode = global_superblock->next_inode;
+    }
 
-    printf("%s search start token: %s\n", path, token);
+    return 0;
+}
 
-    while (token != NULL) {
-        current_entry = start_of_log;
-        int found = 0;
+// Scan the whole log once. Runs before FUSE starts or with map_lock held exclusively, so no
+// reader holds a retired table.
+int build_inode_table() {
+    free_retired_tables();
+    if (inode_table) {
+        memset(inode_table->offsets, 0, inode_table->len * sizeof(uint64_t));
+    }
+    dead_bytes = 0;
+    count(&index_rebuilds, 1);
+    return index_log(wfs_log_start(global_superblock));
+}
 
-        printf("%s searching in looper\n", path);
-        while (current_entry < end_of_log) {
-            // Check if the current entry is a directory or file with the correct name and inode
-            if ((current_entry->inode.inode_number == current_inode)) {
-                
-                found_entry = current_entry;
-                found = 1;
-            }
-            // Move to the next log entry
-            current_entry = (struct wfs_log_entry *)((char *)current_entry + sizeof(struct wfs_log_entry) + current_entry->inode.size);
-        }
+// Checkpoints (see wfs.h). A mount that has written CHECKPOINT_BYTES of log since the last
+// one writes a new one from the cleaner thread, and every writable mount writes one when it
+// is unmounted, so the next mount loads the table and only indexes the log written after it.
+#define CHECKPOINT_BYTES (64 * 1024 * 1024)
 
-        if (!found || found_entry->inode.deleted == 1) { // also check if deleted
-            // Token not found in the log, path  does not exist
-            printf("%s Not found in looper\n", path);
-            return NULL;
-        }
+uint64_t checkpointed_head = 0;     // head just after the last checkpoint written or loaded
 
-        // get found_entry
-        //////--------------------///////////////////
-        // get current_inode
-        struct wfs_dentry *current_dentry = (struct wfs_dentry *)found_entry->data;
-        int num_entry = found_entry->inode.size / sizeof(struct wfs_dentry);
-
-        // printf("Listing all dentries in found_entry:\n");
-        // for (int i = 0; i < num_entry; i++) {
-        //     printf("Dentry %d: Name: %s, Inode Number: %lu\n", i, current_dentry->name, current_dentry->inode_number);
-        //     current_dentry += 1;
-        // }
-
-        // Reset current_dentry to the start position before the main loop
-        current_dentry = (struct wfs_dentry *)found_entry->data;
-        int old_inode = current_inode;
-
-        printf("%s before with name: %s token: %s\n", path, current_dentry->name, token);
-        for (int i = 0; i < num_entry; i++) {
-            
-            if (strcmp(current_dentry->name, token) == 0) {
-                printf("%s made it in here with name: %s token: %s\n", path, current_dentry->name, token);
-                current_inode = current_dentry->inode_number;
-            }
-            current_dentry += 1;
+// Load the inode table from the superblock's checkpoint and index the log after it. Returns
+// -ENOENT if there is no checkpoint of the log below head. Runs before FUSE starts.
+int load_checkpoint() {
+    struct wfs_checkpoint *checkpoint = wfs_checkpoint_at(global_superblock, global_superblock->head);
+    if (!checkpoint) {
+        return -ENOENT;
+    }
+    for (uint32_t inode = 0; inode < checkpoint->count; inode++) {
+        uint64_t offset = checkpoint->offsets[inode];
+        if (offset != 0 && (offset < wfs_log_start(global_superblock) || offset >= checkpoint->head)) {
+            fprintf(stderr, "Checkpoint names offset %lu for inode %u, outside the log it covers\n", offset, inode);
+            return -ENOENT;
         }
+    }
 
-        // Update inode for the next path component
-        if (current_inode == old_inode && strcmp(path, "/") != 0) {
-            printf("Returning current = old\n");
-            return NULL;
-        }
+    unsigned int len = 64;
+    while (len < checkpoint->count) {
+        len *= 2;
+    }
+    struct inode_table *table = calloc(1, sizeof(struct inode_table) + len * sizeof(uint64_t));
+    if (!table) {
+        perror("Error allocating inode table");
+        return -ENOMEM;
+    }
+    table->len = len;
+    memcpy(table->offsets, checkpoint->offsets, checkpoint->count * sizeof(uint64_t));
+    free(inode_table);
+    inode_table = table;
+    dead_bytes = checkpoint->dead_bytes;
+    if (checkpoint->next_inode > next_inode) {
+        next_inode = checkpoint->next_inode;
+    }
+    checkpointed_head = global_superblock->checkpoint + wfs_entry_len((struct wfs_log_entry *)((char *)global_superblock + global_superblock->checkpoint));
+    return index_log(checkpoint->head);
+}
 
-        if (strcmp(path, "/") == 0) {
-            break;
-        }
+// Dentry cache: (parent inode, name) -> child inode, including negative entries for names
+// that are known not to exist, so repeated lookups of hot (or missing) paths cost one hash
+// probe per component instead of a dentry scan. Entries are dropped whenever a directory
+// gains or loses a name. Buckets are guarded by striped locks. Every invalidation bumps
+// dcache_generation, and a lookup only caches what it found if the generation is the one it
+// started with, so a result read from a directory version that was just replaced is never
+// cached.
+#define DCACHE_BUCKETS 4096
+#define DCACHE_LOCKS 64
+#define DCACHE_MAX_ENTRIES 65536
+#define DCACHE_MISS -1
+#define DCACHE_NEGATIVE -2
+
+struct dcache_entry {
+    unsigned int parent_inode;
+    int inode;                      // child inode, or DCACHE_NEGATIVE
+    char name[MAX_FILE_NAME_LEN];
+    struct dcache_entry *next;
+};
 
-        token = strtok(NULL, "/"); // Move to next token
+struct dcache_entry *dcache[DCACHE_BUCKETS];
+pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+unsigned int dcache_entries = 0;
+unsigned int dcache_generation = 0;
+
+unsigned int dcache_hash(unsigned int parent_inode, const char *name) {
+    // FNV-1a over the parent inode and the name
+    uint32_t hash = 2166136261u ^ parent_inode;
+    hash *= 16777619u;
+    for (const char *c = name; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
     }
-    
-    return find_entry_by_inode(current_inode); // Return the pointer to the last found entry
+    return hash % DCACHE_BUCKETS;
 }
 
-static int wfs_getattr(const char *path, struct stat *stbuf) {
-    printf("GetAttr ******************************\n");
-    printf("Get path: %s\n", path);
-    memset(stbuf, 0, sizeof(struct stat)); // Initialize the stat structure
+unsigned int dcache_begin() {
+    return __atomic_load_n(&dcache_generation, __ATOMIC_ACQUIRE);
+}
 
-    struct wfs_log_entry *entry = looper(path, 0); // Use looper to find the log entry for the path
-    if (!entry) {
-        printf("Fails here for path: %s\n", path);
-        return -ENOENT; // File or directory not found
+void dcache_clear() {
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_lock(&dcache_locks[i]);
     }
+    __atomic_add_fetch(&dcache_generation, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        struct dcache_entry *entry = dcache[i];
+        while (entry) {
+            struct dcache_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        dcache[i] = NULL;
+    }
+    __atomic_store_n(&dcache_entries, 0, __ATOMIC_RELAXED);
 
-    // Fill the stat structure with the file/directory attributes
-    stbuf->st_mode = entry->inode.mode;
-    stbuf->st_nlink = entry->inode.links;
-    stbuf->st_uid = entry->inode.uid;
-    stbuf->st_gid = entry->inode.gid;
-    stbuf->st_size = entry->inode.size;
-    stbuf->st_mtime = entry->inode.mtime;
-
-    return 0; // Return success
+    for (int i = DCACHE_LOCKS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&dcache_locks[i]);
+    }
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    printf("Entering mknod path: %s *********************************\n", path);
-    // Check if superblock is properly mapped
-    if (!global_superblock) {
-        fprintf(stderr, "Superblock not mapped\n");
-        return -EIO;
+int dcache_lookup(unsigned int parent_inode, const char *name) {
+    unsigned int bucket = dcache_hash(parent_inode, name);
+    int inode = DCACHE_MISS;
+
+    pthread_mutex_lock(&dcache_locks[bucket % DCACHE_LOCKS]);
+    for (struct dcache_entry *entry = dcache[bucket]; entry; entry = entry->next) {
+        if (entry->parent_inode == parent_inode && strcmp(entry->name, name) == 0) {
+            inode = entry->inode;
+            break;
+        }
     }
+    pthread_mutex_unlock(&dcache_locks[bucket % DCACHE_LOCKS]);
+    return inode;
+}
 
-    char parent_path[MAX_PATH_LEN];
+// generation is what dcache_begin() returned before the directory was read
+void dcache_insert(unsigned int parent_inode, const char *name, int inode, unsigned int generation) {
+    // Names that can never be stored in a dentry are not worth caching
+    if (strlen(name) >= MAX_FILE_NAME_LEN) {
+        return;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        // Path is the root directory, no parent
-        return -EISDIR;
+    // Keep memory bounded; the cache refills from hot paths quickly
+    if (__atomic_load_n(&dcache_entries, __ATOMIC_RELAXED) >= DCACHE_MAX_ENTRIES) {
+        dcache_clear();
     }
 
-    strcpy(parent_path, path);
-    char *last_slash = strrchr(parent_path, '/');
+    struct dcache_entry *entry = malloc(sizeof(struct dcache_entry));
+    if (!entry) {
+        return;
+    }
 
-    char new_path[MAX_FILE_NAME_LEN];
+    unsigned int bucket = dcache_hash(parent_inode, name);
+    entry->parent_inode = parent_inode;
+    entry->inode = inode;
+    strcpy(entry->name, name);
 
-    if (last_slash != NULL) {
-        // Copy everything after the last slash to new_path
-        strncpy(new_path, last_slash + 1, MAX_FILE_NAME_LEN); // Copy up to 4 characters to leave room for the null terminator
-        new_path[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
-    } else {
-        // If there's no slash, the whole path is the new path
-        strncpy(new_path, path, MAX_FILE_NAME_LEN);
-        new_path[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
+    pthread_mutex_lock(&dcache_locks[bucket % DCACHE_LOCKS]);
+    if (__atomic_load_n(&dcache_generation, __ATOMIC_ACQUIRE) != generation) {
+        pthread_mutex_unlock(&dcache_locks[bucket % DCACHE_LOCKS]);
+        free(entry);
+        return;
     }
-
-    if (last_slash == parent_path) {
-        // If the path is a direct child of root (e.g., "/a")
-        strcpy(parent_path, "/");
-    } else if (last_slash != NULL) {
-        // For deeper paths, find the parent directory
-        *last_slash = '\0'; // Terminate the string to get the parent path
-    } else {
-        // Handle unexpected cases
-        return -EINVAL; // Invalid argument
+    // A name is cached once, so dcache_invalidate() drops all there is of it. A readdir
+    // call caches the name the kernel had no room for, and the next call caches it again.
+    for (struct dcache_entry *cached = dcache[bucket]; cached; cached = cached->next) {
+        if (cached->parent_inode == parent_inode && strcmp(cached->name, name) == 0) {
+            cached->inode = inode;
+            pthread_mutex_unlock(&dcache_locks[bucket % DCACHE_LOCKS]);
+            free(entry);
+            return;
+        }
     }
+    entry->next = dcache[bucket];
+    dcache[bucket] = entry;
+    pthread_mutex_unlock(&dcache_locks[bucket % DCACHE_LOCKS]);
+    __atomic_add_fetch(&dcache_entries, 1, __ATOMIC_RELAXED);
+}
 
-    struct wfs_log_entry *parent_dir_entry = looper(parent_path, S_IFDIR);
-    if (!parent_dir_entry) {
-        return -ENOENT;  // Parent directory not found
+// Called after the directory version without (or with) the name has been indexed
+void dcache_invalidate(unsigned int parent_inode, const char *name) {
+    unsigned int bucket = dcache_hash(parent_inode, name);
+
+    pthread_mutex_lock(&dcache_locks[bucket % DCACHE_LOCKS]);
+    __atomic_add_fetch(&dcache_generation, 1, __ATOMIC_RELEASE);
+    struct dcache_entry **link = &dcache[bucket];
+    while (*link) {
+        struct dcache_entry *entry = *link;
+        if (entry->parent_inode == parent_inode && strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry);
+            __atomic_sub_fetch(&dcache_entries, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        link = &entry->next;
     }
+    pthread_mutex_unlock(&dcache_locks[bucket % DCACHE_LOCKS]);
+}
 
-    printf("New path: %s\n", new_path);
-    printf("Parent path: %s\n", parent_path);
-    // Prepare the new file entry
-    struct wfs_dentry newFile;
-    strncpy(newFile.name, new_path, MAX_FILE_NAME_LEN);
-    newFile.name[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
-    int newInode = find_new_inode();
-    newFile.inode_number = newInode; // Assign inode number after new dir entry
-    printf("Created new dentry with name %s\n", newFile.name);
-
-    // Create a new log entry for the parent directory
-    struct wfs_log_entry *newParentDirEntry = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    *newParentDirEntry = *parent_dir_entry; // Copy the existing parent dir entry
-    newParentDirEntry->inode.size = parent_dir_entry->inode.size + sizeof(struct wfs_dentry);
-    memcpy(newParentDirEntry->data, parent_dir_entry->data, parent_dir_entry->inode.size);
-    memcpy((char *)newParentDirEntry->data , &newFile, sizeof(struct wfs_dentry));
+// Fingerprint index of a WFS_FEATURE_DEDUP image (see wfs.h): a log offset holding a chunk
+// with each fingerprint. Writes add the chunks they store, and the index is rebuilt from the
+// live files at mount and after every compaction, which moves them. A write compares the
+// bytes before sharing them, so an entry for data that has since been superseded is harmless.
+// dedup_lock guards the table.
+struct wfs_dedup_table dedup_table;
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Runs before FUSE starts or with map_lock held exclusively
+int dedup_rebuild() {
+    pthread_mutex_lock(&dedup_lock);
+    wfs_dedup_free(&dedup_table);
+    for (unsigned int inode = 0; inode < next_inode; inode++) {
+        uint64_t offset = inode_offset(inode);
+        struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)global_superblock + offset);
+        if (offset == 0 || entry->inode.deleted || !(entry->inode.flags & WFS_INODE_EXTENTS)) {
+            continue;
+        }
 
-    global_superblock->head += sizeof(struct wfs_log_entry) + newParentDirEntry->inode.size;
+        // A damaged chain is reported by the reads that need it
+        struct wfs_extent *extents;
+        uint32_t extent_count;
+        if (wfs_collect_extents(global_superblock, entry, &extents, &extent_count) != 0) {
+            continue;
+        }
+        for (uint32_t i = 0; i < extent_count; i++) {
+            struct wfs_extent *extent = &extents[i];
+            uint64_t chunk = (extent->file_offset + WFS_DEDUP_CHUNK - 1) / WFS_DEDUP_CHUNK * WFS_DEDUP_CHUNK;
+            for (; !extent->block && chunk + WFS_DEDUP_CHUNK <= extent->file_offset + extent->length; chunk += WFS_DEDUP_CHUNK) {
+                uint64_t chunk_offset = extent->log_offset + (chunk - extent->file_offset);
+                if (wfs_dedup_insert(&dedup_table, wfs_fingerprint((char *)global_superblock + chunk_offset), chunk_offset) != 0) {
+                    free(extents);
+                    pthread_mutex_unlock(&dedup_lock);
+                    perror("Error building fingerprint index");
+                    return -ENOMEM;
+                }
+            }
+        }
+        free(extents);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return 0;
+}
 
-    // Create a new log entry for the file
-    struct wfs_log_entry *newFileEntry = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    newFileEntry->inode.mode = S_IFREG | mode;
-    newFileEntry->inode.inode_number = newInode;
-    newFileEntry->inode.links = 1;
-    newFileEntry->inode.uid = getuid();
-    newFileEntry->inode.gid = getgid();
-    newFileEntry->inode.atime = time(NULL);
-    newFileEntry->inode.mtime = time(NULL);
-    newFileEntry->inode.ctime = time(NULL);
-    newFileEntry->inode.size = sizeof(struct wfs_log_entry);
+// Durability. Every operation appends one transaction (see wfs.h) and commits it with
+// commit_log(). In strict mode that flushes it before the operation returns. In batched mode
+// committed transactions accumulate and are flushed together once commit_bytes are pending,
+// commit_interval_ms have passed, or on fsync/flush/release. Transactions are committed in
+// log order, each waiting for the ones reserved before it, so the log below complete_head
+// is whole and recovery never finds a flushed transaction behind a torn one. A flush syncs
+// the pages from synced_head to complete_head and then the superblock page.
+// commit_lock guards all of it.
+#define DURABILITY_STRICT 0
+#define DURABILITY_BATCHED 1
+
+int durability = DURABILITY_STRICT;
+unsigned int commit_interval_ms = 100;
+unsigned int commit_bytes = 256 * 1024;
+
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;     // complete_head moved
+uint64_t complete_head = 0;     // every transaction below this has been committed
+uint64_t synced_head = 0;       // the log below this is durable
+uint64_t commit_seq = 0;        // sequence number of the last transaction this mount committed
+struct timespec last_flush;
+long page_size = 4096;
+
+// Storage backends. Everything reads and writes the image through the mapping at
+// global_superblock; a backend decides how the changes made there reach the file and how the
+// bytes of read replies are fetched. The default mmap backend (-o backend=mmap) maps the file
+// shared, so the mapping is the file's page cache and syncing is msync. The direct backend
+// (-o backend=direct) maps it privately and writes the file itself (see direct_start()).
+// Hooks a backend has no use for are left NULL.
+struct storage_ops {
+    int sync_method;                                // SYNC_MSYNC or SYNC_URING unless io= says otherwise
+    int shares_file;                                // the mapping is the file, so the image may be spliced
+    int (*start)(const char *disk_path);            // once the image is mapped and recovered
+    void (*stop)(void);
+    int (*sync)(uint64_t start, uint64_t end);      // bytes changed in place, outside the log tail
+    int (*flush_sync)(void);                        // the log below complete_head, then the superblock
+    unsigned int (*queue_flush)(void);              // the same as linked sqes; returns how many
+    void (*release)(void);                          // after a flush; caller holds commit_lock
+    void (*read)(char *dest, uint64_t offset, size_t len);
+    void (*prefetch)(uint64_t start, uint64_t end);
+    void (*moved)(void);                            // compaction moved the log
+};
 
-    memcpy(newFileEntry->data, &newFile, sizeof(struct wfs_dentry));
+struct storage_ops *storage;
 
-    // Update the superblock head to point to the next free space
-    global_superblock->head += sizeof(struct wfs_log_entry) + newFileEntry->inode.size;
+// Make the bytes [start, end) of the image that were changed in place durable
+int sync_range(uint64_t start, uint64_t end) {
+    return storage->sync(start, end);
+}
 
-    // Synchronize changes
-    if (msync(global_superblock, DISK_SIZE, MS_SYNC) == -1) {
+int msync_range(uint64_t start, uint64_t end) {
+    uint64_t aligned = start - start % page_size;
+    uint64_t begin = monotonic_ns();
+    int ret = msync((char *)global_superblock + aligned, end - aligned, MS_SYNC);
+    stats_end(STAT_MSYNC, begin, ret);
+    if (ret == -1) {
         perror("Error syncing changes");
         return -EIO;
     }
-
-    printf("Reached end of mknod for path: %s\n", path);
     return 0;
 }
 
+// Sync the log committed since the last flush and then the superblock with msync, holding
+// commit_lock throughout. Caller holds commit_lock.
+int msync_flush() {
+    if (synced_head == complete_head) {
+        return 0;
+    }
 
-static int wfs_mkdir(const char *path, mode_t mode) {
-    printf("Entering mkdir path: %s >>>>>>>>>>>>>>>>>>>>>>>>>>\n", path);
-    // Check if superblock is properly mapped
-    if (!global_superblock) {
-        fprintf(stderr, "Superblock not mapped\n");
-        return -EIO;
+    int ret = msync_range(synced_head, complete_head);
+    if (ret == 0) {
+        ret = msync_range(0, sizeof(struct wfs_sb));
     }
+    if (ret == 0) {
+        synced_head = complete_head;
+    }
+    return ret;
+}
 
-    // Use looper to find the parent directory of the path
-    char parent_dir[MAX_PATH_LEN];
+// Sync methods. They decide how a flush is waited for, whichever backend writes it.
+// SYNC_MSYNC (-o io=mmap) makes the log and then the superblock durable with commit_lock
+// held, so every operation that commits meanwhile waits for the disk. SYNC_URING
+// (-o io=uring) submits the backend's flush as linked sqes to an io_uring and drops
+// commit_lock while they run: operations keep committing, a batched flush returns as soon
+// as it is submitted, and strict operations that commit during a flush are all covered by
+// the next one (group commit).
+#define SYNC_MSYNC 0
+#define SYNC_URING 1
+#define URING_ENTRIES 4
+#define URING_SYNC_MAX (1ull << 30)     // longest range one sqe covers; its len is 32 bits
+
+int sync_method = -1;   // the backend's unless io= is given
+
+// The ring, set up by uring_setup(). Submission and completion are guarded by commit_lock.
+struct uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+uint64_t flushing_head = 0;     // a flush of the log below this is in flight, 0 if none
+unsigned int flush_pending = 0; // its sqes not yet completed
+int flush_failed = 0;           // one of them failed
+int flush_waiting = 0;          // a thread waits for them in io_uring_enter() without commit_lock
+uint64_t flush_start_ns = 0;
+
+int uring_setup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd == -1) {
+        return -errno;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        // Path is the root directory, no parent
-        return -EISDIR;
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        int err = errno;
+        close(ring.fd);
+        ring.fd = -1;
+        return -err;
     }
 
-    strcpy(parent_dir, path);
-    char *last_slash = strrchr(parent_dir, '/');
+    ring.sq_tail = (unsigned int *)((char *)ring.sq_ring + params.sq_off.tail);
+    ring.sq_mask = (unsigned int *)((char *)ring.sq_ring + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)((char *)ring.sq_ring + params.sq_off.array);
+    ring.cq_head = (unsigned int *)((char *)ring.cq_ring + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)((char *)ring.cq_ring + params.cq_off.tail);
+    ring.cq_mask = (unsigned int *)((char *)ring.cq_ring + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + params.cq_off.cqes);
+    return 0;
+}
 
-    char new_dir[MAX_FILE_NAME_LEN];
+// Claim the next sqe, zeroed. Every sqe expects its user_data as its result.
+static struct io_uring_sqe *uring_next_sqe() {
+    unsigned int index = *ring.sq_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+}
 
-    if (last_slash != NULL) {
-        // Copy everything after the last slash to new_path
-        strncpy(new_dir, last_slash + 1, MAX_FILE_NAME_LEN); // Copy up to 4 characters to leave room for the null terminator
-        new_dir[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
-    } else {
-        // If there's no slash, the whole path is the new path
-        strncpy(new_dir, path, MAX_FILE_NAME_LEN);
-        new_dir[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
+static void uring_submit_sqe() {
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+// Queue an fdatasync of the file bytes from start to end, like msync(MS_SYNC) does for a
+// range of the mapping. The range, from start's page on, must be no longer than
+// URING_SYNC_MAX. Linked ones run in order, and are cancelled if the one before fails.
+void uring_queue_sync(uint64_t start, uint64_t end, int link) {
+    uint64_t aligned = start - start % page_size;
+    struct io_uring_sqe *sqe = uring_next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->fd = disk_fd;
+    sqe->off = aligned;
+    sqe->len = end - aligned;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    uring_submit_sqe();
+}
+
+// Queue a write of the mapping's bytes [start, end) to the same offsets of the file through
+// fd. A short write fails the flush like an error does.
+void uring_queue_write(int fd, uint64_t start, uint64_t end, int link) {
+    struct io_uring_sqe *sqe = uring_next_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)((char *)global_superblock + start);
+    sqe->off = start;
+    sqe->len = end - start;
+    sqe->user_data = end - start;
+    uring_submit_sqe();
+}
+
+// Take the completions that have arrived. Once every sqe of the flush in flight has
+// completed, the log below flushing_head is durable. Caller holds commit_lock.
+int uring_reap() {
+    unsigned int head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        if (cqe->res < 0 || (uint64_t)cqe->res != cqe->user_data) {
+            flush_failed = 1;
+        }
+        flush_pending--;
+        head++;
     }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
 
-    if (last_slash == parent_dir) {
-        // If the path is a direct child of root (e.g., "/a")
-        strcpy(parent_dir, "/");
-    } else if (last_slash != NULL) {
-        // For deeper paths, find the parent directory
-        *last_slash = '\0'; // Terminate the string to get the parent path
+    if (flushing_head == 0 || flush_pending > 0) {
+        return 0;
+    }
+    int ret = 0;
+    if (flush_failed) {
+        fprintf(stderr, "Error syncing changes\n");
+        ret = -EIO;
     } else {
-        // Handle unexpected cases
-        return -EINVAL; // Invalid argument
+        synced_head = flushing_head;
     }
+    stats_end(STAT_IO_SYNC, flush_start_ns, ret);
+    flushing_head = 0;
+    pthread_cond_broadcast(&commit_cond);
+    return ret;
+}
 
-    struct wfs_log_entry *parent_dir_entry = looper(parent_dir, S_IFDIR);
-    if (!parent_dir_entry) {
-        return -ENOENT;  // Parent directory not found
+// Wait for the flush in flight, if there is one. Caller holds commit_lock, which is released
+// while waiting.
+int uring_wait() {
+    int ret = 0;
+    while (flushing_head != 0 && ret == 0) {
+        if (flush_waiting) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        } else {
+            flush_waiting = 1;
+            pthread_mutex_unlock(&commit_lock);
+            syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            pthread_mutex_lock(&commit_lock);
+            flush_waiting = 0;
+            ret = uring_reap();
+        }
     }
+    return ret;
+}
 
-    printf("New path: %s\n", new_dir);
-    printf("Parent path: %s\n", parent_dir);
-    // Prepare the new file entry
-    struct wfs_dentry newDir;
-    strncpy(newDir.name, new_dir, MAX_FILE_NAME_LEN);
-    newDir.name[MAX_FILE_NAME_LEN - 1] = '\0'; // Ensure null-termination
-    printf("newDir name: %s\n", newDir.name);
-    int newInode = find_new_inode();
-    newDir.inode_number = newInode; // Assign inode number after new dir entry
-    printf("Created new dentry with name %s and inode: %ld\n", newDir.name, newDir.inode_number);
-
-    struct wfs_dentry *current_dentry = (struct wfs_dentry *)parent_dir_entry->data;
-    int num_entry = parent_dir_entry->inode.size / sizeof(struct wfs_dentry);
-    printf("Listing all dentries in parent_dir_entry\n");
-    for (int i = 0; i < num_entry; i++) {
-        printf("Dentry %d: Name: %s, Inode Number: %lu\n", i, current_dentry->name, current_dentry->inode_number);
-        current_dentry += 1;
+// Flush everything committed, waiting for it only if wait is set. A flush already in flight
+// is waited for first, then one covering everything committed since is submitted. Caller
+// holds commit_lock, which is released while waiting.
+int uring_flush(int wait) {
+    uint64_t target = complete_head;
+    int ret = flush_waiting ? 0 : uring_reap();   // the waiter takes the completions
+    while (synced_head < target && (ret == 0 || wait)) {
+        if (flushing_head == 0 && complete_head - (synced_head - synced_head % page_size) > URING_SYNC_MAX) {
+            // Too long for one sqe; nothing is in flight, so flush it as SYNC_MSYNC would
+            ret = storage->flush_sync();
+            pthread_cond_broadcast(&commit_cond);
+            if (ret != 0) {
+                return ret;
+            }
+        } else if (flushing_head == 0) {
+            flushing_head = complete_head;
+            flush_failed = 0;
+            flush_start_ns = monotonic_ns();
+            flush_pending = storage->queue_flush();
+            if (syscall(__NR_io_uring_enter, ring.fd, flush_pending, 0, 0, NULL, 0) != flush_pending) {
+                perror("Error submitting sync");
+                flushing_head = 0;
+                return -EIO;
+            }
+            ret = 0;
+            if (!wait) {
+                break;
+            }
+        } else if (!wait) {
+            break;
+        } else {
+            ret = uring_wait();
+            if (ret != 0) {
+                return ret;
+            }
+        }
     }
+    return ret;
+}
 
-
-    // Create a new log entry for the parent directory
-    struct wfs_log_entry *newParentDirEntry = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    *newParentDirEntry = *parent_dir_entry;
-    newParentDirEntry->inode.size = parent_dir_entry->inode.size + sizeof(struct wfs_dentry);
-    memcpy(newParentDirEntry->data, parent_dir_entry->data, parent_dir_entry->inode.size);
-    memcpy((char *)newParentDirEntry->data , &newDir, sizeof(struct wfs_dentry));
-
-    global_superblock->head += sizeof(struct wfs_log_entry) + newParentDirEntry->inode.size;
-
-    current_dentry = (struct wfs_dentry *)newParentDirEntry->data;
-    num_entry = newParentDirEntry->inode.size / sizeof(struct wfs_dentry);
-    printf("Listing all dentries in new parent_dir_entry\n");
-    for (int i = 0; i < num_entry; i++) {
-        printf("Dentry %d: Name: %s, Inode Number: %lu\n", i, current_dentry->name, current_dentry->inode_number);
-        current_dentry += 1;
+void uring_close() {
+    if (ring.fd != -1) {
+        close(ring.fd);
+        ring.fd = -1;
     }
+}
 
+// The mmap backend syncs the log and the superblock page where the shared mapping has left
+// them in the page cache, and reads straight out of the mapping
+unsigned int mmap_queue_flush() {
+    uring_queue_sync(synced_head, complete_head, 1);
+    uring_queue_sync(0, sizeof(struct wfs_sb), 0);
+    return 2;
+}
 
-    // Create the new log entry for the directory
-    struct wfs_log_entry *newDirEntry = (struct wfs_log_entry *)((char *)global_superblock + global_superblock->head);
-    newDirEntry->inode.mode = S_IFDIR | mode;  // Ensure the mode indicates a directory
-    newDirEntry->inode.inode_number = newInode;
-    newDirEntry->inode.links = 2; // Directories typically have 2 links (".", "..")
-    newDirEntry->inode.uid = getuid();
-    newDirEntry->inode.gid = getgid();
-    newDirEntry->inode.atime = time(NULL);
-    newDirEntry->inode.mtime = time(NULL);
-    newDirEntry->inode.ctime = time(NULL);
-    newDirEntry->inode.size = sizeof(struct wfs_log_entry); // No additional data for the directory
+void mmap_read(char *dest, uint64_t offset, size_t len) {
+    memcpy(dest, (char *)global_superblock + offset, len);
+}
 
-    memcpy(newDirEntry->data, &newDir, sizeof(struct wfs_dentry));
+void mmap_prefetch(uint64_t start, uint64_t end) {
+    madvise((char *)global_superblock + start, end - start, MADV_WILLNEED);
+}
 
-    // Update the superblock head to point to the next free space
-    global_superblock->head += sizeof(struct wfs_log_entry) + newDirEntry->inode.size;
+struct storage_ops mmap_storage = {
+    .sync_method = SYNC_MSYNC,
+    .shares_file = 1,
+    .sync = msync_range,
+    .flush_sync = msync_flush,
+    .queue_flush = mmap_queue_flush,
+    .read = mmap_read,
+    .prefetch = mmap_prefetch,
+};
 
-    // Synchronize changes
-    if (msync(global_superblock, DISK_SIZE, MS_SYNC) == -1) {
-        perror("Error syncing changes");
-        return -EIO;
+// The direct backend. The image is mapped privately, so changes stay in this process's
+// memory, never in the page cache, until the backend writes them: a flush writes the pages
+// from synced_head to complete_head and then the superblock page through a second descriptor
+// opened with O_DIRECT, as four linked sqes (write, fdatasync, write, fdatasync) with
+// SYNC_URING. The writes skip the page cache, and a full disk is an error from the write
+// rather than SIGBUS. Once a page lies wholly below synced_head its private copy is dropped,
+// so memory holds the unflushed tail rather than everything written this mount. Reads of
+// durable log bytes are served from a cache of READ_CACHE_BLOCK blocks filled with O_DIRECT
+// reads (cache_mb, 0 turns it off); the rest, compressed blocks and all metadata still come
+// from the mapping. Bytes changed in place (the superblock, compaction) are written buffered
+// once any flush in flight is done, so an older copy of them can never land after a newer one.
+#define READ_CACHE_BLOCK (64 * 1024)
+#define READ_CACHE_LOCKS 64
+
+int direct_fd = -1;
+uint64_t released_head = 0;     // private copies of the pages below this are dropped
+unsigned int read_cache_mb = 64;
+size_t read_cache_slots = 0;
+char *read_cache = NULL;
+uint64_t *read_cache_tags = NULL;   // one past the offset of the block each slot holds, 0 if none
+pthread_mutex_t read_cache_locks[READ_CACHE_LOCKS];
+
+// Write the mapping's bytes [start, end) to the same offsets of the file through fd. Other
+// threads may be moving head in the superblock meanwhile, as they may while msync writes its
+// page; recovery finds the end of the log from the transactions, not from head.
+static int write_mapped(int fd, uint64_t start, uint64_t end) {
+    while (start < end) {
+        ssize_t written = pwrite(fd, (char *)global_superblock + start, end - start, start);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        start += written;
     }
-
-    printf("Reached end of mkdir for path: %s\n", path);
     return 0;
 }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    // Use looper to find the log entry for the file
-    struct wfs_log_entry *file_entry = looper(path, 0);
-    printf("Read path: %s", path);
-    if (!file_entry) {
-        return -ENOENT; // File not found
-    }
+// The whole pages a flush writes: O_DIRECT needs aligned offsets and lengths
+static uint64_t flush_start() {
+    return synced_head - synced_head % page_size;
+}
 
-    // Check if the offset is valid
-    if (offset >= file_entry->inode.size) {
-        return -EINVAL; // Invalid argument
-    }
+static uint64_t flush_end() {
+    uint64_t end = (complete_head + page_size - 1) / page_size * page_size;
+    return end < disk_size ? end : disk_size;
+}
 
-    // Calculate the size to read
-    size_t available_size = file_entry->inode.size - offset;
-    size_t read_size = (size < available_size) ? size : available_size;
+static uint64_t sb_page_end() {
+    return page_size < disk_size ? page_size : disk_size;
+}
 
-    // Read the data
-    memcpy(buf, (char *)file_entry->data + offset, read_size);
+int direct_sync(uint64_t start, uint64_t end) {
+    pthread_mutex_lock(&commit_lock);
+    if (ring.fd != -1) {
+        uring_wait();   // a flush that failed is retried by the next one
+    }
+    uint64_t begin = monotonic_ns();
+    int ret = write_mapped(disk_fd, start, end) == 0 && fdatasync(disk_fd) == 0 ? 0 : -EIO;
+    stats_end(STAT_IO_SYNC, begin, ret);
+    pthread_mutex_unlock(&commit_lock);
+    if (ret != 0) {
+        perror("Error writing changes");
+    }
+    return ret;
+}
 
-    // Return the number of bytes read
-    return read_size;
+static int direct_sync_hook(struct wfs_sb *sb, uint64_t start, uint64_t end) {
+    return direct_sync(start, end);
 }
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    // Use looper to find the log entry for the file
-    struct wfs_log_entry *file_entry = looper(path, 0);
-    printf("Write path: %s", path);
-    if (!file_entry) {
-        return -ENOENT; // File not found
+// Caller holds commit_lock
+int direct_flush_sync() {
+    if (synced_head == complete_head) {
+        return 0;
     }
 
-    // Check if the offset is valid
-    if (offset > file_entry->inode.size) {
-        return -EINVAL; // Invalid argument
+    uint64_t begin = monotonic_ns();
+    int ret = write_mapped(direct_fd, flush_start(), flush_end()) == 0 && fdatasync(direct_fd) == 0 &&
+              write_mapped(direct_fd, 0, sb_page_end()) == 0 && fdatasync(direct_fd) == 0 ? 0 : -EIO;
+    stats_end(STAT_IO_SYNC, begin, ret);
+    if (ret != 0) {
+        perror("Error writing changes");
+        return ret;
     }
+    synced_head = complete_head;
+    return 0;
+}
 
-    // Calculate the size to write
-    size_t available_size = file_entry->inode.size - offset;
-    size_t write_size = (size < available_size) ? size : available_size;
+unsigned int direct_queue_flush() {
+    uring_queue_write(direct_fd, flush_start(), flush_end(), 1);
+    uring_queue_sync(flush_start(), flush_end(), 1);
+    uring_queue_write(direct_fd, 0, sb_page_end(), 1);
+    uring_queue_sync(0, sb_page_end(), 0);
+    return 4;
+}
 
-    // Write the data at the specified offset
-    memcpy((char *)file_entry->data + offset, buf, write_size);
+// Drop the private copies of the pages that are now durable; they read back from the file.
+// The superblock page is never dropped, as it changes in place.
+void direct_release() {
+    uint64_t end = synced_head - synced_head % page_size;
+    uint64_t start = released_head > page_size ? released_head : page_size;
+    if (end > start) {
+        madvise((char *)global_superblock + start, end - start, MADV_DONTNEED);
+    }
+    if (end > released_head) {
+        released_head = end;
+    }
+}
 
-    // Update the file size if necessary
-    if (offset + write_size > file_entry->inode.size) {
-        file_entry->inode.size = offset + write_size;
+// Copy len bytes of the log at offset, all of them below complete_head. Blocks wholly below
+// synced_head hold what the file holds, so they are cached; others are copied from the mapping.
+void direct_read(char *dest, uint64_t offset, size_t len) {
+    uint64_t durable = __atomic_load_n(&synced_head, __ATOMIC_RELAXED);
+    while (len > 0) {
+        uint64_t block = offset - offset % READ_CACHE_BLOCK;
+        size_t part = block + READ_CACHE_BLOCK - offset < len ? block + READ_CACHE_BLOCK - offset : len;
+        if (read_cache_slots == 0 || block + READ_CACHE_BLOCK > durable) {
+            memcpy(dest, (char *)global_superblock + offset, part);
+        } else {
+            size_t slot = block / READ_CACHE_BLOCK % read_cache_slots;
+            char *data = read_cache + slot * READ_CACHE_BLOCK;
+            pthread_mutex_t *lock = &read_cache_locks[slot % READ_CACHE_LOCKS];
+            pthread_mutex_lock(lock);
+            if (read_cache_tags[slot] == block + 1) {
+                count(&read_cache_hits, 1);
+            } else {
+                count(&read_cache_misses, 1);
+                read_cache_tags[slot] = 0;
+                if (pread(direct_fd, data, READ_CACHE_BLOCK, block) == READ_CACHE_BLOCK) {
+                    read_cache_tags[slot] = block + 1;
+                } else {
+                    data = (char *)global_superblock + block;
+                }
+            }
+            memcpy(dest, data + (offset - block), part);
+            pthread_mutex_unlock(lock);
+        }
+        dest += part;
+        offset += part;
+        len -= part;
     }
+}
 
-    // Update the modification time
-    file_entry->inode.mtime = time(NULL);
+// Compaction rewrote the log in place and synced it. Caller holds map_lock exclusively, so
+// no read is using the cache.
+void direct_moved() {
+    if (read_cache_tags) {
+        memset(read_cache_tags, 0, read_cache_slots * sizeof(uint64_t));
+    }
+    released_head = 0;
+}
 
-    // Synchronize changes
-    if (msync(global_superblock, DISK_SIZE, MS_SYNC) == -1) {
-        perror("Error syncing changes");
-        return -EIO;
+// Swap the shared mapping wfs_map() left for a private one. Whatever recovery and upgrades
+// wrote through the shared one is in the page cache, which the private mapping starts from.
+int direct_start(const char *disk_path) {
+    void *map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, disk_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping disk file");
+        return -1;
+    }
+    munmap(global_superblock, disk_size);
+    global_superblock = map;
+    wfs_sync_hook = direct_sync_hook;
+
+    // O_DIRECT needs whole pages; where it cannot be had, the same writes go through the
+    // page cache
+    direct_fd = disk_size % page_size == 0 ? open(disk_path, O_RDWR | O_DIRECT) : -1;
+    if (direct_fd == -1) {
+        fprintf(stderr, "Image cannot be opened with O_DIRECT, writing it through the page cache\n");
+        direct_fd = open(disk_path, O_RDWR);
+    }
+    if (direct_fd == -1) {
+        perror("Error opening disk file");
+        return -1;
     }
 
-    // Return the number of bytes written
-    return write_size;
+    read_cache_slots = (size_t)read_cache_mb * 1024 * 1024 / READ_CACHE_BLOCK;
+    if (read_cache_slots > 0) {
+        read_cache = aligned_alloc(page_size, read_cache_slots * READ_CACHE_BLOCK);
+        read_cache_tags = calloc(read_cache_slots, sizeof(uint64_t));
+        if (!read_cache || !read_cache_tags) {
+            fprintf(stderr, "Error allocating read cache\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < READ_CACHE_LOCKS; i++) {
+        pthread_mutex_init(&read_cache_locks[i], NULL);
+    }
+    return 0;
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    return 0;
+void direct_stop() {
+    if (direct_fd != -1) {
+        close(direct_fd);
+        direct_fd = -1;
+    }
+    free(read_cache);
+    free(read_cache_tags);
+    read_cache = NULL;
+    read_cache_tags = NULL;
+    read_cache_slots = 0;
 }
 
-static int wfs_unlink(const char *path) {
-    return 0;
+struct storage_ops direct_storage = {
+    .sync_method = SYNC_URING,
+    .shares_file = 0,
+    .start = direct_start,
+    .stop = direct_stop,
+    .sync = direct_sync,
+    .flush_sync = direct_flush_sync,
+    .queue_flush = direct_queue_flush,
+    .release = direct_release,
+    .read = direct_read,
+    .moved = direct_moved,
+};
+
+struct storage_ops *storage = &mmap_storage;
+
+// Make everything committed durable, or with SYNC_URING only start to unless wait is set.
+// Caller holds commit_lock.
+int flush_log(int wait) {
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    int ret = sync_method == SYNC_URING ? uring_flush(wait) : storage->flush_sync();
+    if (storage->release) {
+        storage->release();
+    }
+    return ret;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <disk_image> <mount_point> [FUSE options]\n", argv[0]);
-        return EXIT_FAILURE;
+// Called at the end of every modifying operation with the entries it appended after the
+// commit record reserve_log() left room for. Every reserved transaction must be committed,
+// even if the operation fails, since the ones after it wait for it.
+int commit_log(void *start, size_t len) {
+    struct wfs_log_entry *header = (struct wfs_log_entry *)((char *)start - WFS_COMMIT_LEN);
+    uint64_t offset = (char *)header - (char *)global_superblock;
+
+    memset(header, 0, WFS_COMMIT_LEN);
+    header->length = WFS_COMMIT_LEN;
+    header->inode.flags = WFS_INODE_COMMIT;
+    header->inode.size = sizeof(struct wfs_commit);
+    struct wfs_commit *commit = (struct wfs_commit *)header->data;
+    commit->magic = WFS_COMMIT_MAGIC;
+    commit->epoch = global_superblock->epoch;
+    commit->len = len;
+    commit->checksum = wfs_checksum(start, len, wfs_commit_seed(commit));
+
+    int ret = 0;
+    pthread_mutex_lock(&commit_lock);
+    while (complete_head != offset) {
+        pthread_cond_wait(&commit_cond, &commit_lock);
     }
+    commit->seq = ++commit_seq;
+    complete_head = offset + WFS_COMMIT_LEN + len;
+    pthread_cond_broadcast(&commit_cond);
 
-    // Open the disk image file
-    disk_fd = open(argv[argc - 2], O_RDWR);
-    if (disk_fd == -1) {
-        perror("Error opening disk file");
-        return EXIT_FAILURE;
+    if (durability == DURABILITY_STRICT || complete_head - synced_head >= commit_bytes) {
+        ret = flush_log(durability == DURABILITY_STRICT);
     }
+    pthread_mutex_unlock(&commit_lock);
+    return ret;
+}
 
-    // Map the disk image into memory
-    global_superblock = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
-    if (global_superblock == MAP_FAILED) {
-        perror("Error mapping disk file");
-        close(disk_fd);
-        return EXIT_FAILURE;
+// Flush everything pending, or only if commit_interval_ms have passed since the last flush.
+// A full flush first waits for transactions already under way, so it covers every operation
+// that returned before it was called.
+int sync_log(int only_if_due) {
+    int ret = 0;
+    pthread_mutex_lock(&commit_lock);
+    if (!only_if_due) {
+        uint64_t head = __atomic_load_n(&global_superblock->head, __ATOMIC_RELAXED);
+        while (complete_head < head) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        }
     }
 
-    // Adjust argv for FUSE
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long since_flush_ms = (now.tv_sec - last_flush.tv_sec) * 1000 + (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+    if (!only_if_due || since_flush_ms >= commit_interval_ms) {
+        ret = flush_log(!only_if_due);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return ret;
+}
+
+// Log cleaner. Compaction moves every live entry, so it runs with map_lock held exclusively
+// and rebuilds the inode table afterwards; the dentry cache only holds inode numbers and stays
+// valid. The background thread compacts once the mount has been idle for a while and enough
+// of the log is garbage, and make_room() compacts in the foreground when the log is full.
+// The same thread flushes batched commits whose interval has run out.
+#define CLEANER_IDLE_SECONDS 2
+#define CLEANER_MIN_DEAD_PERCENT 25
+
+pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t background_cond = PTHREAD_COND_INITIALIZER;
+pthread_t background_thread;
+int background_running = 0;
+time_t last_op_time = 0;
+
+// Totals reported at unmount
+unsigned int compactions = 0;
+uint64_t compacted_bytes = 0;
+double compaction_seconds = 0;
+double max_compaction_pause = 0;
+
+// Caller holds map_lock exclusively
+int compact_log() {
+    struct wfs_compact_stats stats;
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // Pending batched changes must be durable before entries start moving
+    int ret = sync_log(0);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // When compaction moves entries it syncs everything it kept; when it finds nothing to
+    // gain it leaves the log as sync_log() left it. If it failed partway, nothing is taken
+    // as durable and the next flush syncs the whole log.
+    ret = wfs_compact(global_superblock, disk_size, &stats);
+    if (storage->moved) {
+        storage->moved();
+    }
+    complete_head = global_superblock->head;
+    synced_head = ret == 0 ? complete_head : wfs_log_start(global_superblock);
+    checkpointed_head = 0;  // The checkpoint is gone with the offsets it held
+    if (build_inode_table() != 0 || (deduplication && dedup_rebuild() != 0)) {
+        ret = -ENOMEM;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double pause = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    compactions++;
+    compacted_bytes += stats.bytes_before;
+    compaction_seconds += stats.seconds;
+    if (pause > max_compaction_pause) {
+        max_compaction_pause = pause;
+    }
+
+    printf("Compacted log from %lu to %lu bytes (%u live entries, %u dead) at %.1f MB/s, FUSE paused %.3f ms\n",
+           stats.bytes_before, stats.bytes_after, stats.live_entries, stats.dead_entries,
+           stats.seconds > 0 ? stats.bytes_before / stats.seconds / 1e6 : 0.0, pause * 1e3);
+    return ret;
+}
+
+void *background_main(void *arg) {
+    pthread_mutex_lock(&background_lock);
+    while (background_running) {
+        unsigned int wait_ms = 1000;
+        if (durability == DURABILITY_BATCHED && commit_interval_ms < wait_ms) {
+            wait_ms = commit_interval_ms;
+        }
+
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += wait_ms / 1000;
+        wake.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&background_cond, &background_lock, &wake);
+
+        if (!background_running) {
+            break;
+        }
+        pthread_mutex_unlock(&background_lock);
+
+        pthread_rwlock_rdlock(&map_lock);
+        sync_log(1);
+        int checkpoint_due = __atomic_load_n(&global_superblock->head, __ATOMIC_RELAXED) - checkpointed_head >= CHECKPOINT_BYTES;
+        pthread_rwlock_unlock(&map_lock);
+
+        if (checkpoint_due) {
+            pthread_rwlock_wrlock(&map_lock);
+            write_checkpoint();
+            pthread_rwlock_unlock(&map_lock);
+        }
+
+        if (time(NULL) - __atomic_load_n(&last_op_time, __ATOMIC_RELAXED) >= CLEANER_IDLE_SECONDS) {
+            pthread_rwlock_wrlock(&map_lock);
+            uint64_t log_bytes = global_superblock->head - compact_base;
+            if (dead_bytes > 0 && dead_bytes * 100 >= log_bytes * CLEANER_MIN_DEAD_PERCENT) {
+                compact_log();
+            }
+            pthread_rwlock_unlock(&map_lock);
+        }
+
+        pthread_mutex_lock(&background_lock);
+    }
+    pthread_mutex_unlock(&background_lock);
+    return NULL;
+}
+
+// Image growth. When an append does not fit, the image file is extended in chunks of a
+// quarter of its size (at least GROW_MIN_BYTES) and remapped, so a full log costs one
+// fallocate and mremap rather than ENOSPC. A log that is largely garbage is compacted
+// instead. max_disk_size (mount option max_size, 0 for none) caps the growth.
+#define GROW_MIN_BYTES (16 * 1024 * 1024)
+
+uint64_t max_disk_size = 0;
+
+// Caller holds map_lock exclusively
+// Extend the image file to end with its new blocks allocated, so a full disk is ENOSPC here
+// rather than SIGBUS from a later write into the mapping. Where the file system cannot
+// allocate ahead, the file is only extended.
+int extend_disk(uint64_t start, uint64_t end) {
+    if (fallocate(disk_fd, 0, start, end - start) == 0) {
+        return 0;
+    }
+    return errno == EOPNOTSUPP ? ftruncate(disk_fd, end) : -1;
+}
+
+int grow_disk(uint64_t min_size) {
+    uint64_t grow_by = disk_size / 4 > GROW_MIN_BYTES ? disk_size / 4 : GROW_MIN_BYTES;
+    uint64_t new_size = disk_size + grow_by;
+    if (new_size < min_size) {
+        new_size = min_size;
+    }
+    new_size = (new_size + page_size - 1) / page_size * page_size;
+
+    if (max_disk_size) {
+        if (min_size > max_disk_size) {
+            return -ENOSPC;
+        }
+        if (new_size > max_disk_size) {
+            new_size = max_disk_size;
+        }
+    }
+
+    if (extend_disk(disk_size, new_size) != 0) {
+        perror("Error growing disk file");
+        return -ENOSPC;
+    }
+
+    // A flush in flight may be writing out of the mapping, which can move
+    pthread_mutex_lock(&commit_lock);
+    if (ring.fd != -1) {
+        uring_wait();
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    void *new_map = mremap(global_superblock, disk_size, new_size, MREMAP_MAYMOVE);
+    if (new_map == MAP_FAILED) {
+        perror("Error remapping disk file");
+        return -ENOSPC;
+    }
+
+    global_superblock = new_map;
+    disk_size = new_size;
+    global_superblock->disk_size = new_size;
+    disk_grows++;
+    printf("Grew disk image to %lu bytes\n", disk_size);
+    return 0;
+}
+
+// Make room for needed more bytes at head. This can move entries or the whole mapping, so
+// it runs with map_lock held exclusively, between attempts at an operation.
+int make_room(size_t needed) {
+    uint64_t log_bytes = global_superblock->head - compact_base;
+    if (dead_bytes > 0 && dead_bytes * 100 >= log_bytes * CLEANER_MIN_DEAD_PERCENT) {
+        compact_log();
+        if (global_superblock->head + needed <= disk_size) {
+            return 0;
+        }
+    }
+
+    if (grow_disk(global_superblock->head + needed) == 0) {
+        return 0;
+    }
+
+    // Out of room to grow; whatever garbage is left is the last resort
+    if (dead_bytes > 0) {
+        compact_log();
+    }
+    return global_superblock->head + needed <= disk_size ? 0 : -ENOSPC;
+}
+
+// Appends may only write below dirty_end (see wfs_mark_dirty()). Moving it costs a
+// superblock sync, so it is moved DIRTY_AHEAD past what the append needs, and later appends
+// find it there.
+#define DIRTY_AHEAD (4 * 1024 * 1024)
+
+pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int raise_dirty_end(uint64_t end) {
+    pthread_mutex_lock(&dirty_lock);
+    int ret = wfs_mark_dirty(global_superblock, end + DIRTY_AHEAD < disk_size ? end + DIRTY_AHEAD : disk_size);
+    pthread_mutex_unlock(&dirty_lock);
+    return ret;
+}
+
+// Claim a transaction of len bytes at the end of the log and return the offset of its first
+// entry, leaving room in front for the commit record commit_log() writes. Appends from
+// different threads only meet here. This is a compare-and-swap loop rather than a plain
+// fetch-add so a reservation never runs past the mapping. When the log is full it returns 0
+// and leaves the size in room_needed, and the operation fails with ENOSPC for
+// retry_with_room().
+uint64_t reserve_log(size_t len) {
+    size_t total = WFS_COMMIT_LEN + len;
+    uint64_t head = __atomic_load_n(&global_superblock->head, __ATOMIC_RELAXED);
+    do {
+        if (head + total > disk_size) {
+            room_needed = total;
+            return 0;
+        }
+        if (head + total > __atomic_load_n(&global_superblock->dirty_end, __ATOMIC_RELAXED) && raise_dirty_end(head + total) != 0) {
+            room_needed = 0;
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&global_superblock->head, &head, head + total, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    count(&bytes_appended, total);
+    return head + WFS_COMMIT_LEN;
+}
+
+// Called once an operation has released map_lock after failing with ENOSPC. Returns whether
+// room was made for what it tried to append, in which case the operation is run again.
+int retry_with_room() {
+    size_t needed = room_needed;
+    room_needed = 0;
+    if (needed == 0) {
+        return 0;   // A genuine ENOSPC
+    }
+
+    pthread_rwlock_wrlock(&map_lock);
+    int ret = 0;
+    if (global_superblock->head + needed > disk_size) {   // Another thread may have made room
+        ret = make_room(needed);
+    }
+    pthread_rwlock_unlock(&map_lock);
+    return ret == 0;
+}
+
+// Append the inode table as a checkpoint and point the superblock at it once it is durable.
+// A full log is left to the operations that need the room. Caller holds map_lock
+// exclusively, so the table is not changing and every transaction below head is complete.
+int write_checkpoint() {
+    if (!inode_table) {
+        return 0;
+    }
+    uint32_t inodes = inode_table->len < next_inode ? inode_table->len : next_inode;
+    size_t len = wfs_record_len(sizeof(struct wfs_checkpoint) + inodes * sizeof(uint64_t));
+    uint64_t offset = reserve_log(len);
+    if (offset == 0) {
+        room_needed = 0;
+        return -ENOSPC;
+    }
+
+    struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)global_superblock + offset);
+    memset(&entry->inode, 0, sizeof(struct wfs_inode));
+    entry->inode.flags = WFS_INODE_CHECKPOINT;
+    entry->inode.size = sizeof(struct wfs_checkpoint) + inodes * sizeof(uint64_t);
+    entry->inode.ctime = time(NULL);
+    entry->length = len;
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)entry->data;
+    checkpoint->head = offset - WFS_COMMIT_LEN;
+    checkpoint->dead_bytes = dead_bytes;
+    checkpoint->count = inodes;
+    checkpoint->next_inode = next_inode;
+    memcpy(checkpoint->offsets, inode_table->offsets, inodes * sizeof(uint64_t));
+
+    int ret = commit_log(entry, len);
+    if (ret == 0) {
+        ret = sync_log(0);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    uint64_t old = global_superblock->checkpoint;
+    global_superblock->checkpoint = offset;
+    ret = sync_range(0, sizeof(struct wfs_sb));
+    if (old >= compact_base) {
+        dead_bytes += wfs_entry_len((struct wfs_log_entry *)((char *)global_superblock + old));
+    }
+    checkpointed_head = global_superblock->head;
+    count(&checkpoints, 1);
+    return ret;
+}
+
+// Inode numbers are handed out from a high-water mark kept in the superblock, so allocation
+// never has to look at the log. Caller holds namespace_lock.
+int find_new_inode() {
+    int newInode = next_inode++;
+    global_superblock->next_inode = next_inode;
+    return newInode;
+}
+
+// Directory inserts. An inline directory is copied whole with the new dentry appended until
+// that would take it past WFS_DIR_INLINE_MAX names, when it is turned into pages. A paged
+// directory gets the page the name hashes to rewritten, or split once it holds
+// WFS_DIR_PAGE_MAX names, and a new index version (see wfs.h). dir_insert_plan() works out
+// what has to be appended so the caller can reserve it together with its own entries, and
+// dir_insert_write() fills it in. dir_remove_plan() plans the opposite: the directory, or the
+// page the name hashes to, rewritten without it. Pages are never merged back; one left empty
+// is dropped from the slots it served. Caller holds namespace_lock throughout.
+struct dir_insert {
+    struct wfs_log_entry *dir;      // current version of the directory
+    size_t len;                     // bytes to append
+    int paged;                      // the new version is paged
+    int full;                       // the new version lists every slot
+    const char *name;               // being inserted or removed
+    uint32_t inode_number;          // the inserted name is for
+    uint32_t hash;                  // of the name
+    uint32_t global_depth;          // of the new version
+    uint32_t local_depth;           // of the page the name went into, before any split
+    int split;                      // that page becomes two with local_depth + 1
+    struct wfs_dir_page *pages[2];  // new pages, NULL if empty
+    uint32_t page_bytes[2];         // of dentries in them
+    uint64_t *old_slots;            // every slot of the current version, for a full version
+    int remove;                     // removing name rather than inserting it
+    uint32_t removed_bytes;         // of dentries carrying it
+    uint32_t entries;               // names in the new version
+};
+
+void dir_insert_free(struct dir_insert *insert) {
+    free(insert->pages[0]);
+    free(insert->pages[1]);
+    free(insert->old_slots);
+}
+
+int dir_insert_plan(struct dir_insert *insert, struct wfs_log_entry *dir, const char *name, uint32_t inode_number) {
+    memset(insert, 0, sizeof(*insert));
+    insert->dir = dir;
+    insert->name = name;
+    insert->inode_number = inode_number;
+    uint32_t name_bytes = wfs_dentry_len(strlen(name));
+
+    char *old = dir->data;
+    uint32_t old_bytes = dir->inode.size;
+    if (!(dir->inode.flags & WFS_INODE_PAGED)) {
+        insert->entries = wfs_dir_count(dir) + 1;
+        if (insert->entries <= WFS_DIR_INLINE_MAX) {
+            insert->len = wfs_record_len(dir->inode.size + name_bytes);
+            return 0;
+        }
+    }
+
+    // An inline directory becomes a single page serving the only slot, then splits
+    insert->paged = 1;
+    insert->full = 1;
+    insert->hash = wfs_name_hash(name);
+    uint32_t old_count = insert->entries - 1;
+    if (dir->inode.flags & WFS_INODE_PAGED) {
+        struct wfs_dir_index *index = (struct wfs_dir_index *)dir->data;
+        insert->entries = index->entries + 1;
+        insert->global_depth = index->global_depth;
+        insert->full = index->depth + 1 > WFS_MAX_DIR_DEPTH;
+
+        uint64_t page_offset;
+        int ret = wfs_dir_find_page(global_superblock, dir, insert->hash & ((1u << index->global_depth) - 1), &page_offset);
+        if (ret != 0) {
+            return ret;
+        }
+        if (page_offset != 0) {
+            struct wfs_log_entry *page_entry = (struct wfs_log_entry *)((char *)global_superblock + page_offset);
+            struct wfs_dir_page *page = (struct wfs_dir_page *)page_entry->data;
+            old = page->dentries;
+            old_bytes = page_entry->inode.size - sizeof(struct wfs_dir_page);
+            old_count = page->count;
+            insert->local_depth = page->local_depth;
+        } else {
+            old_bytes = 0;
+            old_count = 0;
+            insert->local_depth = index->global_depth;  // A new page for just this slot
+        }
+    }
+
+    insert->split = old_count >= WFS_DIR_PAGE_MAX && insert->local_depth < WFS_DIR_MAX_GLOBAL_DEPTH;
+    if (insert->split && insert->local_depth == insert->global_depth) {
+        insert->global_depth++;     // The slots double, so every one is listed
+        insert->full = 1;
+    }
+
+    if (insert->full && (dir->inode.flags & WFS_INODE_PAGED)) {
+        insert->old_slots = calloc(1u << ((struct wfs_dir_index *)dir->data)->global_depth, sizeof(uint64_t));
+        if (!insert->old_slots) {
+            return -ENOMEM;
+        }
+        int ret = wfs_dir_slots(global_superblock, dir, insert->old_slots);
+        if (ret != 0) {
+            dir_insert_free(insert);
+            return ret;
+        }
+    }
+
+    // Build the new page(s): a split sends each name by the next bit of its hash
+    int page_count = insert->split ? 2 : 1;
+    for (int i = 0; i < page_count; i++) {
+        insert->pages[i] = calloc(1, sizeof(struct wfs_dir_page) + old_bytes + name_bytes);
+        if (!insert->pages[i]) {
+            dir_insert_free(insert);
+            return -ENOMEM;
+        }
+        insert->pages[i]->local_depth = insert->local_depth + insert->split;
+    }
+    char *pos = old;
+    for (uint32_t i = 0; i <= old_count; i++) {
+        struct wfs_dentry *dentry = (struct wfs_dentry *)pos;
+        const char *entry_name = i < old_count ? dentry->name : name;
+        int half = insert->split ? (wfs_name_hash(entry_name) >> insert->local_depth) & 1 : 0;
+        struct wfs_dir_page *page = insert->pages[half];
+        insert->page_bytes[half] += wfs_put_dentry((struct wfs_dentry *)(page->dentries + insert->page_bytes[half]), entry_name,
+                                                   i < old_count ? dentry->inode_number : inode_number);
+        page->count++;
+        if (i < old_count) {
+            pos = (char *)wfs_next_dentry(dentry);
+        }
+    }
+
+    for (int i = 0; i < page_count; i++) {
+        if (insert->pages[i]->count == 0) {
+            free(insert->pages[i]);
+            insert->pages[i] = NULL;
+            continue;
+        }
+        insert->len += wfs_record_len(sizeof(struct wfs_dir_page) + insert->page_bytes[i]);
+    }
+
+    uint32_t slots = insert->full ? 1u << insert->global_depth : 1u << (insert->global_depth - insert->local_depth);
+    insert->len += wfs_record_len(sizeof(struct wfs_dir_index) + slots * sizeof(struct wfs_dir_slot));
+    return 0;
+}
+
+// Returns -ENOENT if the directory does not hold name
+int dir_remove_plan(struct dir_insert *insert, struct wfs_log_entry *dir, const char *name) {
+    memset(insert, 0, sizeof(*insert));
+    insert->dir = dir;
+    insert->name = name;
+    insert->remove = 1;
+
+    if (!(dir->inode.flags & WFS_INODE_PAGED)) {
+        uint32_t removed = 0;
+        for (char *pos = dir->data; pos < dir->data + dir->inode.size; pos = (char *)wfs_next_dentry((struct wfs_dentry *)pos)) {
+            struct wfs_dentry *dentry = (struct wfs_dentry *)pos;
+            if (strcmp(dentry->name, name) == 0) {
+                insert->removed_bytes += wfs_dentry_len(dentry->name_len);
+                removed++;
+            }
+            insert->entries++;
+        }
+        if (removed == 0) {
+            return -ENOENT;
+        }
+        insert->entries -= removed;
+        insert->len = wfs_record_len(dir->inode.size - insert->removed_bytes);
+        return 0;
+    }
+
+    struct wfs_dir_index *index = (struct wfs_dir_index *)dir->data;
+    insert->paged = 1;
+    insert->hash = wfs_name_hash(name);
+    insert->global_depth = index->global_depth;
+    insert->full = index->depth + 1 > WFS_MAX_DIR_DEPTH;
+
+    uint64_t page_offset;
+    int ret = wfs_dir_find_page(global_superblock, dir, insert->hash & ((1u << index->global_depth) - 1), &page_offset);
+    if (ret != 0) {
+        return ret;
+    }
+    if (page_offset == 0) {
+        return -ENOENT;
+    }
+    struct wfs_log_entry *page_entry = (struct wfs_log_entry *)((char *)global_superblock + page_offset);
+    struct wfs_dir_page *page = (struct wfs_dir_page *)page_entry->data;
+    insert->local_depth = page->local_depth;
+
+    insert->pages[0] = calloc(1, page_entry->inode.size);
+    if (!insert->pages[0]) {
+        return -ENOMEM;
+    }
+    insert->pages[0]->local_depth = page->local_depth;
+    uint32_t removed = 0;
+    char *pos = page->dentries;
+    for (uint32_t i = 0; i < page->count; i++) {
+        struct wfs_dentry *dentry = (struct wfs_dentry *)pos;
+        if (strcmp(dentry->name, name) == 0) {
+            insert->removed_bytes += wfs_dentry_len(dentry->name_len);
+            removed++;
+        } else {
+            insert->page_bytes[0] += wfs_put_dentry((struct wfs_dentry *)(insert->pages[0]->dentries + insert->page_bytes[0]), dentry->name, dentry->inode_number);
+            insert->pages[0]->count++;
+        }
+        pos = (char *)wfs_next_dentry(dentry);
+    }
+    if (removed == 0) {
+        dir_insert_free(insert);
+        return -ENOENT;
+    }
+    insert->entries = index->entries - removed;
+    if (insert->pages[0]->count == 0) {
+        free(insert->pages[0]);
+        insert->pages[0] = NULL;
+    } else {
+        insert->len += wfs_record_len(sizeof(struct wfs_dir_page) + insert->page_bytes[0]);
+    }
+
+    if (insert->full) {
+        insert->old_slots = calloc(1u << index->global_depth, sizeof(uint64_t));
+        if (!insert->old_slots) {
+            dir_insert_free(insert);
+            return -ENOMEM;
+        }
+        ret = wfs_dir_slots(global_superblock, dir, insert->old_slots);
+        if (ret != 0) {
+            dir_insert_free(insert);
+            return ret;
+        }
+    }
+
+    uint32_t slots = insert->full ? 1u << insert->global_depth : 1u << (insert->global_depth - insert->local_depth);
+    insert->len += wfs_record_len(sizeof(struct wfs_dir_index) + slots * sizeof(struct wfs_dir_slot));
+    return 0;
+}
+
+// Write the records planned by dir_insert_plan() or dir_remove_plan() at dest, log offset
+// offset, and return the new version of the directory
+struct wfs_log_entry *dir_insert_write(struct dir_insert *insert, char *dest, uint64_t offset) {
+    struct wfs_log_entry *dir = insert->dir;
+    size_t new_size = insert->remove ? dir->inode.size - insert->removed_bytes : dir->inode.size + wfs_dentry_len(strlen(insert->name));
+
+    if (!insert->paged) {
+        struct wfs_log_entry *version = (struct wfs_log_entry *)dest;
+        version->inode = dir->inode;
+        version->inode.size = new_size;
+        version->length = wfs_record_len(new_size);
+        if (!insert->remove) {
+            memcpy(version->data, dir->data, dir->inode.size);
+            wfs_put_dentry((struct wfs_dentry *)(version->data + dir->inode.size), insert->name, insert->inode_number);
+            return version;
+        }
+
+        char *kept = version->data;
+        for (char *pos = dir->data; pos < dir->data + dir->inode.size; pos = (char *)wfs_next_dentry((struct wfs_dentry *)pos)) {
+            struct wfs_dentry *dentry = (struct wfs_dentry *)pos;
+            if (strcmp(dentry->name, insert->name) != 0) {
+                memcpy(kept, dentry, wfs_dentry_len(dentry->name_len));
+                kept += wfs_dentry_len(dentry->name_len);
+            }
+        }
+        return version;
+    }
+
+    uint64_t page_offsets[2] = {0, 0};
+    size_t written = 0;
+    for (int i = 0; i < 2; i++) {
+        if (!insert->pages[i]) {
+            continue;
+        }
+        struct wfs_log_entry *page_entry = (struct wfs_log_entry *)(dest + written);
+        page_entry->inode = dir->inode;
+        page_entry->inode.flags = WFS_INODE_DATA;
+        page_entry->inode.size = sizeof(struct wfs_dir_page) + insert->page_bytes[i];
+        page_entry->length = wfs_record_len(page_entry->inode.size);
+        memcpy(page_entry->data, insert->pages[i], page_entry->inode.size);
+        page_offsets[i] = offset + written;
+        written += wfs_entry_len(page_entry);
+    }
+
+    struct wfs_log_entry *version = (struct wfs_log_entry *)(dest + written);
+    version->inode = dir->inode;
+    version->inode.flags = WFS_INODE_PAGED;
+    version->inode.size = new_size;
+
+    struct wfs_dir_index *index = (struct wfs_dir_index *)version->data;
+    index->global_depth = insert->global_depth;
+    index->entries = insert->entries;
+    if (insert->full) {
+        index->prev = 0;
+        index->depth = 0;
+        index->count = 1u << insert->global_depth;
+        uint32_t old_mask = (dir->inode.flags & WFS_INODE_PAGED) ? (1u << ((struct wfs_dir_index *)dir->data)->global_depth) - 1 : 0;
+        for (uint32_t slot = 0; slot < index->count; slot++) {
+            index->slots[slot].slot = slot;
+            index->slots[slot].reserved = 0;
+            index->slots[slot].page = insert->old_slots ? insert->old_slots[slot & old_mask] : 0;
+        }
+    } else {
+        index->prev = (char *)dir - (char *)global_superblock;
+        index->depth = ((struct wfs_dir_index *)dir->data)->depth + 1;
+        index->count = 0;
+    }
+
+    // The slots that shared the old page, in order
+    uint32_t first = insert->hash & ((1u << insert->local_depth) - 1);
+    for (uint32_t slot = first; slot < (1u << insert->global_depth); slot += 1u << insert->local_depth) {
+        uint64_t page = page_offsets[insert->split ? (slot >> insert->local_depth) & 1 : 0];
+        if (insert->full) {
+            index->slots[slot].page = page;
+        } else {
+            index->slots[index->count].slot = slot;
+            index->slots[index->count].reserved = 0;
+            index->slots[index->count].page = page;
+            index->count++;
+        }
+    }
+
+    version->length = wfs_content_len(version);
+    return version;
+}
+
+struct wfs_log_entry* find_entry_by_inode(int inode) {
+    TRACE("find_entry_by_inode: %d\n", inode);
+    uint64_t offset = inode < 0 ? 0 : inode_offset(inode);
+    if (offset == 0) {
+        TRACE("Inode %d not found or deleted\n", inode);
+        return NULL;
+    }
+
+    struct wfs_log_entry *found_entry = (struct wfs_log_entry *)((char *)global_superblock + offset);
+    if (found_entry->inode.deleted == 1) { // also check if deleted
+        TRACE("Inode %d not found or deleted\n", inode);
+        return NULL;
+    }
+
+    TRACE("Found entry by inode %d\n", found_entry->inode.inode_number);
+    return found_entry;
+}
+
+// Walks the components of a path without copying it. Each call copies the next component
+// into name, where the dcache and the dentries want it NUL-terminated, and steps past it, so
+// resolving a path takes nothing but the caller's stack. Returns the component's length, 0
+// once none are left, or -ENAMETOOLONG for one that no dentry can hold.
+struct path_iter {
+    const char *next;
+    const char *end;
+};
+
+int path_next(struct path_iter *iter, char name[MAX_FILE_NAME_LEN]) {
+    while (iter->next < iter->end && *iter->next == '/') {
+        iter->next++;
+    }
+    const char *component = iter->next;
+    const char *slash = memchr(component, '/', iter->end - component);
+    iter->next = slash ? slash : iter->end;
+
+    size_t len = iter->next - component;
+    if (len >= MAX_FILE_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, component, len);
+    name[len] = '\0';
+    return len;
+}
+
+// Resolves the first path_len bytes of path, so a caller can look up a parent in place
+struct wfs_log_entry *looper_len(const char *path, size_t path_len, mode_t mode) {
+    TRACE("Get looper: %.*s\n", (int)path_len, path);
+    count(&lookups, 1);
+    // Check if the global superblock has been mapped
+    if (!global_superblock) {
+        fprintf(stderr, "Disk file not mapped\n");
+        return NULL;
+    }
+
+    struct path_iter iter = {path, path + path_len};
+    char name[MAX_FILE_NAME_LEN];
+    unsigned int current_inode = 0; // Start with root inode
+    int len;
+
+    while ((len = path_next(&iter, name)) != 0) {
+        if (len < 0) {
+            return NULL;
+        }
+        count(&lookup_components, 1);
+        int cached_inode = dcache_lookup(current_inode, name);
+        if (cached_inode == DCACHE_NEGATIVE) {
+            count(&dcache_hits, 1);
+            TRACE("%.*s negative dentry for %s\n", (int)path_len, path, name);
+            return NULL;
+        }
+        if (cached_inode != DCACHE_MISS) {
+            count(&dcache_hits, 1);
+            current_inode = cached_inode;
+            continue;
+        }
+
+        unsigned int generation = dcache_begin();
+        struct wfs_log_entry *found_entry = find_entry_by_inode(current_inode);
+        if (!found_entry) {
+            // Token not found in the log, path  does not exist
+            TRACE("%.*s Not found in looper\n", (int)path_len, path);
+            return NULL;
+        }
+
+        uint32_t child_inode;
+        if (wfs_dir_lookup(global_superblock, found_entry, name, &child_inode) != 0) {
+            dcache_insert(current_inode, name, DCACHE_NEGATIVE, generation);
+            return NULL;
+        }
+        dcache_insert(current_inode, name, child_inode, generation);
+        current_inode = child_inode;
+    }
+
+    return find_entry_by_inode(current_inode); // Return the pointer to the last found entry
+}
+
+struct wfs_log_entry* looper(const char *path, mode_t mode) {
+    return looper_len(path, strlen(path), mode);
+}
+
+// Splits path into the length of its parent's path, which looper_len() resolves in place,
+// and its last component, copied into name
+int split_path(const char *path, size_t *parent_len, char name[MAX_FILE_NAME_LEN]) {
+    const char *last_slash = strrchr(path, '/');
+    if (!last_slash || last_slash[1] == '\0') {
+        return -EINVAL;
+    }
+    size_t len = strlen(last_slash + 1);
+    if (len >= MAX_FILE_NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, last_slash + 1, len + 1);
+    *parent_len = last_slash - path;
+    return 0;
+}
+
+// The contents of /.wfs_stats: one "name value" line per counter, then a table of calls,
+// errors and latencies per callback. Caller holds map_lock shared.
+int format_stats(char *buf, size_t size) {
+    pthread_mutex_lock(&index_lock);
+    uint64_t dead = dead_bytes;
+    pthread_mutex_unlock(&index_lock);
+    pthread_mutex_lock(&commit_lock);
+    uint64_t transactions = commit_seq;
+    uint64_t pending = complete_head - synced_head;
+    pthread_mutex_unlock(&commit_lock);
+    uint64_t block_hits, block_misses;
+    wfs_block_cache_stats(&block_hits, &block_misses);
+    pthread_mutex_lock(&dedup_lock);
+    size_t dedup_entries = dedup_table.used;
+    pthread_mutex_unlock(&dedup_lock);
+
+    int len = snprintf(buf, size,
+                       "uptime_s %.1f\n"
+                       "disk_size %lu\n"
+                       "log_head %lu\n"
+                       "dead_bytes %lu\n"
+                       "bytes_appended %lu\n"
+                       "transactions %lu\n"
+                       "unsynced_bytes %lu\n"
+                       "inodes %u\n"
+                       "lookups %lu\n"
+                       "lookup_components %lu\n"
+                       "dcache_hits %lu\n"
+                       "dcache_entries %u\n"
+                       "index_rebuilds %lu\n"
+                       "scanned_entries %lu\n"
+                       "checkpoints %lu\n"
+                       "compactions %u\n"
+                       "compacted_bytes %lu\n"
+                       "max_compaction_pause_ms %.3f\n"
+                       "disk_grows %lu\n"
+                       "compression %d\n"
+                       "data_written %lu\n"
+                       "data_stored %lu\n"
+                       "block_cache_hits %lu\n"
+                       "block_cache_misses %lu\n"
+                       "dedup %d\n"
+                       "dedup_chunks %lu\n"
+                       "dedup_shared %lu\n"
+                       "dedup_ms %.1f\n"
+                       "dedup_index_entries %zu\n"
+                       "writeback_writes %lu\n"
+                       "writeback_appends %lu\n"
+                       "readahead_bytes %lu\n"
+                       "read_cache_hits %lu\n"
+                       "read_cache_misses %lu\n"
+                       "\n%-8s %12s %8s %10s %10s %10s %10s\n",
+                       (monotonic_ns() - mount_ns) / 1e9, disk_size, __atomic_load_n(&global_superblock->head, __ATOMIC_RELAXED),
+                       dead, __atomic_load_n(&bytes_appended, __ATOMIC_RELAXED), transactions, pending, next_inode,
+                       __atomic_load_n(&lookups, __ATOMIC_RELAXED), __atomic_load_n(&lookup_components, __ATOMIC_RELAXED),
+                       __atomic_load_n(&dcache_hits, __ATOMIC_RELAXED), __atomic_load_n(&dcache_entries, __ATOMIC_RELAXED),
+                       index_rebuilds, scanned_entries, checkpoints, compactions, compacted_bytes, max_compaction_pause * 1e3, disk_grows,
+                       compression, __atomic_load_n(&data_written, __ATOMIC_RELAXED),
+                       __atomic_load_n(&data_stored, __ATOMIC_RELAXED), block_hits, block_misses, deduplication,
+                       __atomic_load_n(&dedup_chunks, __ATOMIC_RELAXED), __atomic_load_n(&dedup_shared, __ATOMIC_RELAXED),
+                       __atomic_load_n(&dedup_ns, __ATOMIC_RELAXED) / 1e6, dedup_entries,
+                       __atomic_load_n(&writeback_writes, __ATOMIC_RELAXED),
+                       __atomic_load_n(&writeback_appends, __ATOMIC_RELAXED),
+                       __atomic_load_n(&readahead_bytes, __ATOMIC_RELAXED),
+                       __atomic_load_n(&read_cache_hits, __ATOMIC_RELAXED),
+                       __atomic_load_n(&read_cache_misses, __ATOMIC_RELAXED),
+                       "op", "calls", "errors", "avg_us", "p50_us", "p99_us", "max_us");
+
+    for (int kind = 0; kind < STAT_KINDS && len < size; kind++) {
+        struct latency_stats *stats = &latencies[kind];
+        uint64_t calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+        len += snprintf(buf + len, size - len, "%-8s %12lu %8lu %10.1f %10.1f %10.1f %10.1f\n", stat_names[kind], calls,
+                        __atomic_load_n(&stats->errors, __ATOMIC_RELAXED),
+                        calls ? __atomic_load_n(&stats->total_ns, __ATOMIC_RELAXED) / 1e3 / calls : 0.0,
+                        stats_percentile(stats, calls, 0.5), stats_percentile(stats, calls, 0.99),
+                        __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED) / 1e3);
+    }
+    return len < size ? len : size - 1;
+}
+
+int stats_getattr(struct stat *stbuf) {
+    char buf[STATS_MAX_LEN];
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_size = format_stats(buf, sizeof(buf));
+    stbuf->st_mtime = time(NULL);
+    return 0;
+}
+
+// The file is formatted afresh for every read; it is opened with direct_io, so its size
+// changing between getattr and read does not matter
+int stats_read(char *buf, size_t size, off_t offset) {
+    char stats[STATS_MAX_LEN];
+    int len = format_stats(stats, sizeof(stats));
+    if (offset >= len) {
+        return 0;
+    }
+    if (size > len - offset) {
+        size = len - offset;
+    }
+    memcpy(buf, stats + offset, size);
+    return size;
+}
+
+// Open files. Opening a file resolves its path once and keeps the inode number in an
+// open_file behind fi->fh, so reads and writes through the handle find the file in the inode
+// table without walking the path again (entries move, so the pointer itself is not kept). In
+// batched mode a handle opened for writing also holds small writes that each continue the one
+// before (appends by echo >>, loggers, small-block copies) in a buffer of writeback_bytes, and
+// appends them as one write once the buffer fills, a write does not continue it, or the
+// handle is flushed, fsynced or released, the points batched mode makes durable anyway.
+// Reading a file through any handle or path first appends what handles hold for it, and
+// getattr reports the size their bytes will give it.
+#define WRITEBACK_DEFAULT (64 * 1024)
+
+// The kernel reads ahead within a file, but a file's extents are scattered through the log,
+// so its reads still fault the image in a page at a time. A handle counts the reads that each
+// continue the one before, and once READAHEAD_AFTER have, has the kernel start reading the log
+// behind the next readahead_window bytes of the file (MADV_WILLNEED), topping the window up
+// whenever the reader has used half of it.
+#define READAHEAD_DEFAULT (4 * 1024 * 1024)
+#define READAHEAD_AFTER 2
+
+struct open_file {
+    uint32_t inode;
+    int buffered;               // may hold writes, and is on the open_files list
+    pthread_mutex_t lock;       // guards the fields below
+    char *buf;                  // writeback_bytes, allocated by the first write held
+    uint64_t offset;            // file offset of buf[0]
+    size_t len;                 // bytes held
+    uint64_t next_read;         // file offset just past the last read through the handle
+    unsigned int sequential;    // reads in a row that started there
+    uint64_t prefetched;        // file offset the log has been prefetched up to
+    struct open_file *prev;
+    struct open_file *next;
+};
+
+size_t writeback_bytes = WRITEBACK_DEFAULT;    // 0 never buffers
+size_t readahead_window = READAHEAD_DEFAULT;    // 0 never prefetches
+pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+struct open_file *open_files = NULL;
+unsigned int holding_files = 0;     // handles holding bytes, so reads skip the list when none do
+
+static struct open_file *open_file_of(struct fuse_file_info *fi) {
+    return fi ? (struct open_file *)(uintptr_t)fi->fh : NULL;
+}
+
+// Write the latest version of inode. Another write to the file may have appended a newer
+// version than the caller saw while it waited for the lock.
+static int write_inode(uint32_t inode, struct fuse_bufvec *buf, off_t offset) {
+    pthread_mutex_lock(&inode_locks[inode % INODE_LOCKS]);
+    struct wfs_log_entry *file_entry = find_entry_by_inode(inode);
+    int ret = file_entry ? write_extents(file_entry, buf, offset) : -ENOENT;
+    pthread_mutex_unlock(&inode_locks[inode % INODE_LOCKS]);
+    return ret;
+}
+
+// Append the bytes file holds. They are kept on -ENOSPC for the caller to retry once room
+// has been made, and dropped on other errors, which are returned. Those of a file removed
+// since are dropped quietly. Caller holds map_lock shared and file->lock.
+static int writeback_append(struct open_file *file) {
+    if (file->len == 0) {
+        return 0;
+    }
+
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(file->len);
+    bufv.buf[0].mem = file->buf;
+    int ret = write_inode(file->inode, &bufv, file->offset);
+    if (ret == -ENOSPC) {
+        return ret;
+    }
+    file->len = 0;
+    __atomic_sub_fetch(&holding_files, 1, __ATOMIC_RELEASE);
+    count(&writeback_appends, 1);
+    return ret < 0 && ret != -ENOENT ? ret : 0;
+}
+
+// Append the bytes every handle but except holds for inode, so a read sees them, or a write
+// is not overwritten by older bytes appended after it. Caller holds map_lock shared and no
+// handle's lock.
+static int writeback_sync_inode(uint32_t inode, struct open_file *except) {
+    if (__atomic_load_n(&holding_files, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (struct open_file *file = open_files; file && ret == 0; file = file->next) {
+        if (file->inode == inode && file != except) {
+            pthread_mutex_lock(&file->lock);
+            ret = writeback_append(file);
+            pthread_mutex_unlock(&file->lock);
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return ret;
+}
+
+// Append the bytes every handle holds. Caller holds map_lock shared and no handle's lock.
+static int writeback_sync_all() {
+    if (__atomic_load_n(&holding_files, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (struct open_file *file = open_files; file && ret == 0; file = file->next) {
+        pthread_mutex_lock(&file->lock);
+        ret = writeback_append(file);
+        pthread_mutex_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return ret;
+}
+
+// The size the bytes handles hold would give inode, or 0
+static uint64_t writeback_size(uint32_t inode) {
+    if (__atomic_load_n(&holding_files, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    uint64_t size = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (struct open_file *file = open_files; file; file = file->next) {
+        if (file->inode == inode) {
+            pthread_mutex_lock(&file->lock);
+            if (file->len > 0 && file->offset + file->len > size) {
+                size = file->offset + file->len;
+            }
+            pthread_mutex_unlock(&file->lock);
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return size;
+}
+
+// Hold a write in file's buffer if it is small and continues the bytes held. Returns its
+// size if it was held, 0 if it has to be written to the log (after what the buffer held,
+// which is appended first), or an error. Caller holds map_lock shared.
+static int writeback_write(struct open_file *file, struct fuse_bufvec *buf, off_t offset) {
+    size_t size = fuse_buf_size(buf);
+    pthread_mutex_lock(&file->lock);
+    if (file->len > 0 && (offset != file->offset + file->len || file->len + size > writeback_bytes)) {
+        int ret = writeback_append(file);
+        if (ret != 0) {
+            pthread_mutex_unlock(&file->lock);
+            return ret;
+        }
+    }
+    if (size >= writeback_bytes || (!file->buf && !(file->buf = malloc(writeback_bytes)))) {
+        pthread_mutex_unlock(&file->lock);
+        return 0;
+    }
+
+    struct fuse_bufvec dest = FUSE_BUFVEC_INIT(size);
+    dest.buf[0].mem = file->buf + file->len;
+    if (fuse_buf_copy(&dest, buf, 0) != (ssize_t)size) {
+        pthread_mutex_unlock(&file->lock);
+        return -EIO;
+    }
+    if (file->len == 0) {
+        file->offset = offset;
+        __atomic_add_fetch(&holding_files, 1, __ATOMIC_RELEASE);
+    }
+    file->len += size;
+    pthread_mutex_unlock(&file->lock);
+    count(&writeback_writes, 1);
+    return size;
+}
+
+// The latest version of the file fi was opened on, or else the one path names, after
+// appending any bytes handles hold for it
+static int find_file_for_read(const char *path, struct fuse_file_info *fi, struct wfs_log_entry **file_entry) {
+    struct open_file *file = open_file_of(fi);
+    uint32_t inode;
+    if (file) {
+        inode = file->inode;
+    } else {
+        struct wfs_log_entry *entry = looper(path, 0);
+        if (!entry) {
+            return -ENOENT;
+        }
+        inode = entry->inode.inode_number;
+    }
+
+    int ret = writeback_sync_inode(inode, NULL);
+    if (ret != 0) {
+        return ret;
+    }
+    *file_entry = find_entry_by_inode(inode);
+    return *file_entry ? 0 : -ENOENT;
+}
+
+// Backends that do not read through the page cache have nothing to prefetch into
+static void advise_willneed(uint64_t start, uint64_t end) {
+    if (end > start && storage->prefetch) {
+        storage->prefetch(start, end);
+        count(&readahead_bytes, end - start);
+    }
+}
+
+// Ask the kernel to start reading the log bytes behind [from, to) of the file. Extents next
+// to each other in the log, as a streamed write leaves them, are advised as one range.
+// Caller holds map_lock shared.
+static void prefetch_file(struct wfs_log_entry *file_entry, uint64_t from, uint64_t to) {
+    struct wfs_extent inline_extent = {
+        .file_offset = 0,
+        .log_offset = file_entry->data - (char *)global_superblock,
+        .length = file_entry->inode.size,
+    };
+    struct wfs_extent *extents = &inline_extent;
+    uint32_t extent_count = 1;
+    if ((file_entry->inode.flags & WFS_INODE_EXTENTS) &&
+        wfs_collect_extents(global_superblock, file_entry, &extents, &extent_count) != 0) {
+        return;
+    }
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = 0, end = 0;   // the range being gathered
+    for (uint32_t i = 0; i < extent_count; i++) {
+        struct wfs_extent *extent = &extents[i];
+        uint64_t lo = extent->file_offset > from ? extent->file_offset : from;
+        uint64_t hi = extent->file_offset + extent->length < to ? extent->file_offset + extent->length : to;
+        if (lo >= hi) {
+            continue;
+        }
+
+        // A compressed block is decompressed whole, and its record is never longer than this
+        uint64_t first, last;
+        if (extent->block & WFS_EXTENT_COMPRESSED) {
+            first = extent->log_offset;
+            last = first + wfs_record_len(WFS_BLOCK_SIZE);
+        } else {
+            first = extent->log_offset + (lo - extent->file_offset);
+            last = first + (hi - lo);
+        }
+        first &= ~(page - 1);
+        last = last < disk_size ? last : disk_size;
+
+        if (end > start && first >= start && first <= end + page) {
+            end = last > end ? last : end;
+            continue;
+        }
+        advise_willneed(start, end);
+        start = first;
+        end = last;
+    }
+    advise_willneed(start, end);
+
+    if (extents != &inline_extent) {
+        free(extents);
+    }
+}
+
+// Note a read of size bytes at offset through file, and prefetch ahead of it once it streams.
+// Caller holds map_lock shared.
+static void readahead_note(struct open_file *file, struct wfs_log_entry *file_entry, off_t offset, size_t size) {
+    if (!file || readahead_window == 0) {
+        return;
+    }
+    uint64_t from = 0, to = 0;
+    pthread_mutex_lock(&file->lock);
+    if ((uint64_t)offset == file->next_read) {
+        file->sequential++;
+    } else {
+        file->sequential = 0;
+        file->prefetched = 0;
+    }
+    file->next_read = offset + size;
+    if (file->sequential >= READAHEAD_AFTER && file->prefetched < file->next_read + readahead_window / 2 &&
+        file->next_read < file_entry->inode.size) {
+        from = file->prefetched > file->next_read ? file->prefetched : file->next_read;
+        to = file->next_read + readahead_window;
+        file->prefetched = to;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    if (from < to) {
+        prefetch_file(file_entry, from, to);
+    }
+}
+
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+    TRACE("GetAttr ******************************\n");
+    TRACE("Get path: %s\n", path);
+    memset(stbuf, 0, sizeof(struct stat)); // Initialize the stat structure
+    if (is_stats_path(path)) {
+        return stats_getattr(stbuf);
+    }
+
+    struct wfs_log_entry *entry = looper(path, 0); // Use looper to find the log entry for the path
+    if (!entry) {
+        TRACE("Fails here for path: %s\n", path);
+        return -ENOENT; // File or directory not found
+    }
+
+    // Fill the stat structure with the file/directory attributes
+    stbuf->st_mode = entry->inode.mode;
+    stbuf->st_nlink = entry->inode.links;
+    stbuf->st_uid = entry->inode.uid;
+    stbuf->st_gid = entry->inode.gid;
+    stbuf->st_size = entry->inode.size;
+    stbuf->st_mtime = entry->inode.mtime;
+
+    // Writes still held in write-back buffers count
+    if (S_ISREG(entry->inode.mode)) {
+        uint64_t held = writeback_size(entry->inode.inode_number);
+        if (held > stbuf->st_size) {
+            stbuf->st_size = held;
+        }
+    }
+
+    return 0; // Return success
+}
+
+static int wfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    TRACE("Entering mknod path: %s *********************************\n", path);
+    // Check if superblock is properly mapped
+    if (!global_superblock) {
+        fprintf(stderr, "Superblock not mapped\n");
+        return -EIO;
+    }
+    if (read_only) {
+        return -EROFS;
+    }
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+
+    if (strcmp(path, "/") == 0) {
+        // Path is the root directory, no parent
+        return -EISDIR;
+    }
+
+    size_t parent_len;
+    char new_path[MAX_FILE_NAME_LEN];
+    int ret = split_path(path, &parent_len, new_path);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_log_entry *parent_dir_entry = looper_len(path, parent_len, S_IFDIR);
+    if (!parent_dir_entry) {
+        return -ENOENT;  // Parent directory not found
+    }
+
+    TRACE("New path: %s\n", new_path);
+    TRACE("Parent path: %.*s\n", (int)parent_len, path);
+    // Prepare the new file entry
+    int newInode = find_new_inode();
+    TRACE("Created new dentry with name %s\n", new_path);
+
+    // The new inode followed by what the parent needs to gain the dentry
+    struct dir_insert insert;
+    ret = dir_insert_plan(&insert, parent_dir_entry, new_path, newInode);
+    if (ret != 0) {
+        return ret;
+    }
+    size_t file_len = wfs_record_len(sizeof(struct wfs_extent_list));
+    size_t needed = file_len + insert.len;
+    uint64_t offset = reserve_log(needed);
+    if (offset == 0) {
+        dir_insert_free(&insert);
+        return -ENOSPC;
+    }
+
+    // Create a new log entry for the file
+    struct wfs_log_entry *newFileEntry = (struct wfs_log_entry *)((char *)global_superblock + offset);
+    memset(&newFileEntry->inode, 0, sizeof(struct wfs_inode));
+    newFileEntry->inode.mode = S_IFREG | mode;
+    newFileEntry->inode.inode_number = newInode;
+    newFileEntry->inode.links = 1;
+    newFileEntry->inode.uid = getuid();
+    newFileEntry->inode.gid = getgid();
+    newFileEntry->inode.atime = time(NULL);
+    newFileEntry->inode.mtime = time(NULL);
+    newFileEntry->inode.ctime = time(NULL);
+
+    // An empty extent list
+    newFileEntry->inode.flags = WFS_INODE_EXTENTS;
+    newFileEntry->inode.size = 0;
+    newFileEntry->length = file_len;
+    memset(newFileEntry->data, 0, sizeof(struct wfs_extent_list));
+
+    // Create a new log entry for the parent directory
+    struct wfs_log_entry *newParentDirEntry = dir_insert_write(&insert, (char *)newFileEntry + file_len, offset + file_len);
+    dir_insert_free(&insert);
+
+    // Publish the file before the dentry naming it
+    ret = index_entry(newFileEntry);
+    if (ret == 0) {
+        ret = index_entry(newParentDirEntry);
+    }
+
+    // The parent may have a negative dentry cached for the new name
+    dcache_invalidate(parent_dir_entry->inode.inode_number, new_path);
+
+    // Synchronize changes
+    if (commit_log(newFileEntry, needed) != 0) {
+        return -EIO;
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    TRACE("Reached end of mknod for path: %s\n", path);
+    return 0;
+}
+
+
+static int wfs_mkdir(const char *path, mode_t mode) {
+    TRACE("Entering mkdir path: %s >>>>>>>>>>>>>>>>>>>>>>>>>>\n", path);
+    // Check if superblock is properly mapped
+    if (!global_superblock) {
+        fprintf(stderr, "Superblock not mapped\n");
+        return -EIO;
+    }
+    if (read_only) {
+        return -EROFS;
+    }
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+
+    if (strcmp(path, "/") == 0) {
+        // Path is the root directory, no parent
+        return -EISDIR;
+    }
+
+    // Use looper to find the parent directory of the path
+    size_t parent_len;
+    char new_dir[MAX_FILE_NAME_LEN];
+    int ret = split_path(path, &parent_len, new_dir);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_log_entry *parent_dir_entry = looper_len(path, parent_len, S_IFDIR);
+    if (!parent_dir_entry) {
+        return -ENOENT;  // Parent directory not found
+    }
+
+    TRACE("New path: %s\n", new_dir);
+    TRACE("Parent path: %.*s\n", (int)parent_len, path);
+    // Prepare the new file entry
+    int newInode = find_new_inode();
+    TRACE("Created new dentry with name %s and inode: %d\n", new_dir, newInode);
+
+    // The new directory followed by what the parent needs to gain the dentry
+    struct dir_insert insert;
+    ret = dir_insert_plan(&insert, parent_dir_entry, new_dir, newInode);
+    if (ret != 0) {
+        return ret;
+    }
+    size_t dir_len = wfs_record_len(0);
+    size_t needed = dir_len + insert.len;
+    uint64_t offset = reserve_log(needed);
+    if (offset == 0) {
+        dir_insert_free(&insert);
+        return -ENOSPC;
+    }
+
+    // Create the new log entry for the directory
+    struct wfs_log_entry *newDirEntry = (struct wfs_log_entry *)((char *)global_superblock + offset);
+    memset(&newDirEntry->inode, 0, sizeof(struct wfs_inode));
+    newDirEntry->inode.mode = S_IFDIR | mode;  // Ensure the mode indicates a directory
+    newDirEntry->inode.inode_number = newInode;
+    newDirEntry->inode.links = 2; // Directories typically have 2 links (".", "..")
+    newDirEntry->inode.uid = getuid();
+    newDirEntry->inode.gid = getgid();
+    newDirEntry->inode.atime = time(NULL);
+    newDirEntry->inode.mtime = time(NULL);
+    newDirEntry->inode.ctime = time(NULL);
+    newDirEntry->inode.size = 0; // New directories start with no dentries
+    newDirEntry->length = dir_len;
+
+    // Create a new log entry for the parent directory
+    struct wfs_log_entry *newParentDirEntry = dir_insert_write(&insert, (char *)newDirEntry + dir_len, offset + dir_len);
+    dir_insert_free(&insert);
+    TRACE("Parent directory now has %u bytes of dentries\n", newParentDirEntry->inode.size);
+
+    // Publish the directory before the dentry naming it
+    ret = index_entry(newDirEntry);
+    if (ret == 0) {
+        ret = index_entry(newParentDirEntry);
+    }
+
+    // The parent may have a negative dentry cached for the new name
+    dcache_invalidate(parent_dir_entry->inode.inode_number, new_dir);
+
+    // Synchronize changes
+    if (commit_log(newDirEntry, needed) != 0) {
+        return -EIO;
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    TRACE("Reached end of mkdir for path: %s\n", path);
+    return 0;
+}
+
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (is_stats_path(path)) {
+        return stats_read(buf, size, offset);
+    }
+
+    // Find the log entry for the file, through its handle if it has one
+    struct wfs_log_entry *file_entry;
+    TRACE("Read path: %s\n", path);
+    int ret = find_file_for_read(path, fi, &file_entry);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Nothing to read at or past the end of the file
+    if (offset >= file_entry->inode.size) {
+        return 0;
+    }
+
+    // Read the data, gathering it from the extents that hold it
+    readahead_note(open_file_of(fi), file_entry, offset, size);
+    return wfs_file_read(global_superblock, file_entry, buf, size, offset);
+}
+
+// Add size bytes of extent, from skip bytes into it, to a read reply, or size zeroes if extent
+// is NULL. FUSE sends the reply after the callback has returned and released map_lock, and
+// nothing says when it is done, so log bytes are copied out by the storage backend while the
+// lock still holds compaction off. Only when splice_reads says the file's log never moves are
+// they passed as the file descriptor and offset for the kernel to splice into the reply.
+// Compressed extents are decompressed into memory. FUSE frees memory buffers.
+static int add_reply_buf(struct fuse_bufvec *bufv, const struct wfs_extent *extent, uint64_t skip, size_t size) {
+    struct fuse_buf *reply_buf = &bufv->buf[bufv->count];
+    memset(reply_buf, 0, sizeof(struct fuse_buf));
+    reply_buf->size = size;
+    if (extent && !(extent->block & WFS_EXTENT_COMPRESSED) && splice_reads) {
+        reply_buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        reply_buf->fd = disk_fd;
+        reply_buf->pos = extent->log_offset + skip;
+    } else {
+        reply_buf->fd = -1;
+        reply_buf->mem = extent ? malloc(size) : calloc(1, size);
+        if (!reply_buf->mem) {
+            return -ENOMEM;
+        }
+        int ret = 0;
+        if (extent && !(extent->block & WFS_EXTENT_COMPRESSED)) {
+            storage->read(reply_buf->mem, extent->log_offset + skip, size);
+        } else if (extent) {
+            ret = wfs_block_read(global_superblock, extent, skip, reply_buf->mem, size);
+        }
+        if (ret != 0) {
+            free(reply_buf->mem);
+            return ret;
+        }
+    }
+    bufv->count++;
+    return 0;
+}
+
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (is_stats_path(path)) {
+        struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+        char *stats = malloc(size ? size : 1);
+        if (!bufv || !stats) {
+            free(bufv);
+            free(stats);
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(stats_read(stats, size, offset));
+        bufv->buf[0].mem = stats;
+        *bufp = bufv;
+        return 0;
+    }
+
+    // Find the log entry for the file, through its handle if it has one
+    struct wfs_log_entry *file_entry;
+    TRACE("Read path: %s\n", path);
+    int ret = find_file_for_read(path, fi, &file_entry);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Nothing to read at or past the end of the file
+    if (offset >= file_entry->inode.size) {
+        struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+        if (!bufv) {
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(0);
+        *bufp = bufv;
+        return 0;
+    }
+    if (size > file_entry->inode.size - offset) {
+        size = file_entry->inode.size - offset;
+    }
+    readahead_note(open_file_of(fi), file_entry, offset, size);
+
+    // An inline file is one extent holding the whole file
+    struct wfs_extent inline_extent = {
+        .file_offset = 0,
+        .log_offset = file_entry->data - (char *)global_superblock,
+        .length = file_entry->inode.size,
+    };
+    struct wfs_extent *extents = &inline_extent;
+    uint32_t count = 1;
+    if (file_entry->inode.flags & WFS_INODE_EXTENTS) {
+        if (wfs_collect_extents(global_superblock, file_entry, &extents, &count) != 0) {
+            return -EIO;
+        }
+    }
+
+    // One buffer per extent in range and per hole between them
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + 2 * count * sizeof(struct fuse_buf));
+    if (!bufv) {
+        if (extents != &inline_extent) {
+            free(extents);
+        }
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+
+    uint64_t pos = offset;
+    uint64_t end = offset + size;
+    for (uint32_t i = 0; i < count && pos < end && ret == 0; i++) {
+        uint64_t from = extents[i].file_offset > pos ? extents[i].file_offset : pos;
+        uint64_t to = extents[i].file_offset + extents[i].length < end ? extents[i].file_offset + extents[i].length : end;
+        if (from >= to) {
+            continue;
+        }
+        if (from > pos) {
+            ret = add_reply_buf(bufv, NULL, 0, from - pos);
+        }
+        if (ret == 0) {
+            ret = add_reply_buf(bufv, &extents[i], from - extents[i].file_offset, to - from);
+        }
+        pos = to;
+    }
+    if (ret == 0 && pos < end) {
+        ret = add_reply_buf(bufv, NULL, 0, end - pos);
+    }
+    if (extents != &inline_extent) {
+        free(extents);
+    }
+
+    if (ret != 0) {
+        for (size_t i = 0; i < bufv->count; i++) {
+            free(bufv->buf[i].mem);
+        }
+        free(bufv);
+        return ret;
+    }
+    *bufp = bufv;
+    return 0;
+}
+
+// Until the data of a write has a place in the log, its new extent i has this log_offset,
+// which is past the end of any image
+#define PENDING_EXTENT(i) (UINT64_MAX - (i))
+
+// Split a write of size bytes from src at offset on a WFS_FEATURE_DEDUP image into extents in
+// file order: whole chunks whose bytes are already in the log point at them, and the rest is
+// left pending for the data record, *stored bytes of it. fingerprints[] gets one entry per
+// whole chunk, the first at first_chunk, which is left 0 for the chunks that were shared.
+// Returns the number of extents, at most chunk_count + 2.
+static uint32_t dedup_plan(const char *src, size_t size, off_t offset, uint64_t first_chunk, uint32_t chunk_count,
+                           uint64_t *fingerprints, struct wfs_extent *fresh, size_t *stored) {
+    uint64_t start = monotonic_ns();
+    uint64_t *matches = calloc(chunk_count ? chunk_count : 1, sizeof(uint64_t));
+    for (uint32_t k = 0; k < chunk_count; k++) {
+        fingerprints[k] = wfs_fingerprint(src + (first_chunk + (uint64_t)k * WFS_DEDUP_CHUNK - offset));
+    }
+    pthread_mutex_lock(&dedup_lock);
+    for (uint32_t k = 0; matches && k < chunk_count; k++) {
+        matches[k] = wfs_dedup_find(&dedup_table, fingerprints[k]);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+
+    // Bytes below head never change until compaction, which holds map_lock exclusively
+    uint64_t head = __atomic_load_n(&global_superblock->head, __ATOMIC_RELAXED);
+    uint64_t end = offset + size;
+    uint64_t pos = offset;
+    uint32_t extent_count = 0;
+    uint32_t shared = 0;
+    for (uint32_t k = 0; pos < end;) {
+        uint64_t chunk = first_chunk + (uint64_t)k * WFS_DEDUP_CHUNK;
+        uint64_t next = k < chunk_count ? chunk : end;
+        uint64_t log_offset = 0;
+        if (k < chunk_count && pos == chunk) {
+            next = chunk + WFS_DEDUP_CHUNK;
+            uint64_t match = matches ? matches[k] : 0;
+            if (match != 0 && match + WFS_DEDUP_CHUNK <= head &&
+                memcmp((char *)global_superblock + match, src + (pos - offset), WFS_DEDUP_CHUNK) == 0) {
+                log_offset = match;
+                fingerprints[k] = 0;
+                shared++;
+            }
+            k++;
+        }
+
+        // Stored bytes are contiguous in the record, shared ones only if they were before
+        struct wfs_extent *last = extent_count > 0 ? &fresh[extent_count - 1] : NULL;
+        if (last && (log_offset == 0 ? last->log_offset == PENDING_EXTENT(extent_count - 1)
+                                     : last->log_offset + last->length == log_offset)) {
+            last->length += next - pos;
+        } else {
+            fresh[extent_count].file_offset = pos;
+            fresh[extent_count].log_offset = log_offset ? log_offset : PENDING_EXTENT(extent_count);
+            fresh[extent_count].length = next - pos;
+            fresh[extent_count].block = 0;
+            extent_count++;
+        }
+        if (log_offset == 0) {
+            *stored += next - pos;
+        }
+        pos = next;
+    }
+    free(matches);
+
+    count(&dedup_chunks, chunk_count);
+    count(&dedup_shared, shared);
+    count(&dedup_ns, monotonic_ns() - start);
+    return extent_count;
+}
+
+// Append the bytes as a data record and a new version of the file that maps them, linked to
+// the version it updates. Every WFS_MAX_EXTENT_DEPTH writes the merged extent list is stored
+// instead, so reads never follow a long chain. Either way only the new bytes and a few
+// extents are written, whatever the size of the file. When FUSE hands over the bytes in a
+// pipe they are spliced into the image file rather than copied through memory, unless the
+// storage backend keeps its own copy of the log in the mapping. On an image
+// with WFS_FEATURE_COMPRESS or WFS_FEATURE_DEDUP the bytes are then in one memory buffer (see
+// locked_write_buf()). Compression cuts them into blocks that each get a record and an extent
+// of their own; deduplication leaves the chunks it finds in the log out of the record and
+// points extents at them instead. Caller holds the file's inode lock.
+static int write_extents(struct wfs_log_entry *file_entry, struct fuse_bufvec *buf, off_t offset) {
+    size_t size = fuse_buf_size(buf);
+    int compress = compression;
+    int dedup = deduplication && !compress;
+    const char *src = compress || dedup ? (char *)buf->buf[buf->idx].mem + buf->off : NULL;
+    uint32_t blocks = compress ? (size + WFS_BLOCK_SIZE - 1) / WFS_BLOCK_SIZE : 1;  // data records
+
+    uint64_t first_chunk = (offset + WFS_DEDUP_CHUNK - 1) / WFS_DEDUP_CHUNK * WFS_DEDUP_CHUNK;
+    uint32_t chunk_count = 0;
+    if (dedup && first_chunk + WFS_DEDUP_CHUNK <= offset + size) {
+        chunk_count = (offset + size - first_chunk) / WFS_DEDUP_CHUNK;
+    }
+
+    uint32_t fresh_count = dedup ? chunk_count + 2 : blocks;
+    struct wfs_extent *fresh = calloc(fresh_count, sizeof(struct wfs_extent));
+    uint32_t *packed_len = calloc(blocks, sizeof(uint32_t));     // 0 if the block is stored as it is
+    char *packed = compress ? malloc(size) : NULL;
+    uint64_t *fingerprints = dedup ? calloc(chunk_count ? chunk_count : 1, sizeof(uint64_t)) : NULL;
+    if (!fresh || !packed_len || (compress && !packed) || (dedup && !fingerprints)) {
+        free(fresh);
+        free(packed_len);
+        free(packed);
+        free(fingerprints);
+        return -ENOMEM;
+    }
+
+    // A block is only stored compressed if that saves space, header included
+    size_t data_len = 0;
+    size_t stored = 0;
+    if (dedup) {
+        fresh_count = dedup_plan(src, size, offset, first_chunk, chunk_count, fingerprints, fresh, &stored);
+        blocks = stored > 0 ? 1 : 0;
+        data_len = stored > 0 ? wfs_record_len(stored) : 0;
+    }
+    for (uint32_t i = 0; !dedup && i < blocks; i++) {
+        size_t block_len = size;
+        if (compress) {
+            block_len = size - (size_t)i * WFS_BLOCK_SIZE < WFS_BLOCK_SIZE ? size - (size_t)i * WFS_BLOCK_SIZE : WFS_BLOCK_SIZE;
+        }
+        fresh[i].file_offset = offset + (uint64_t)i * WFS_BLOCK_SIZE;
+        fresh[i].log_offset = PENDING_EXTENT(i);
+        fresh[i].length = block_len;
+        if (compress && block_len > sizeof(struct wfs_block)) {
+            char *dest = packed + (size_t)i * WFS_BLOCK_SIZE;
+            packed_len[i] = wfs_compress(src + (size_t)i * WFS_BLOCK_SIZE, block_len, dest, block_len - sizeof(struct wfs_block) - 1);
+        }
+        data_len += wfs_record_len(packed_len[i] ? sizeof(struct wfs_block) + packed_len[i] : block_len);
+    }
+
+    struct wfs_extent *extents = NULL;
+    uint32_t extent_count = fresh_count;
+    uint32_t depth = 1;
+    if (file_entry->inode.flags & WFS_INODE_EXTENTS) {
+        depth = ((struct wfs_extent_list *)file_entry->data)->depth + 1;
+    }
+    if (depth >= WFS_MAX_EXTENT_DEPTH) {
+        if (wfs_collect_extents(global_superblock, file_entry, &extents, &extent_count) != 0) {
+            free(fresh);
+            free(packed_len);
+            free(packed);
+            free(fingerprints);
+            return -EIO;
+        }
+        // Collecting leaves room for one overlay; every further one can add two extents
+        if (fresh_count > 1) {
+            struct wfs_extent *grown = realloc(extents, (2 * (extent_count + 1) + 2 * fresh_count) * sizeof(struct wfs_extent));
+            if (!grown) {
+                free(extents);
+                free(fresh);
+                free(packed_len);
+                free(packed);
+                free(fingerprints);
+                return -ENOMEM;
+            }
+            extents = grown;
+        }
+        for (uint32_t i = 0; i < fresh_count; i++) {
+            wfs_overlay_extent(extents, &extent_count, &fresh[i]);
+        }
+    }
+
+    size_t needed = data_len + wfs_record_len(sizeof(struct wfs_extent_list) + extent_count * sizeof(struct wfs_extent));
+    uint64_t log_offset = reserve_log(needed);
+    if (log_offset == 0) {
+        free(extents);
+        free(fresh);
+        free(packed_len);
+        free(packed);
+        free(fingerprints);
+        return -ENOSPC;
+    }
+
+    struct wfs_log_entry *dataEntry = (struct wfs_log_entry *)((char *)global_superblock + log_offset);
+    struct wfs_log_entry *record = dataEntry;
+    if (dedup && stored > 0) {
+        // The pending extents' bytes, one after the other
+        record->inode = file_entry->inode;
+        record->inode.flags = WFS_INODE_DATA;
+        record->inode.size = stored;
+        size_t pos = 0;
+        for (uint32_t i = 0; i < fresh_count; i++) {
+            if (fresh[i].log_offset == PENDING_EXTENT(i)) {
+                memcpy(record->data + pos, src + (fresh[i].file_offset - offset), fresh[i].length);
+                fresh[i].log_offset = record->data + pos - (char *)global_superblock;
+                pos += fresh[i].length;
+            }
+        }
+        record->length = wfs_record_len(stored);
+        record = wfs_next_entry(record);
+    }
+    for (uint32_t i = 0; !dedup && i < blocks; i++) {
+        record->inode = file_entry->inode;
+        if (packed_len[i]) {
+            record->inode.flags = WFS_INODE_DATA | WFS_INODE_COMPRESSED;
+            record->inode.size = sizeof(struct wfs_block) + packed_len[i];
+            struct wfs_block *block = (struct wfs_block *)record->data;
+            block->length = fresh[i].length;
+            block->reserved = 0;
+            memcpy(block->bytes, packed + (size_t)i * WFS_BLOCK_SIZE, packed_len[i]);
+            fresh[i].log_offset = (char *)record - (char *)global_superblock;
+            fresh[i].block = WFS_EXTENT_COMPRESSED;
+        } else {
+            record->inode.flags = WFS_INODE_DATA;
+            record->inode.size = fresh[i].length;
+            fresh[i].log_offset = record->data - (char *)global_superblock;
+            if (compress) {
+                memcpy(record->data, src + (size_t)i * WFS_BLOCK_SIZE, fresh[i].length);
+            }
+        }
+        record->length = wfs_record_len(record->inode.size);
+        record = wfs_next_entry(record);
+    }
+    free(packed_len);
+    free(packed);
+
+    if (!compress && !dedup) {
+        struct fuse_bufvec dest = FUSE_BUFVEC_INIT(size);
+        if ((buf->buf[buf->idx].flags & FUSE_BUF_IS_FD) && storage->shares_file) {
+            dest.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            dest.buf[0].fd = disk_fd;
+            dest.buf[0].pos = fresh[0].log_offset;
+        } else {
+            dest.buf[0].mem = dataEntry->data;
+        }
+        if (fuse_buf_copy(&dest, buf, FUSE_BUF_SPLICE_NONBLOCK) != (ssize_t)size) {
+            // The reservation still has to be committed; leave it as one unreferenced data record
+            dataEntry->inode.size = needed - sizeof(struct wfs_log_entry);
+            dataEntry->length = needed;
+            free(extents);
+            free(fresh);
+            commit_log(dataEntry, needed);
+            return -EIO;
+        }
+    }
+    count(&data_written, size);
+    count(&data_stored, data_len);
+
+    struct wfs_log_entry *newFileEntry = record;
+    newFileEntry->inode = file_entry->inode;
+    newFileEntry->inode.flags = WFS_INODE_EXTENTS;
+    if (offset + size > newFileEntry->inode.size) {
+        newFileEntry->inode.size = offset + size;
+    }
+    newFileEntry->inode.mtime = time(NULL);
+    newFileEntry->inode.ctime = time(NULL);
+
+    struct wfs_extent_list *list = (struct wfs_extent_list *)newFileEntry->data;
+    list->count = extent_count;
+    if (extents) {
+        list->prev = 0;
+        list->depth = 0;
+        for (uint32_t i = 0; i < extent_count; i++) {
+            uint64_t pending = UINT64_MAX - extents[i].log_offset;
+            list->extents[i] = pending < fresh_count ? fresh[pending] : extents[i];
+        }
+        free(extents);
+    } else {
+        list->prev = (char *)file_entry - (char *)global_superblock;
+        list->depth = depth;
+        memcpy(list->extents, fresh, fresh_count * sizeof(struct wfs_extent));
+    }
+    newFileEntry->length = wfs_content_len(newFileEntry);
+
+    int ret = index_entry(newFileEntry);
+
+    // Synchronize changes
+    if (commit_log(dataEntry, needed) != 0) {
+        free(fresh);
+        free(fingerprints);
+        return -EIO;
+    }
+
+    // Only committed chunks are offered to other writes
+    if (dedup) {
+        pthread_mutex_lock(&dedup_lock);
+        uint32_t e = 0;
+        for (uint32_t k = 0; k < chunk_count && ret == 0; k++) {
+            uint64_t chunk = first_chunk + (uint64_t)k * WFS_DEDUP_CHUNK;
+            while (fresh[e].file_offset + fresh[e].length <= chunk) {
+                e++;
+            }
+            if (fingerprints[k] != 0) {
+                ret = wfs_dedup_insert(&dedup_table, fingerprints[k], fresh[e].log_offset + (chunk - fresh[e].file_offset));
+            }
+        }
+        pthread_mutex_unlock(&dedup_lock);
+    }
+    free(fresh);
+    free(fingerprints);
+
+    return ret != 0 ? ret : size;
+}
+
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *)buf;
+    return wfs_write_buf(path, &bufv, offset, fi);
+}
+
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    if (read_only) {
+        return -EROFS;
+    }
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+
+    // Find the file, through its handle if it has one
+    struct open_file *file = open_file_of(fi);
+    uint32_t inode;
+    TRACE("Write path: %s\n", path);
+    if (file) {
+        inode = file->inode;
+    } else {
+        struct wfs_log_entry *file_entry = looper(path, 0);
+        if (!file_entry) {
+            return -ENOENT; // File not found
+        }
+        inode = file_entry->inode.inode_number;
+    }
+
+    // Ranges never written read as zeroes
+    if (fuse_buf_size(buf) == 0) {
+        return 0;
+    }
+    // Whether it would be held in a buffer or go to the log, a write may not end past what
+    // inode.size holds
+    if ((uint64_t)offset + fuse_buf_size(buf) > WFS_MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    // Bytes other handles hold for the file are older than these
+    int ret = writeback_sync_inode(inode, file);
+    if (ret == 0 && file && file->buffered) {
+        ret = writeback_write(file, buf, offset);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    return write_inode(inode, buf, offset);
+}
+
+// readdir offsets: "." is 1 and ".." is 2, then READDIR_FIRST plus the next name's cookie.
+// Names are listed in order of their hash with its bits reversed, and a name's cookie is that
+// key << 8 | which of the names sharing its hash it is, so unlinking or adding names, or a page
+// splitting, between two calls does not make the next one skip others. Reversed, the low bits
+// that pick a slot come first, so the names of each page of a paged directory are listed
+// together, and a directory listed while inline goes on from the same cookie once paged. Each
+// call only reads as far as the kernel's buffer fills, so a large directory is listed a page
+// at a time rather than gathered in one go.
+#define READDIR_FIRST 3
+#define READDIR_SAME_HASH_MAX 255
+// Listed names also go into the dentry cache, so the getattr calls that follow a listing
+// (ls -l) resolve their last component with one probe. Larger directories would only churn it.
+#define READDIR_CACHE_MAX (DCACHE_MAX_ENTRIES / 4)
+
+// Returns nonzero once the kernel's buffer is full
+static int readdir_fill(void *buf, fuse_fill_dir_t filler, struct wfs_dentry *dentry, off_t next,
+                        unsigned int dir_inode, int cache, unsigned int generation) {
+    struct wfs_log_entry *child = find_entry_by_inode(dentry->inode_number);
+    if (!child) {
+        return 0;
+    }
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = child->inode.inode_number;
+    st.st_mode = child->inode.mode;
+    if (cache) {
+        dcache_insert(dir_inode, dentry->name, child->inode.inode_number, generation);
+    }
+    return filler(buf, dentry->name, &st, next);
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = (x >> 1 & 0x55555555) | (x & 0x55555555) << 1;
+    x = (x >> 2 & 0x33333333) | (x & 0x33333333) << 2;
+    x = (x >> 4 & 0x0f0f0f0f) | (x & 0x0f0f0f0f) << 4;
+    x = (x >> 8 & 0x00ff00ff) | (x & 0x00ff00ff) << 8;
+    return x >> 16 | x << 16;
+}
+
+struct readdir_name {
+    uint32_t key;
+    struct wfs_dentry *dentry;
+};
+
+static int compare_readdir_names(const void *a, const void *b) {
+    const struct readdir_name *x = a;
+    const struct readdir_name *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return strcmp(x->dentry->name, y->dentry->name);
+}
+
+// List the count dentries from first whose cookies are at least pos, in cookie order. Returns
+// 1 once the kernel's buffer is full, else 0 or an error.
+static int readdir_names(void *buf, fuse_fill_dir_t filler, char *first, uint32_t count, uint64_t pos,
+                         unsigned int dir_inode, int cache, unsigned int generation) {
+    struct readdir_name *names = malloc((count ? count : 1) * sizeof(struct readdir_name));
+    if (!names) {
+        return -ENOMEM;
+    }
+    struct wfs_dentry *dentry = (struct wfs_dentry *)first;
+    for (uint32_t i = 0; i < count; i++, dentry = wfs_next_dentry(dentry)) {
+        names[i].key = reverse_bits(wfs_name_hash(dentry->name));
+        names[i].dentry = dentry;
+    }
+    qsort(names, count, sizeof(struct readdir_name), compare_readdir_names);
+
+    int full = 0;
+    uint64_t same_hash = 0;
+    for (uint32_t i = 0; i < count && !full; i++) {
+        same_hash = i > 0 && names[i].key == names[i - 1].key ? same_hash + 1 : 0;
+        uint64_t cookie = (uint64_t)names[i].key << 8 | (same_hash < READDIR_SAME_HASH_MAX ? same_hash : READDIR_SAME_HASH_MAX);
+        full = cookie >= pos && readdir_fill(buf, filler, names[i].dentry, READDIR_FIRST + cookie + 1, dir_inode, cache, generation);
+    }
+    free(names);
+    return full;
+}
+
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    TRACE("Entering readdir path: %s offset %ld\n", path, (long)offset);
+    unsigned int generation = dcache_begin();
+    struct wfs_log_entry *dir = looper(path, S_IFDIR);
+    if (!dir) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(dir->inode.mode)) {
+        return -ENOTDIR;
+    }
+
+    if (offset < 1 && filler(buf, ".", NULL, 1)) {
+        return 0;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2)) {
+        return 0;
+    }
+
+    unsigned int dir_inode = dir->inode.inode_number;
+    uint64_t pos = offset < READDIR_FIRST ? 0 : offset - READDIR_FIRST;
+
+    if (!(dir->inode.flags & WFS_INODE_PAGED)) {
+        int ret = readdir_names(buf, filler, dir->data, wfs_dir_count(dir), pos, dir_inode, 1, generation);
+        return ret < 0 ? ret : 0;
+    }
+
+    // A page with local depth d serves the slots sharing its low d bits, which reversed are the
+    // keys from reverse_bits(those bits) up to the next multiple of 1 << (32 - d)
+    struct wfs_dir_index *index = (struct wfs_dir_index *)dir->data;
+    int cache = index->entries <= READDIR_CACHE_MAX;
+    for (uint64_t key = pos >> 8; key <= UINT32_MAX;) {
+        uint32_t slot = reverse_bits(key) & ((1u << index->global_depth) - 1);
+        uint64_t page_offset;
+        int ret = wfs_dir_find_page(global_superblock, dir, slot, &page_offset);
+        if (ret != 0) {
+            return ret;
+        }
+        uint32_t depth = index->global_depth;
+        if (page_offset != 0) {
+            struct wfs_dir_page *page = (struct wfs_dir_page *)((struct wfs_log_entry *)((char *)global_superblock + page_offset))->data;
+            if (page->local_depth < depth) {
+                depth = page->local_depth;
+            }
+            ret = readdir_names(buf, filler, page->dentries, page->count, pos, dir_inode, cache, generation);
+            if (ret != 0) {
+                return ret < 0 ? ret : 0;
+            }
+        }
+        key = reverse_bits(slot & ((1u << depth) - 1)) + (1ull << (32 - depth));
+    }
+    return 0;
+}
+
+// Log bytes of a file that index_entry() does not count once the file is superseded: the
+// older versions its extent chain still needs, and the data its visible extents point at,
+// each compressed record once. Only the log above compact_base counts. On a deduplicating
+// image a chunk may be shared with files the log does not name, so data is left out there.
+static uint64_t file_chain_bytes(struct wfs_log_entry *file) {
+    uint64_t bytes = 0;
+    struct wfs_log_entry *version = file;
+    for (int depth = 0; depth <= WFS_MAX_EXTENT_DEPTH && (version->inode.flags & WFS_INODE_EXTENTS); depth++) {
+        uint64_t prev = ((struct wfs_extent_list *)version->data)->prev;
+        if (prev == 0) {
+            break;
+        }
+        version = (struct wfs_log_entry *)((char *)global_superblock + prev);
+        if (prev >= compact_base) {
+            bytes += wfs_entry_len(version);
+        }
+    }
+
+    struct wfs_extent *extents;
+    uint32_t count;
+    if (deduplication || !(file->inode.flags & WFS_INODE_EXTENTS) ||
+        wfs_collect_extents(global_superblock, file, &extents, &count) != 0) {
+        return bytes;
+    }
+    uint64_t last_record = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (extents[i].log_offset < compact_base) {
+            continue;
+        }
+        if (!(extents[i].block & WFS_EXTENT_COMPRESSED)) {
+            bytes += extents[i].length;
+        } else if (extents[i].log_offset != last_record) {
+            // Extents over parts of one block are next to each other in the file
+            last_record = extents[i].log_offset;
+            bytes += wfs_entry_len((struct wfs_log_entry *)((char *)global_superblock + last_record));
+        }
+    }
+    free(extents);
+    return bytes;
+}
+
+// Unlinking appends, in one transaction, the parent without the name followed by a tombstone:
+// the file's inode with deleted set and no data. Once the tombstone is indexed the inode reads
+// as missing, and compaction drops it together with every earlier entry of the file.
+static int wfs_unlink(const char *path) {
+    TRACE("Entering unlink path: %s\n", path);
+    if (!global_superblock) {
+        fprintf(stderr, "Superblock not mapped\n");
+        return -EIO;
+    }
+    if (read_only) {
+        return -EROFS;
+    }
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+
+    size_t parent_len;
+    char name[MAX_FILE_NAME_LEN];
+    int ret = split_path(path, &parent_len, name);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct wfs_log_entry *parent_dir_entry = looper_len(path, parent_len, S_IFDIR);
+    if (!parent_dir_entry) {
+        return -ENOENT;
+    }
+    if (!S_ISDIR(parent_dir_entry->inode.mode)) {
+        return -ENOTDIR;
+    }
+    uint32_t child_inode;
+    if (wfs_dir_lookup(global_superblock, parent_dir_entry, name, &child_inode) != 0) {
+        return -ENOENT;
+    }
+
+    // Writes to the file take its inode lock and look it up again, so none can append a
+    // version after the tombstone and bring it back
+    pthread_mutex_lock(&inode_locks[child_inode % INODE_LOCKS]);
+    struct wfs_log_entry *child = find_entry_by_inode(child_inode);
+    if (child && S_ISDIR(child->inode.mode)) {
+        pthread_mutex_unlock(&inode_locks[child_inode % INODE_LOCKS]);
+        return -EISDIR;
+    }
+
+    // A name whose inode is already gone only needs the parent rewritten
+    struct dir_insert removal;
+    ret = dir_remove_plan(&removal, parent_dir_entry, name);
+    if (ret != 0) {
+        pthread_mutex_unlock(&inode_locks[child_inode % INODE_LOCKS]);
+        return ret;
+    }
+    size_t tombstone_len = child ? wfs_record_len(0) : 0;
+    size_t needed = removal.len + tombstone_len;
+    uint64_t offset = reserve_log(needed);
+    if (offset == 0) {
+        dir_insert_free(&removal);
+        pthread_mutex_unlock(&inode_locks[child_inode % INODE_LOCKS]);
+        return -ENOSPC;
+    }
+
+    struct wfs_log_entry *newParentDirEntry = dir_insert_write(&removal, (char *)global_superblock + offset, offset);
+    dir_insert_free(&removal);
+    struct wfs_log_entry *tombstone = (struct wfs_log_entry *)((char *)global_superblock + offset + removal.len);
+    if (child) {
+        tombstone->inode = child->inode;
+        tombstone->inode.deleted = 1;
+        tombstone->inode.flags = 0;
+        tombstone->inode.size = 0;
+        tombstone->inode.links = 0;
+        tombstone->inode.ctime = time(NULL);
+        tombstone->length = tombstone_len;
+    }
+
+    // Unpublish the name before the inode it named. The file's data and the tombstone itself
+    // are garbage from here on.
+    ret = index_entry(newParentDirEntry);
+    if (ret == 0 && child) {
+        // A file a snapshot pins keeps its data, and the tombstone that hides it. The latest
+        // version is counted by index_entry() as the tombstone supersedes it.
+        uint64_t data_bytes = (char *)child - (char *)global_superblock >= compact_base ? file_chain_bytes(child) + tombstone_len : 0;
+        ret = index_entry(tombstone);
+        pthread_mutex_lock(&index_lock);
+        dead_bytes += data_bytes;
+        pthread_mutex_unlock(&index_lock);
+    }
+    pthread_mutex_unlock(&inode_locks[child_inode % INODE_LOCKS]);
+
+    dcache_invalidate(parent_dir_entry->inode.inode_number, name);
+
+    if (commit_log((char *)global_superblock + offset, needed) != 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
+// Every FUSE callback holds map_lock shared so the cleaner never moves entries underneath it.
+// Operations that append, reads included since they append write-back buffers, are retried
+// once room has been made if the log was full.
+void begin_op() {
+    pthread_rwlock_rdlock(&map_lock);
+    __atomic_store_n(&last_op_time, time(NULL), __ATOMIC_RELAXED);
+}
+
+void end_op() {
+    pthread_rwlock_unlock(&map_lock);
+}
+
+// fsync, flush (close) and release all append the writes the handle holds and make batched
+// changes durable
+static int sync_op(enum stat_kind kind, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    struct open_file *file = open_file_of(fi);
+    int ret = 0;
+    if (file && file->buffered) {
+        do {
+            begin_op();
+            pthread_mutex_lock(&file->lock);
+            ret = writeback_append(file);
+            pthread_mutex_unlock(&file->lock);
+            end_op();
+        } while (ret == -ENOSPC && retry_with_room());
+    }
+
+    pthread_rwlock_rdlock(&map_lock);
+    int synced = sync_log(0);
+    pthread_rwlock_unlock(&map_lock);
+    if (ret == 0) {
+        ret = synced;
+    }
+    stats_end(kind, start, ret);
+    return ret;
+}
+
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return sync_op(STAT_FSYNC, fi);
+}
+
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    return sync_op(STAT_FLUSH, fi);
+}
+
+// Once off the list no read or write can reach the handle, so its bytes are appended and it
+// is freed without holding open_files_lock
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    struct open_file *file = open_file_of(fi);
+    if (file && file->buffered) {
+        pthread_mutex_lock(&open_files_lock);
+        if (file->prev) {
+            file->prev->next = file->next;
+        } else {
+            open_files = file->next;
+        }
+        if (file->next) {
+            file->next->prev = file->prev;
+        }
+        pthread_mutex_unlock(&open_files_lock);
+    }
+
+    int ret = sync_op(STAT_RELEASE, fi);
+    if (file) {
+        if (file->len > 0) {
+            __atomic_sub_fetch(&holding_files, 1, __ATOMIC_RELEASE);    // lost to ENOSPC
+        }
+        pthread_mutex_destroy(&file->lock);
+        free(file->buf);
+        free(file);
+        fi->fh = 0;
+    }
+    return ret;
+}
+
+// /.wfs_stats is opened uncached, see stats_read(). Other files get an open_file.
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    if (is_stats_path(path)) {
+        fi->direct_io = 1;
+        stats_end(STAT_OPEN, start, 0);
+        return 0;
+    }
+
+    begin_op();
+    struct wfs_log_entry *entry = looper(path, 0);
+    uint32_t inode = entry ? entry->inode.inode_number : 0;
+    end_op();
+    if (!entry) {
+        stats_end(STAT_OPEN, start, -ENOENT);
+        return -ENOENT;
+    }
+
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    if (!file) {
+        stats_end(STAT_OPEN, start, -ENOMEM);
+        return -ENOMEM;
+    }
+    file->inode = inode;
+    file->buffered = durability == DURABILITY_BATCHED && writeback_bytes > 0 && !read_only &&
+                     (fi->flags & O_ACCMODE) != O_RDONLY;
+    pthread_mutex_init(&file->lock, NULL);
+    if (file->buffered) {
+        pthread_mutex_lock(&open_files_lock);
+        file->next = open_files;
+        if (open_files) {
+            open_files->prev = file;
+        }
+        open_files = file;
+        pthread_mutex_unlock(&open_files_lock);
+    }
+    fi->fh = (uintptr_t)file;
+    stats_end(STAT_OPEN, start, 0);
+    return 0;
+}
+
+static int locked_getattr(const char *path, struct stat *stbuf) {
+    uint64_t start = monotonic_ns();
+    begin_op();
+    int ret = wfs_getattr(path, stbuf);
+    end_op();
+    stats_end(STAT_GETATTR, start, ret);
+    return ret;
+}
+
+static int locked_mknod(const char *path, mode_t mode, dev_t rdev) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        pthread_mutex_lock(&namespace_lock);
+        ret = wfs_mknod(path, mode, rdev);
+        pthread_mutex_unlock(&namespace_lock);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_MKNOD, start, ret);
+    return ret;
+}
+
+static int locked_mkdir(const char *path, mode_t mode) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        pthread_mutex_lock(&namespace_lock);
+        ret = wfs_mkdir(path, mode);
+        pthread_mutex_unlock(&namespace_lock);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_MKDIR, start, ret);
+    return ret;
+}
+
+static int locked_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        ret = wfs_read(path, buf, size, offset, fi);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_READ, start, ret);
+    return ret;
+}
+
+static int locked_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        ret = wfs_write(path, buf, size, offset, fi);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_WRITE, start, ret);
+    return ret;
+}
+
+static int locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        ret = wfs_read_buf(path, bufp, size, offset, fi);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_READ, start, ret);
+    return ret;
+}
+
+// -ENOSPC comes from reserve_log() before anything is read from buf, so a write is retried
+// even when its bytes are in a pipe. Compression and deduplication read them first, so on
+// those images they are copied into one memory buffer before the first attempt.
+static int locked_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    struct fuse_bufvec copy = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    copy.buf[0].mem = NULL;
+    if ((compression || deduplication) && (buf->count > 1 || (buf->buf[0].flags & FUSE_BUF_IS_FD))) {
+        size_t size = copy.buf[0].size;
+        char *bytes = malloc(size ? size : 1);
+        copy.buf[0].mem = bytes;
+        if (!bytes || fuse_buf_copy(&copy, buf, 0) != (ssize_t)size) {
+            free(bytes);
+            stats_end(STAT_WRITE, start, bytes ? -EIO : -ENOMEM);
+            return bytes ? -EIO : -ENOMEM;
+        }
+        copy = FUSE_BUFVEC_INIT(size);  // Copying advanced it
+        copy.buf[0].mem = bytes;
+        buf = &copy;
+    }
+
+    int ret;
+    do {
+        begin_op();
+        ret = wfs_write_buf(path, buf, offset, fi);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    free(copy.buf[0].mem);
+    stats_end(STAT_WRITE, start, ret);
+    return ret;
+}
+
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = monotonic_ns();
+    begin_op();
+    int ret = wfs_readdir(path, buf, filler, offset, fi);
+    end_op();
+    stats_end(STAT_READDIR, start, ret);
+    return ret;
+}
+
+static int locked_unlink(const char *path) {
+    uint64_t start = monotonic_ns();
+    int ret;
+    do {
+        begin_op();
+        pthread_mutex_lock(&namespace_lock);
+        ret = wfs_unlink(path);
+        pthread_mutex_unlock(&namespace_lock);
+        end_op();
+    } while (ret == -ENOSPC && retry_with_room());
+    stats_end(STAT_UNLINK, start, ret);
+    return ret;
+}
+
+// Snapshots. SIGUSR2 records the log as it is now in the superblock's snapshot table (see
+// wfs.h), after appending what handles hold and making every change durable. Nothing is
+// copied: from then on compaction leaves the log below the snapshot alone, so its garbage no
+// longer counts towards dead_bytes. snapshot=N mounts snapshot N read-only, by indexing the
+// log only up to it.
+uint32_t snapshot_id = 0;   // mounted snapshot, 0 for the live filesystem
+
+int take_snapshot() {
+    int ret;
+    do {
+        pthread_rwlock_rdlock(&map_lock);
+        ret = writeback_sync_all();
+        pthread_rwlock_unlock(&map_lock);
+    } while (ret == -ENOSPC && retry_with_room());
+    if (ret != 0) {
+        return ret;
+    }
+
+    pthread_rwlock_wrlock(&map_lock);
+    ret = sync_log(0);
+    int slot = ret == 0 ? wfs_snapshot_add(global_superblock, global_superblock->head, inode_offset(0)) : ret;
+    if (slot >= 0) {
+        global_superblock->checkpoint = 0;    // it counted garbage below the new compaction base
+        if (sync_range(0, sizeof(struct wfs_sb)) != 0) {
+            memset(&global_superblock->snapshots[slot], 0, sizeof(struct wfs_snapshot));
+            slot = -EIO;
+        } else {
+            compact_base = global_superblock->head;
+            dead_bytes = 0;
+        }
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    if (slot < 0) {
+        fprintf(stderr, "Error taking snapshot: %s\n", strerror(-slot));
+        return slot;
+    }
+    printf("Took snapshot %u at log offset %lu\n", global_superblock->snapshots[slot].id, global_superblock->snapshots[slot].head);
+    return 0;
+}
+
+// SIGUSR1 and SIGUSR2 are blocked in every thread (see main) and taken here, where
+// formatting and locking are safe
+void *stats_main(void *arg) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    char buf[STATS_MAX_LEN];
+
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if (!__atomic_load_n(&stats_running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (sig == SIGUSR2) {
+            if (read_only) {
+                fprintf(stderr, "Snapshots are taken of writable mounts only\n");
+            } else {
+                take_snapshot();
+            }
+            continue;
+        }
+        pthread_rwlock_rdlock(&map_lock);
+        format_stats(buf, sizeof(buf));
+        pthread_rwlock_unlock(&map_lock);
+        fputs(buf, stderr);
+    }
+    return NULL;
+}
+
+// The cleaner is started here rather than in main because fuse_main may fork to daemonize
+static void *wfs_init(struct fuse_conn_info *conn) {
+    // Let the kernel splice reads out of and writes into the image file (see wfs_read_buf)
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    // Let the kernel read ahead as far as it offers (it never offers more than the mount's
+    // read_ahead_kb), with several reads in flight, and take writes of up to 128 KiB at once
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES);
+
+    // Nothing to clean on a read-only mount
+    background_running = !read_only;
+    if (background_running && pthread_create(&background_thread, NULL, background_main, NULL) != 0) {
+        fprintf(stderr, "Error starting log cleaner\n");
+        background_running = 0;
+    }
+
+    stats_running = 1;
+    if (pthread_create(&stats_thread, NULL, stats_main, NULL) != 0) {
+        fprintf(stderr, "Error starting stats thread\n");
+        stats_running = 0;
+    }
+    return NULL;
+}
+
+static void wfs_destroy(void *private_data) {
+    sync_log(0);
+
+    pthread_mutex_lock(&background_lock);
+    int running = background_running;
+    background_running = 0;
+    pthread_cond_signal(&background_cond);
+    pthread_mutex_unlock(&background_lock);
+
+    if (running) {
+        pthread_join(background_thread, NULL);
+    }
+
+    if (!read_only && global_superblock->head != checkpointed_head) {
+        pthread_rwlock_wrlock(&map_lock);
+        write_checkpoint();
+        pthread_rwlock_unlock(&map_lock);
+    }
+
+    // Every append wrote below head, so the next mount has nothing past it to clean up
+    if (!read_only) {
+        global_superblock->dirty_end = global_superblock->head;
+        sync_range(0, sizeof(struct wfs_sb));
+    }
+
+    if (stats_running) {
+        __atomic_store_n(&stats_running, 0, __ATOMIC_RELEASE);
+        pthread_kill(stats_thread, SIGUSR1);
+        pthread_join(stats_thread, NULL);
+    }
+    uring_close();
+    if (storage->stop) {
+        storage->stop();
+    }
+
+    if (compactions > 0) {
+        printf("Log cleaner: %u compactions, %.1f MB/s, longest FUSE pause %.3f ms\n",
+               compactions, compaction_seconds > 0 ? compacted_bytes / compaction_seconds / 1e6 : 0.0,
+               max_compaction_pause * 1e3);
+    }
+}
+
+// mount.wfs options, passed with -o alongside the FUSE ones
+enum {
+    KEY_DURABILITY_STRICT,
+    KEY_DURABILITY_BATCHED,
+    KEY_COMMIT_MS,
+    KEY_COMMIT_BYTES,
+    KEY_MAX_SIZE,
+    KEY_TRACE,
+    KEY_RO,
+    KEY_WRITEBACK_BYTES,
+    KEY_IO_MMAP,
+    KEY_IO_URING,
+    KEY_BACKEND_MMAP,
+    KEY_BACKEND_DIRECT,
+    KEY_CACHE_MB,
+    KEY_SNAPSHOT,
+    KEY_READAHEAD_BYTES,
+};
+
+static struct fuse_opt wfs_opts[] = {
+    FUSE_OPT_KEY("durability=strict", KEY_DURABILITY_STRICT),
+    FUSE_OPT_KEY("durability=batched", KEY_DURABILITY_BATCHED),
+    FUSE_OPT_KEY("commit_ms=", KEY_COMMIT_MS),
+    FUSE_OPT_KEY("commit_bytes=", KEY_COMMIT_BYTES),
+    FUSE_OPT_KEY("max_size=", KEY_MAX_SIZE),
+    FUSE_OPT_KEY("trace", KEY_TRACE),
+    FUSE_OPT_KEY("ro", KEY_RO),
+    FUSE_OPT_KEY("writeback_bytes=", KEY_WRITEBACK_BYTES),
+    FUSE_OPT_KEY("io=mmap", KEY_IO_MMAP),
+    FUSE_OPT_KEY("io=uring", KEY_IO_URING),
+    FUSE_OPT_KEY("backend=mmap", KEY_BACKEND_MMAP),
+    FUSE_OPT_KEY("backend=direct", KEY_BACKEND_DIRECT),
+    FUSE_OPT_KEY("cache_mb=", KEY_CACHE_MB),
+    FUSE_OPT_KEY("snapshot=", KEY_SNAPSHOT),
+    FUSE_OPT_KEY("readahead_bytes=", KEY_READAHEAD_BYTES),
+    FUSE_OPT_END
+};
+
+static int wfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    switch (key) {
+    case KEY_DURABILITY_STRICT:
+        durability = DURABILITY_STRICT;
+        return 0;
+    case KEY_DURABILITY_BATCHED:
+        durability = DURABILITY_BATCHED;
+        return 0;
+    case KEY_COMMIT_MS:
+        commit_interval_ms = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_COMMIT_BYTES:
+        commit_bytes = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_MAX_SIZE:
+        max_disk_size = strtoull(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_TRACE:
+#ifndef WFS_TRACE
+        fprintf(stderr, "mount.wfs was built without tracing; rebuild it with make TRACE=1\n");
+#endif
+        trace_enabled = 1;
+        return 0;
+    case KEY_RO:
+        read_only = 1;
+        return 1;   // FUSE mounts it read-only too
+    case KEY_WRITEBACK_BYTES:
+        writeback_bytes = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_READAHEAD_BYTES:
+        readahead_window = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_IO_MMAP:
+        sync_method = SYNC_MSYNC;
+        return 0;
+    case KEY_IO_URING:
+        sync_method = SYNC_URING;
+        return 0;
+    case KEY_BACKEND_MMAP:
+        storage = &mmap_storage;
+        return 0;
+    case KEY_BACKEND_DIRECT:
+        storage = &direct_storage;
+        return 0;
+    case KEY_CACHE_MB:
+        read_cache_mb = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case KEY_SNAPSHOT:
+        snapshot_id = strtoul(strchr(arg, '=') + 1, NULL, 10);
+        if (snapshot_id == 0) {
+            fprintf(stderr, "Snapshot ids start at 1\n");
+            return -1;
+        }
+        read_only = 1;
+        return fuse_opt_add_arg(outargs, "-oro");
+    default:
+        return 1; // Leave everything else for FUSE
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <disk_image> <mount_point> [FUSE options]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *disk_path = argv[argc - 2];
+
+    // Adjust argv for FUSE. Options are parsed first since -o ro decides how the image is opened.
     argv[argc - 2] = argv[argc - 1];
     argv[argc - 1] = NULL;
     argc--;
 
-    int fuse_stat = fuse_main(argc, argv, &ops, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, NULL, wfs_opts, wfs_opt_proc) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Open the disk image file
+    disk_fd = open(disk_path, read_only ? O_RDONLY : O_RDWR);
+    if (disk_fd == -1) {
+        perror("Error opening disk file");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    // A read-only mount never moves the log in the file, so reads can be spliced from it,
+    // unless wfs_map() is about to upgrade the image or finish a compaction in memory only
+    struct wfs_sb header;
+    if (read_only && pread(disk_fd, &header, sizeof(header), 0) == sizeof(header)) {
+        splice_reads = header.version == WFS_VERSION && header.compact_src == 0;
+    }
+
+    // Map the whole disk image into memory, upgrading older images and completing a
+    // compaction that was interrupted by a crash. A read-only mount does all that in a
+    // private mapping and leaves the file as it is.
+    global_superblock = wfs_map(disk_fd, &disk_size, read_only);
+    if (!global_superblock) {
+        close(disk_fd);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    compression = (global_superblock->features & WFS_FEATURE_COMPRESS) != 0;
+    deduplication = (global_superblock->features & WFS_FEATURE_DEDUP) != 0;
+    compact_base = wfs_compact_base(global_superblock);
+
+    // The storage backend takes over the mapping before anything is written through it. A
+    // read-only mount never writes the file, so the mapping wfs_map() made is all it needs.
+    page_size = sysconf(_SC_PAGESIZE);
+    if (read_only) {
+        storage = &mmap_storage;
+    }
+    if (storage->start && storage->start(disk_path) != 0) {
+        munmap(global_superblock, disk_size);
+        close(disk_fd);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    // A snapshot is the log up to its head. The mapping is private, so the head is only
+    // moved back in memory.
+    if (snapshot_id) {
+        int slot = wfs_snapshot_find(global_superblock, snapshot_id);
+        if (slot == -1) {
+            fprintf(stderr, "No snapshot %u on this image\n", snapshot_id);
+            munmap(global_superblock, disk_size);
+            close(disk_fd);
+            fuse_opt_free_args(&args);
+            return EXIT_FAILURE;
+        }
+        global_superblock->head = global_superblock->snapshots[slot].head;
+    }
+
+    // Index every inode's latest log entry before serving requests, from the checkpoint on
+    uint64_t index_begin = monotonic_ns();
+    int indexed = load_checkpoint();
+    if (indexed == 0) {
+        printf("Loaded the inode table checkpoint and indexed %lu entries after it in %.3f ms\n",
+               scanned_entries, (monotonic_ns() - index_begin) / 1e6);
+    } else if (indexed == -ENOENT) {
+        indexed = build_inode_table();
+        printf("Indexed %lu log entries in %.3f ms\n", scanned_entries, (monotonic_ns() - index_begin) / 1e6);
+    }
+    if (indexed != 0) {
+        fprintf(stderr, "Error building inode table\n");
+        munmap(global_superblock, disk_size);
+        close(disk_fd);
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    if (snapshot_id) {
+        struct wfs_snapshot *snapshot = &global_superblock->snapshots[wfs_snapshot_find(global_superblock, snapshot_id)];
+        if (inode_offset(0) != snapshot->root) {
+            fprintf(stderr, "Snapshot %u does not end at its root directory\n", snapshot_id);
+            munmap(global_superblock, disk_size);
+            close(disk_fd);
+            fuse_opt_free_args(&args);
+            return EXIT_FAILURE;
+        }
+        time_t taken = snapshot->time;
+        printf("Mounted snapshot %u, taken %s", snapshot_id, ctime(&taken));
+    }
+
+    // And the fingerprint of every chunk of file data they hold
+    if (deduplication) {
+        uint64_t begin = monotonic_ns();
+        if (dedup_rebuild() != 0) {
+            munmap(global_superblock, disk_size);
+            close(disk_fd);
+            fuse_opt_free_args(&args);
+            return EXIT_FAILURE;
+        }
+        printf("Indexed %zu chunks for deduplication in %.3f ms\n", dedup_table.used, (monotonic_ns() - begin) / 1e6);
+    }
+
+    // A new epoch, so nothing this mount writes can be confused with transactions an earlier
+    // one left behind a torn transaction
+    if (!read_only) {
+        global_superblock->epoch++;
+        if (sync_range(0, sizeof(struct wfs_sb)) != 0) {
+            munmap(global_superblock, disk_size);
+            close(disk_fd);
+            fuse_opt_free_args(&args);
+            return EXIT_FAILURE;
+        }
+    }
+    complete_head = synced_head = global_superblock->head;
+
+    // A read-only mount never syncs
+    if (sync_method == -1) {
+        sync_method = storage->sync_method;
+    }
+    if (read_only) {
+        sync_method = SYNC_MSYNC;
+    } else if (sync_method == SYNC_URING) {
+        int ret = uring_setup();
+        if (ret != 0) {
+            fprintf(stderr, "Error setting up io_uring (%s), flushing synchronously\n", strerror(-ret));
+            sync_method = SYNC_MSYNC;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    mount_ns = monotonic_ns();
+    for (int i = 0; i < INODE_LOCKS; i++) {
+        pthread_mutex_init(&inode_locks[i], NULL);
+    }
+    for (int i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&dcache_locks[i], NULL);
+    }
+
+    // Only the stats thread takes SIGUSR1 and SIGUSR2; FUSE's threads inherit the mask
+    sigset_t usr;
+    sigemptyset(&usr);
+    sigaddset(&usr, SIGUSR1);
+    sigaddset(&usr, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr, NULL);
+
+    int fuse_stat = fuse_main(args.argc, args.argv, &ops, NULL);
+    fuse_opt_free_args(&args);
 
     // Unmap the disk file and close it
-    munmap(global_superblock, DISK_SIZE);
+    munmap(global_superblock, disk_size);
     close(disk_fd);
+    free_retired_tables();
+    free(inode_table);
+    dcache_clear();
+    wfs_dedup_free(&dedup_table);
 
     return fuse_stat;
 }
\ No newline at end of file
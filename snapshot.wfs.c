@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "wfs.h"
+
+// Lists, takes or deletes the snapshots of an unmounted image. A mounted one takes them on
+// SIGUSR2 instead, since only it knows what it has not made durable yet.
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t | -d id] disk_path\n", name);
+    fprintf(stderr, "  with no option, list the snapshots\n");
+    fprintf(stderr, "  -t     take a snapshot of the image as it is\n");
+    fprintf(stderr, "  -d id  delete snapshot id, so compaction can reclaim what only it kept\n");
+}
+
+int main(int argc, char *argv[]) {
+    int take = 0;
+    uint32_t delete_id = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "td:")) != -1) {
+        switch (opt) {
+        case 't':
+            take = 1;
+            break;
+        case 'd':
+            delete_id = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || (take && delete_id)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    int writing = take || delete_id;
+
+    int fd = open(argv[optind], writing ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening disk file");
+        return EXIT_FAILURE;
+    }
+
+    size_t disk_size;
+    struct wfs_sb *superblock = wfs_map(fd, &disk_size, !writing);
+    if (!superblock) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+    if (take) {
+        uint64_t root = wfs_latest_version(superblock, 0, superblock->head);
+        int slot = wfs_snapshot_add(superblock, superblock->head, root);
+        if (slot < 0) {
+            fprintf(stderr, "Every snapshot slot is taken; delete one first\n");
+            ret = EXIT_FAILURE;
+        } else {
+            printf("Took snapshot %u at log offset %lu\n", superblock->snapshots[slot].id, superblock->snapshots[slot].head);
+        }
+    } else if (delete_id) {
+        int slot = wfs_snapshot_find(superblock, delete_id);
+        if (slot == -1) {
+            fprintf(stderr, "No snapshot %u on this image\n", delete_id);
+            ret = EXIT_FAILURE;
+        } else {
+            memset(&superblock->snapshots[slot], 0, sizeof(struct wfs_snapshot));
+            printf("Deleted snapshot %u\n", delete_id);
+        }
+    } else {
+        for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+            struct wfs_snapshot *snapshot = &superblock->snapshots[i];
+            if (snapshot->id == 0) {
+                continue;
+            }
+            char when[64];
+            time_t taken = snapshot->time;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+            printf("%u\t%s\t%lu bytes of log\n", snapshot->id, when, snapshot->head - wfs_log_start(superblock));
+        }
+    }
+
+    // The checkpoint counted garbage above the old compaction base
+    if (writing && ret == EXIT_SUCCESS) {
+        superblock->checkpoint = 0;
+    }
+    if (writing && ret == EXIT_SUCCESS && msync(superblock, WFS_SB_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        ret = EXIT_FAILURE;
+    }
+
+    munmap(superblock, disk_size);
+    close(fd);
+    return ret;
+}
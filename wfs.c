@@ -0,0 +1,2085 @@
+#define _GNU_SOURCE     // mremap
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wfs.h"
+
+// Extents of one version of a file. An inline entry acts as a single extent over its data[],
+// so files written before extents existed can be the base of a chain.
+static struct wfs_extent *entry_extents(struct wfs_sb *sb, struct wfs_log_entry *entry, struct wfs_extent *inline_extent, uint32_t *count) {
+    if (entry->inode.flags & WFS_INODE_EXTENTS) {
+        struct wfs_extent_list *list = (struct wfs_extent_list *)entry->data;
+        *count = list->count;
+        return list->extents;
+    }
+
+    inline_extent->file_offset = 0;
+    inline_extent->log_offset = entry->data - (char *)sb;
+    inline_extent->length = entry->inode.size;
+    inline_extent->block = 0;
+    *count = entry->inode.size ? 1 : 0;
+    return inline_extent;
+}
+
+// Fill chain with the versions a read of entry has to look at, newest first
+static int extent_chain(struct wfs_sb *sb, struct wfs_log_entry *entry, struct wfs_log_entry **chain) {
+    uint64_t head = __atomic_load_n(&sb->head, __ATOMIC_RELAXED);  // Appends may be moving it
+    int length = 0;
+    while (1) {
+        if (length > WFS_MAX_EXTENT_DEPTH || (char *)entry < (char *)sb + wfs_log_start(sb) || (char *)entry >= (char *)sb + head) {
+            fprintf(stderr, "Corrupt extent chain for inode %u\n", chain[0]->inode.inode_number);
+            return -EINVAL;
+        }
+        chain[length++] = entry;
+
+        if (!(entry->inode.flags & WFS_INODE_EXTENTS)) {
+            return length;
+        }
+        struct wfs_extent_list *list = (struct wfs_extent_list *)entry->data;
+        if (list->prev == 0) {
+            return length;
+        }
+        entry = (struct wfs_log_entry *)((char *)sb + list->prev);
+    }
+}
+
+// Copy up to size bytes of the file at offset into buf, returning how many were copied.
+// Ranges no extent covers read as zeroes.
+int wfs_file_read(struct wfs_sb *sb, struct wfs_log_entry *entry, char *buf, size_t size, off_t offset) {
+    if (offset >= entry->inode.size) {
+        return 0;
+    }
+    if (size > entry->inode.size - offset) {
+        size = entry->inode.size - offset;
+    }
+
+    if (!(entry->inode.flags & WFS_INODE_EXTENTS)) {
+        memcpy(buf, entry->data + offset, size);
+        return size;
+    }
+
+    struct wfs_log_entry *chain[WFS_MAX_EXTENT_DEPTH + 1];
+    int length = extent_chain(sb, entry, chain);
+    if (length < 0) {
+        return length;
+    }
+
+    // Oldest version first, so newer extents overwrite what they replaced
+    memset(buf, 0, size);
+    uint64_t end = offset + size;
+    for (int i = length - 1; i >= 0; i--) {
+        struct wfs_extent inline_extent;
+        uint32_t count;
+        struct wfs_extent *extents = entry_extents(sb, chain[i], &inline_extent, &count);
+
+        for (uint32_t j = 0; j < count; j++) {
+            uint64_t from = extents[j].file_offset > offset ? extents[j].file_offset : offset;
+            uint64_t to = extents[j].file_offset + extents[j].length < end ? extents[j].file_offset + extents[j].length : end;
+            if (from >= to) {
+                continue;
+            }
+            if (extents[j].block & WFS_EXTENT_COMPRESSED) {
+                int ret = wfs_block_read(sb, &extents[j], from - extents[j].file_offset, buf + (from - offset), to - from);
+                if (ret != 0) {
+                    return ret;
+                }
+            } else {
+                memcpy(buf + (from - offset), (char *)sb + extents[j].log_offset + (from - extents[j].file_offset), to - from);
+            }
+        }
+    }
+
+    return size;
+}
+
+// Replace [extent->file_offset, + length) in the sorted, non-overlapping list with extent.
+// The list must have room for two more extents (one split, one insert).
+void wfs_overlay_extent(struct wfs_extent *list, uint32_t *count, const struct wfs_extent *extent) {
+    uint64_t start = extent->file_offset;
+    uint64_t end = start + extent->length;
+    struct wfs_extent tail;
+    int have_tail = 0;
+    uint32_t kept = 0;
+    uint32_t insert_at = 0;
+
+    for (uint32_t i = 0; i < *count; i++) {
+        struct wfs_extent current = list[i];
+        uint64_t current_end = current.file_offset + current.length;
+
+        if (current_end <= start || current.file_offset >= end) {
+            if (current_end <= start) {
+                insert_at = kept + 1;
+            }
+            list[kept++] = current;
+            continue;
+        }
+
+        // Keep whatever sticks out on either side of the new extent
+        if (current.file_offset < start) {
+            list[kept] = current;
+            list[kept].length = start - current.file_offset;
+            insert_at = ++kept;
+        }
+        if (current_end > end) {
+            tail = current;
+            wfs_extent_skip(&tail, end - current.file_offset);
+            have_tail = 1;
+        }
+    }
+
+    memmove(&list[insert_at + 1], &list[insert_at], (kept - insert_at) * sizeof(struct wfs_extent));
+    list[insert_at] = *extent;
+    kept++;
+
+    if (have_tail) {
+        memmove(&list[insert_at + 2], &list[insert_at + 1], (kept - insert_at - 1) * sizeof(struct wfs_extent));
+        list[insert_at + 1] = tail;
+        kept++;
+    }
+
+    *count = kept;
+}
+
+// Merge the chain behind entry into one sorted list of the extents that are still visible,
+// with room left for one more wfs_overlay_extent(). The caller frees *extents.
+int wfs_collect_extents(struct wfs_sb *sb, struct wfs_log_entry *entry, struct wfs_extent **extents, uint32_t *count) {
+    struct wfs_log_entry *chain[WFS_MAX_EXTENT_DEPTH + 1];
+    int length = extent_chain(sb, entry, chain);
+    if (length < 0) {
+        return length;
+    }
+
+    uint32_t total = 0;
+    for (int i = 0; i < length; i++) {
+        struct wfs_extent inline_extent;
+        uint32_t version_count;
+        entry_extents(sb, chain[i], &inline_extent, &version_count);
+        total += version_count;
+    }
+
+    // Every overlay adds at most two extents
+    struct wfs_extent *list = malloc(2 * (total + 1) * sizeof(struct wfs_extent));
+    if (!list) {
+        return -ENOMEM;
+    }
+
+    // The oldest version is a list this function merged before (or one inline extent), so it
+    // is taken as it is; only the deltas after it are overlaid
+    struct wfs_extent inline_extent;
+    struct wfs_extent *base = entry_extents(sb, chain[length - 1], &inline_extent, count);
+    memcpy(list, base, *count * sizeof(struct wfs_extent));
+    for (int i = length - 2; i >= 0; i--) {
+        uint32_t version_count;
+        struct wfs_extent *version = entry_extents(sb, chain[i], &inline_extent, &version_count);
+        for (uint32_t j = 0; j < version_count; j++) {
+            wfs_overlay_extent(list, count, &version[j]);
+        }
+    }
+
+    *extents = list;
+    return 0;
+}
+
+// Compressed blocks use the LZ4 block format: sequences of a token (literal count in the high
+// nibble, match length - 4 in the low one, 15 meaning more bytes of 255 follow), the literals,
+// and a 2-byte little-endian offset back to the match. The last sequence is literals only, and
+// the last match starts at least 12 bytes from the end. Blocks are at most 64 KiB, so 16-bit
+// positions and offsets always reach.
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_SKIP_SHIFT 6     // step past one more byte for every 64 misses in a row
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Append a length's continuation bytes
+static unsigned char *lz_put_length(unsigned char *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+size_t wfs_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + cap;
+    uint16_t table[1 << LZ_HASH_BITS];
+
+    if (len > WFS_BLOCK_SIZE) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ_MATCH_LIMIT) {
+        const unsigned char *match_limit = end - LZ_MATCH_LIMIT;
+        const unsigned char *extend_limit = end - LZ_LAST_LITERALS;
+        unsigned int misses = 0;
+        ip++;
+        while (ip < match_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+            const unsigned char *ref = base + table[hash];
+            table[hash] = ip - base;
+            if (ref >= ip || read32(ref) != sequence) {
+                ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            // Grow the match backwards into pending literals, then forwards
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *match_end = ip + LZ_MIN_MATCH;
+            const unsigned char *ref_end = ref + LZ_MIN_MATCH;
+            uint64_t differ = 0;
+            while (match_end + 8 <= extend_limit) {
+                uint64_t a, b;
+                memcpy(&a, match_end, 8);
+                memcpy(&b, ref_end, 8);
+                if ((differ = a ^ b) != 0) {
+                    match_end += __builtin_ctzll(differ) / 8;   // Little-endian: first differing byte
+                    break;
+                }
+                match_end += 8;
+                ref_end += 8;
+            }
+            while (!differ && match_end < extend_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t match = match_end - ip - LZ_MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1) {
+                return 0;
+            }
+            unsigned char *token = op++;
+            *token = (literals >= 15 ? 15 : literals) << 4;
+            if (literals >= 15) {
+                op = lz_put_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= match >= 15 ? 15 : match;
+            if (match >= 15) {
+                op = lz_put_length(op, match - 15);
+            }
+            ip = anchor = match_end;
+        }
+    }
+
+    size_t literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    unsigned char *token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15) {
+        op = lz_put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - (unsigned char *)dst;
+}
+
+// Read a length's continuation bytes; returns -1 past the end of the input
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int wfs_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *end = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *op_end = op + cap;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && lz_get_length(&ip, end, &literals) != 0) {
+            return -EINVAL;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return -EINVAL;
+        }
+        // Short runs are copied as a fixed 16 bytes where both sides have room
+        if (literals <= 16 && end - ip >= 16 && op_end - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            return op - (unsigned char *)dst;
+        }
+
+        if (end - ip < 2) {
+            return -EINVAL;
+        }
+        size_t distance = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && lz_get_length(&ip, end, &match) != 0) {
+            return -EINVAL;
+        }
+        match += LZ_MIN_MATCH;
+        if (distance == 0 || distance > (size_t)(op - (unsigned char *)dst) || match > (size_t)(op_end - op)) {
+            return -EINVAL;
+        }
+
+        // A match may overlap the bytes it produces, e.g. a run. Eight bytes at a time is
+        // safe once it starts at least eight back, and may write past the match into room
+        // the next sequence overwrites.
+        const unsigned char *ref = op - distance;
+        if (distance >= 8 && (size_t)(op_end - op) >= match + 8) {
+            unsigned char *match_end = op + match;
+            while (op < match_end) {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            }
+            op = match_end;
+        } else {
+            while (match--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return -EINVAL;     // Ended without the final literals
+}
+
+// Decompressed blocks, direct-mapped by record offset. A slot's lock is held while it is
+// filled and copied from, so concurrent reads of one block decompress it once.
+#define BLOCK_CACHE_SLOTS 64
+
+struct block_cache_slot {
+    pthread_mutex_t lock;
+    uint64_t record;        // offset of the record held, 0 if none
+    char *bytes;            // WFS_BLOCK_SIZE bytes, allocated on first use
+};
+
+static struct block_cache_slot block_cache[BLOCK_CACHE_SLOTS];
+static pthread_once_t block_cache_once = PTHREAD_ONCE_INIT;
+static uint64_t block_cache_hits = 0;
+static uint64_t block_cache_misses = 0;
+
+static void block_cache_init(void) {
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        pthread_mutex_init(&block_cache[i].lock, NULL);
+    }
+}
+
+// Copy size bytes of a compressed extent, starting skip bytes into it, to buf
+int wfs_block_read(struct wfs_sb *sb, const struct wfs_extent *extent, uint64_t skip, char *buf, size_t size) {
+    uint64_t record = extent->log_offset;
+    uint64_t start = (extent->block & ~WFS_EXTENT_COMPRESSED) + skip;
+    uint64_t head = __atomic_load_n(&sb->head, __ATOMIC_RELAXED);
+    struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)sb + record);
+    if (record < wfs_log_start(sb) || record + sizeof(struct wfs_log_entry) + sizeof(struct wfs_block) > head ||
+        entry->inode.flags != (WFS_INODE_DATA | WFS_INODE_COMPRESSED) || entry->inode.size < sizeof(struct wfs_block) ||
+        record + wfs_entry_len(entry) > head) {
+        fprintf(stderr, "Corrupt compressed extent at %lu\n", record);
+        return -EIO;
+    }
+    struct wfs_block *block = (struct wfs_block *)entry->data;
+    if (block->length > WFS_BLOCK_SIZE || start + size > block->length) {
+        fprintf(stderr, "Corrupt compressed block at %lu\n", record);
+        return -EIO;
+    }
+
+    pthread_once(&block_cache_once, block_cache_init);
+    struct block_cache_slot *slot = &block_cache[(record * 0x9E3779B97F4A7C15ULL) >> 58];
+    pthread_mutex_lock(&slot->lock);
+    if (slot->record != record) {
+        if (!slot->bytes && !(slot->bytes = malloc(WFS_BLOCK_SIZE))) {
+            pthread_mutex_unlock(&slot->lock);
+            return -ENOMEM;
+        }
+        int length = wfs_decompress(block->bytes, entry->inode.size - sizeof(struct wfs_block), slot->bytes, block->length);
+        if (length != (int)block->length) {
+            slot->record = 0;
+            pthread_mutex_unlock(&slot->lock);
+            fprintf(stderr, "Corrupt compressed block at %lu\n", record);
+            return -EIO;
+        }
+        slot->record = record;
+        __atomic_add_fetch(&block_cache_misses, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&block_cache_hits, 1, __ATOMIC_RELAXED);
+    }
+    memcpy(buf, slot->bytes + start, size);
+    pthread_mutex_unlock(&slot->lock);
+    return 0;
+}
+
+void wfs_block_cache_clear(void) {
+    pthread_once(&block_cache_once, block_cache_init);
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        pthread_mutex_lock(&block_cache[i].lock);
+        block_cache[i].record = 0;
+        pthread_mutex_unlock(&block_cache[i].lock);
+    }
+}
+
+void wfs_block_cache_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = __atomic_load_n(&block_cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&block_cache_misses, __ATOMIC_RELAXED);
+}
+
+// FNV-1a; directory slots use its low bits
+uint32_t wfs_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+// Fill chain with the index versions of a paged directory, newest first
+static int dir_chain(struct wfs_sb *sb, struct wfs_log_entry *entry, struct wfs_log_entry **chain) {
+    uint64_t head = __atomic_load_n(&sb->head, __ATOMIC_RELAXED);  // Appends may be moving it
+    int length = 0;
+    while (1) {
+        if (length > WFS_MAX_DIR_DEPTH || (char *)entry < (char *)sb + wfs_log_start(sb) || (char *)entry >= (char *)sb + head ||
+            !(entry->inode.flags & WFS_INODE_PAGED)) {
+            fprintf(stderr, "Corrupt directory index for inode %u\n", chain[0]->inode.inode_number);
+            return -EINVAL;
+        }
+        chain[length++] = entry;
+
+        struct wfs_dir_index *index = (struct wfs_dir_index *)entry->data;
+        if (index->prev == 0) {
+            return length;
+        }
+        entry = (struct wfs_log_entry *)((char *)sb + index->prev);
+    }
+}
+
+// Set *page to the offset of the page serving slot of a paged directory, 0 if it is empty
+int wfs_dir_find_page(struct wfs_sb *sb, struct wfs_log_entry *dir, uint32_t slot, uint64_t *page) {
+    struct wfs_log_entry *chain[WFS_MAX_DIR_DEPTH + 1];
+    int length = dir_chain(sb, dir, chain);
+    if (length < 0) {
+        return length;
+    }
+
+    // The newest version that lists the slot wins; the oldest lists all of them in order
+    for (int i = 0; i < length; i++) {
+        struct wfs_dir_index *index = (struct wfs_dir_index *)chain[i]->data;
+        if (index->prev == 0) {
+            if (slot >= index->count) {
+                return -EINVAL;
+            }
+            *page = index->slots[slot].page;
+            return 0;
+        }
+        for (uint32_t j = index->count; j > 0; j--) {
+            if (index->slots[j - 1].slot == slot) {
+                *page = index->slots[j - 1].page;
+                return 0;
+            }
+        }
+    }
+    return -EINVAL;
+}
+
+// Fill pages (1 << global_depth of them) with the page offset of every slot of a paged directory
+int wfs_dir_slots(struct wfs_sb *sb, struct wfs_log_entry *dir, uint64_t *pages) {
+    struct wfs_log_entry *chain[WFS_MAX_DIR_DEPTH + 1];
+    int length = dir_chain(sb, dir, chain);
+    if (length < 0) {
+        return length;
+    }
+
+    uint32_t slots = 1u << ((struct wfs_dir_index *)dir->data)->global_depth;
+    for (int i = length - 1; i >= 0; i--) {
+        struct wfs_dir_index *index = (struct wfs_dir_index *)chain[i]->data;
+        for (uint32_t j = 0; j < index->count; j++) {
+            if (index->slots[j].slot >= slots) {
+                fprintf(stderr, "Corrupt directory index for inode %u\n", dir->inode.inode_number);
+                return -EINVAL;
+            }
+            pages[index->slots[j].slot] = index->slots[j].page;
+        }
+    }
+    return 0;
+}
+
+// Write a dentry naming inode_number at dest, padding included, and return the bytes it takes up
+uint32_t wfs_put_dentry(struct wfs_dentry *dest, const char *name, uint32_t inode_number) {
+    size_t name_len = strlen(name);
+    memset(dest, 0, wfs_dentry_len(name_len));
+    dest->inode_number = inode_number;
+    dest->name_len = name_len;
+    memcpy(dest->name, name, name_len);
+    return wfs_dentry_len(name_len);
+}
+
+// Names in an inline directory
+uint32_t wfs_dir_count(struct wfs_log_entry *dir) {
+    uint32_t count = 0;
+    for (char *pos = dir->data; pos < dir->data + dir->inode.size; pos = (char *)wfs_next_dentry((struct wfs_dentry *)pos)) {
+        count++;
+    }
+    return count;
+}
+
+// The last eight bytes of a name at least that long, as one word
+static inline uint64_t name_tail(const struct wfs_dentry *dentry) {
+    uint64_t tail;
+    memcpy(&tail, dentry->name + dentry->name_len - sizeof(tail), sizeof(tail));
+    return tail;
+}
+
+// Set *inode to the inode named name in dir. Returns -ENOENT if there is no such name.
+int wfs_dir_lookup(struct wfs_sb *sb, struct wfs_log_entry *dir, const char *name, uint32_t *inode) {
+    struct wfs_dentry *dentry;
+    uint32_t count;
+    char *end;
+
+    if (dir->inode.flags & WFS_INODE_PAGED) {
+        struct wfs_dir_index *index = (struct wfs_dir_index *)dir->data;
+        uint64_t page_offset;
+        int ret = wfs_dir_find_page(sb, dir, wfs_name_hash(name) & ((1u << index->global_depth) - 1), &page_offset);
+        if (ret != 0) {
+            return ret;
+        }
+        if (page_offset == 0) {
+            return -ENOENT;
+        }
+        struct wfs_log_entry *page_entry = (struct wfs_log_entry *)((char *)sb + page_offset);
+        struct wfs_dir_page *page = (struct wfs_dir_page *)page_entry->data;
+        dentry = (struct wfs_dentry *)page->dentries;
+        count = page->count;
+        end = (char *)wfs_next_entry(page_entry);
+    } else {
+        // Walked once, bounded by its size, rather than counted first
+        dentry = (struct wfs_dentry *)dir->data;
+        count = UINT32_MAX;
+        end = dir->data + dir->inode.size;
+    }
+
+    // A name added again later shadows the earlier one. Names are compared by length first,
+    // which rules out most dentries without touching their names. Names of eight bytes or
+    // more are then compared by their last eight bytes as one word, where names that share a
+    // prefix usually differ, and the rest only on a match; shorter ones take one memcmp().
+    // Dentries are variable length, so there is no fixed-width run of names for SIMD compares.
+    // The word compare took dir_lookup_prefix in bench.wfs from about 22 to 13 us a pass;
+    // dir_lookup, whose names mostly differ in length, stays at about 12 us.
+    size_t name_len = strlen(name);
+    uint64_t key = 0;
+    if (name_len >= sizeof(key)) {
+        memcpy(&key, name + name_len - sizeof(key), sizeof(key));
+    }
+    int found = 0;
+    for (uint32_t i = 0; i < count && (char *)dentry < end; i++, dentry = wfs_next_dentry(dentry)) {
+        if (dentry->name_len == name_len &&
+            (name_len >= sizeof(key) ? name_tail(dentry) == key && memcmp(dentry->name, name, name_len - sizeof(key)) == 0
+                                     : memcmp(dentry->name, name, name_len) == 0)) {
+            *inode = dentry->inode_number;
+            found = 1;
+        }
+    }
+    return found ? 0 : -ENOENT;
+}
+
+int (*wfs_sync_hook)(struct wfs_sb *sb, uint64_t start, uint64_t end) = NULL;
+
+int wfs_sync(struct wfs_sb *sb, uint64_t start, uint64_t end) {
+    if (wfs_sync_hook) {
+        return wfs_sync_hook(sb, start, end);
+    }
+    uint64_t aligned = start - start % sysconf(_SC_PAGESIZE);
+    if (msync((char *)sb + aligned, end - aligned, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Once compaction has zeroed what it freed and made that durable, nothing past head is left
+// to clean up after a crash
+static int lower_dirty_end(struct wfs_sb *sb) {
+    if (sb->version < WFS_VERSION_DIRTY_END) {
+        return 0;
+    }
+    sb->dirty_end = sb->head;
+    return wfs_sync(sb, 0, WFS_SB_SIZE);
+}
+
+// Copy the pending compacted run down to the start of the log, or to the end of the part
+// snapshots pin, and make it the rest of the log. The run never overlaps its destination
+// (the live bytes fit below the old head), so this can be repeated safely if a crash
+// interrupts it.
+int wfs_compact_finish(struct wfs_sb *sb, size_t disk_size) {
+    if (sb->version < WFS_VERSION_LARGE || sb->compact_src == 0) {
+        return 0;
+    }
+
+    uint64_t start = wfs_compact_base(sb);
+    uint64_t src = sb->compact_src;
+    uint64_t len = sb->compact_len;
+
+    if (src < start + len || src + len > disk_size) {
+        fprintf(stderr, "Invalid pending compaction at %lu (%lu bytes)\n", src, len);
+        return -EINVAL;
+    }
+
+    memcpy((char *)sb + start, (char *)sb + src, len);
+    wfs_block_cache_clear();    // Record offsets now name different records
+    int ret = wfs_sync(sb, start, start + len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Everything past the new head goes back to zeroes, as on a fresh image
+    sb->head = start + len;
+    sb->txn_start = sb->head;
+    sb->compact_src = 0;
+    sb->compact_len = 0;
+    memset((char *)sb + sb->head, 0, src + len - sb->head);
+
+    ret = wfs_sync(sb, sb->head, src + len);
+    if (ret == 0) {
+        ret = wfs_sync(sb, 0, WFS_SB_SIZE);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    return lower_dirty_end(sb);
+}
+
+static int compact_dir(struct wfs_sb *sb, struct wfs_log_entry *entry, char *dest, uint64_t final, uint64_t *length);
+
+// A file holding compressed blocks is compacted without decompressing them: it is written back
+// as each block record its extents still point at, then one record with the bytes of its
+// uncompressed extents, then a version listing every extent. Holes stay holes.
+struct block_plan {
+    struct wfs_extent *extents;     // visible extents, sorted by file offset
+    uint32_t count;
+    uint64_t *records;              // block records they point at, sorted and unique
+    uint32_t record_count;
+    uint64_t raw_bytes;             // bytes of the uncompressed extents
+    uint64_t len;                   // bytes the compacted file takes up
+};
+
+static int compare_offsets(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void free_block_plan(struct block_plan *plan) {
+    free(plan->extents);
+    free(plan->records);
+}
+
+// Returns 1 with plan filled in if the file holds compressed extents, 0 if it is compacted
+// the usual way, or a negative errno
+static int plan_blocks(struct wfs_sb *sb, struct wfs_log_entry *entry, struct block_plan *plan) {
+    memset(plan, 0, sizeof(*plan));
+    if (!(sb->features & WFS_FEATURE_COMPRESS) || !(entry->inode.flags & WFS_INODE_EXTENTS)) {
+        return 0;
+    }
+
+    int ret = wfs_collect_extents(sb, entry, &plan->extents, &plan->count);
+    if (ret != 0) {
+        return ret;
+    }
+    plan->records = malloc((plan->count + 1) * sizeof(uint64_t));
+    if (!plan->records) {
+        free_block_plan(plan);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < plan->count; i++) {
+        if (plan->extents[i].block & WFS_EXTENT_COMPRESSED) {
+            plan->records[plan->record_count++] = plan->extents[i].log_offset;
+        } else {
+            plan->raw_bytes += plan->extents[i].length;
+        }
+    }
+    if (plan->record_count == 0) {
+        free_block_plan(plan);
+        return 0;
+    }
+
+    qsort(plan->records, plan->record_count, sizeof(uint64_t), compare_offsets);
+    uint32_t unique = 0;
+    for (uint32_t i = 0; i < plan->record_count; i++) {
+        if (unique == 0 || plan->records[unique - 1] != plan->records[i]) {
+            plan->records[unique++] = plan->records[i];
+        }
+    }
+    plan->record_count = unique;
+
+    for (uint32_t i = 0; i < plan->record_count; i++) {
+        struct wfs_log_entry *record = (struct wfs_log_entry *)((char *)sb + plan->records[i]);
+        if (plan->records[i] < wfs_log_start(sb) || plan->records[i] >= sb->head ||
+            record->inode.flags != (WFS_INODE_DATA | WFS_INODE_COMPRESSED)) {
+            fprintf(stderr, "Corrupt compressed extent for inode %u\n", entry->inode.inode_number);
+            free_block_plan(plan);
+            return -EINVAL;
+        }
+        plan->len += wfs_entry_len(record);
+    }
+    if (plan->raw_bytes > 0) {
+        plan->len += wfs_record_len(plan->raw_bytes);
+    }
+    plan->len += wfs_record_len(sizeof(struct wfs_extent_list) + plan->count * sizeof(struct wfs_extent));
+    return 1;
+}
+
+static int compact_blocks(struct wfs_sb *sb, struct wfs_log_entry *entry, struct block_plan *plan, char *dest, uint64_t final) {
+    // Records are copied whole; moved[i] is where plan->records[i] ends up
+    uint64_t *moved = malloc(plan->record_count * sizeof(uint64_t));
+    if (!moved) {
+        return -ENOMEM;
+    }
+    uint64_t written = 0;
+    for (uint32_t i = 0; i < plan->record_count; i++) {
+        struct wfs_log_entry *record = (struct wfs_log_entry *)((char *)sb + plan->records[i]);
+        memcpy(dest + written, record, wfs_entry_len(record));
+        moved[i] = final + written;
+        written += wfs_entry_len(record);
+    }
+
+    uint64_t raw = written + sizeof(struct wfs_log_entry);
+    if (plan->raw_bytes > 0) {
+        struct wfs_log_entry *data = (struct wfs_log_entry *)(dest + written);
+        data->inode = entry->inode;
+        data->inode.flags = WFS_INODE_DATA;
+        data->inode.size = plan->raw_bytes;
+        data->length = wfs_content_len(data);
+        written += wfs_entry_len(data);
+    }
+
+    struct wfs_log_entry *file = (struct wfs_log_entry *)(dest + written);
+    file->inode = entry->inode;
+    struct wfs_extent_list *list = (struct wfs_extent_list *)file->data;
+    list->prev = 0;
+    list->depth = 0;
+    list->count = plan->count;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        struct wfs_extent extent = plan->extents[i];
+        if (extent.block & WFS_EXTENT_COMPRESSED) {
+            uint64_t *record = bsearch(&extent.log_offset, plan->records, plan->record_count, sizeof(uint64_t), compare_offsets);
+            extent.log_offset = moved[record - plan->records];
+        } else {
+            memcpy(dest + raw, (char *)sb + extent.log_offset, extent.length);
+            extent.log_offset = final + raw;
+            raw += extent.length;
+        }
+        list->extents[i] = extent;
+    }
+    file->length = wfs_content_len(file);
+    free(moved);
+    return 0;
+}
+
+// Compaction writes an extent file back as one data record holding all of its bytes followed
+// by a version with a single extent, so its chain and superseded data can be dropped.
+static uint64_t compacted_len(struct wfs_sb *sb, struct wfs_log_entry *entry) {
+    if (entry->inode.flags & WFS_INODE_PAGED) {
+        uint64_t length;
+        if (compact_dir(sb, entry, NULL, 0, &length) != 0) {
+            return wfs_entry_len(entry);    // compact_dir() fails again when it is copied
+        }
+        return length;
+    }
+    if (!(entry->inode.flags & WFS_INODE_EXTENTS)) {
+        return wfs_entry_len(entry);
+    }
+    struct block_plan plan;
+    if (plan_blocks(sb, entry, &plan) == 1) {
+        free_block_plan(&plan);
+        return plan.len;
+    }
+    if (entry->inode.size == 0) {
+        return wfs_record_len(sizeof(struct wfs_extent_list));
+    }
+    // At most, as if no chunk were shared and each got an extent
+    uint64_t extents = 1;
+    if (sb->features & WFS_FEATURE_DEDUP) {
+        extents += entry->inode.size / WFS_DEDUP_CHUNK;
+    }
+    return wfs_record_len(entry->inode.size) + wfs_record_len(sizeof(struct wfs_extent_list) + extents * sizeof(struct wfs_extent));
+}
+
+// On a WFS_FEATURE_DEDUP image compaction shares chunks between the files it writes back.
+// Each file is still one data record and one version, but the record only holds the chunks
+// that nothing earlier in the compacted log holds, and the version's extents point at those
+// for the rest. table maps the fingerprints of chunks written so far to their final offsets;
+// their bytes are in run, which ends up at log offset run_final.
+struct compact_dedup {
+    struct wfs_dedup_table table;
+    char *run;
+    uint64_t run_final;
+};
+
+static int compact_dedup_file(struct wfs_sb *sb, struct wfs_log_entry *entry, char *dest, uint64_t final,
+                              struct compact_dedup *dedup, uint64_t *length) {
+    uint64_t size = entry->inode.size;
+    uint32_t chunks = (size + WFS_DEDUP_CHUNK - 1) / WFS_DEDUP_CHUNK;
+    char *bytes = malloc(size);
+    struct wfs_extent *extents = malloc(chunks * sizeof(struct wfs_extent));
+    if (!bytes || !extents) {
+        free(bytes);
+        free(extents);
+        return -ENOMEM;
+    }
+    int ret = wfs_file_read(sb, entry, bytes, size, 0);
+    if (ret < 0) {
+        free(bytes);
+        free(extents);
+        return ret;
+    }
+
+    // Chunks that are stored follow each other in the record, so runs of them (and of shared
+    // chunks that were stored together) make one extent
+    struct wfs_log_entry *data = (struct wfs_log_entry *)dest;
+    uint64_t stored = 0;
+    uint32_t count = 0;
+    ret = 0;
+    for (uint32_t i = 0; i < chunks && ret == 0; i++) {
+        uint64_t start = (uint64_t)i * WFS_DEDUP_CHUNK;
+        uint32_t len = size - start < WFS_DEDUP_CHUNK ? size - start : WFS_DEDUP_CHUNK;
+        uint64_t fingerprint = 0;
+        uint64_t log_offset = 0;
+        if (len == WFS_DEDUP_CHUNK) {
+            fingerprint = wfs_fingerprint(bytes + start);
+            log_offset = wfs_dedup_find(&dedup->table, fingerprint);
+            if (log_offset != 0 && memcmp(dedup->run + (log_offset - dedup->run_final), bytes + start, len) != 0) {
+                log_offset = 0;
+            }
+        }
+        if (log_offset == 0) {
+            log_offset = final + sizeof(struct wfs_log_entry) + stored;
+            memcpy(data->data + stored, bytes + start, len);
+            stored += len;
+            if (fingerprint != 0) {
+                ret = wfs_dedup_insert(&dedup->table, fingerprint, log_offset);
+            }
+        }
+
+        struct wfs_extent *last = count > 0 ? &extents[count - 1] : NULL;
+        if (last && last->log_offset + last->length == log_offset) {
+            last->length += len;
+        } else {
+            extents[count].file_offset = start;
+            extents[count].log_offset = log_offset;
+            extents[count].length = len;
+            extents[count].block = 0;
+            count++;
+        }
+    }
+    free(bytes);
+    if (ret != 0) {
+        free(extents);
+        return ret;
+    }
+
+    // A file made only of shared chunks needs no record
+    struct wfs_log_entry *file = (struct wfs_log_entry *)dest;
+    if (stored > 0) {
+        data->inode = entry->inode;
+        data->inode.flags = WFS_INODE_DATA;
+        data->inode.size = stored;
+        data->length = wfs_content_len(data);
+        file = wfs_next_entry(data);
+    }
+    file->inode = entry->inode;
+    struct wfs_extent_list *list = (struct wfs_extent_list *)file->data;
+    list->prev = 0;
+    list->depth = 0;
+    list->count = count;
+    memcpy(list->extents, extents, count * sizeof(struct wfs_extent));
+    file->length = wfs_content_len(file);
+    free(extents);
+
+    *length = (char *)wfs_next_entry(file) - dest;
+    return 0;
+}
+
+// Write the compacted form of an extent file at dest, which ends up at log offset final, and
+// set *length to the bytes written
+static int compact_extent_file(struct wfs_sb *sb, struct wfs_log_entry *entry, char *dest, uint64_t final,
+                               struct compact_dedup *dedup, uint64_t *length) {
+    struct wfs_log_entry *file = (struct wfs_log_entry *)dest;
+    struct wfs_extent_list *list = (struct wfs_extent_list *)file->data;
+
+    struct block_plan plan;
+    int ret = plan_blocks(sb, entry, &plan);
+    if (ret != 0) {
+        if (ret == 1) {
+            ret = compact_blocks(sb, entry, &plan, dest, final);
+            *length = plan.len;
+            free_block_plan(&plan);
+        }
+        return ret;
+    }
+    if (dedup && entry->inode.size > 0) {
+        return compact_dedup_file(sb, entry, dest, final, dedup, length);
+    }
+
+    if (entry->inode.size > 0) {
+        struct wfs_log_entry *data = (struct wfs_log_entry *)dest;
+        data->inode = entry->inode;
+        data->inode.flags = WFS_INODE_DATA;
+        data->length = wfs_content_len(data);
+        ret = wfs_file_read(sb, entry, data->data, entry->inode.size, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        file = wfs_next_entry(data);
+        file->inode = entry->inode;
+        list = (struct wfs_extent_list *)file->data;
+        list->count = 1;
+        list->extents[0].file_offset = 0;
+        list->extents[0].log_offset = final + sizeof(struct wfs_log_entry);
+        list->extents[0].length = entry->inode.size;
+        list->extents[0].block = 0;
+    } else {
+        file->inode = entry->inode;
+        list->count = 0;
+    }
+
+    list->prev = 0;
+    list->depth = 0;
+    file->length = wfs_content_len(file);
+    *length = (char *)wfs_next_entry(file) - dest;
+    return 0;
+}
+
+// Compaction writes a paged directory back as each of its pages once followed by a version
+// listing every slot, so its index chain and superseded pages can be dropped. With dest NULL
+// this only sets *length to the bytes it would write.
+static int compact_dir(struct wfs_sb *sb, struct wfs_log_entry *entry, char *dest, uint64_t final, uint64_t *length) {
+    struct wfs_dir_index *index = (struct wfs_dir_index *)entry->data;
+    uint32_t slots = 1u << index->global_depth;
+    uint64_t *pages = calloc(slots, sizeof(uint64_t));
+    if (!pages) {
+        return -ENOMEM;
+    }
+    int ret = wfs_dir_slots(sb, entry, pages);
+    if (ret != 0) {
+        free(pages);
+        return ret;
+    }
+
+    // Check every page before anything is written
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        struct wfs_log_entry *page_entry = (struct wfs_log_entry *)((char *)sb + pages[slot]);
+        if (pages[slot] != 0 && ((struct wfs_dir_page *)page_entry->data)->local_depth > index->global_depth) {
+            fprintf(stderr, "Corrupt directory page for inode %u\n", entry->inode.inode_number);
+            free(pages);
+            return -EINVAL;
+        }
+    }
+
+    // A page with local depth d serves every slot sharing its low d bits, the first of
+    // which is below 1 << d; later ones take the offset it was moved to
+    uint64_t written = 0;
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        if (pages[slot] == 0) {
+            continue;
+        }
+        struct wfs_log_entry *page_entry = (struct wfs_log_entry *)((char *)sb + pages[slot]);
+        uint32_t local_depth = ((struct wfs_dir_page *)page_entry->data)->local_depth;
+        if (slot >= (1u << local_depth)) {
+            pages[slot] = pages[slot & ((1u << local_depth) - 1)];
+            continue;
+        }
+
+        if (dest) {
+            memcpy(dest + written, page_entry, wfs_entry_len(page_entry));
+        }
+        pages[slot] = final + written;
+        written += wfs_entry_len(page_entry);
+    }
+
+    if (dest) {
+        struct wfs_log_entry *dir = (struct wfs_log_entry *)(dest + written);
+        dir->inode = entry->inode;
+        struct wfs_dir_index *new_index = (struct wfs_dir_index *)dir->data;
+        new_index->prev = 0;
+        new_index->depth = 0;
+        new_index->count = slots;
+        new_index->global_depth = index->global_depth;
+        new_index->entries = index->entries;
+        for (uint32_t slot = 0; slot < slots; slot++) {
+            new_index->slots[slot].slot = slot;
+            new_index->slots[slot].reserved = 0;
+            new_index->slots[slot].page = pages[slot];
+        }
+        dir->length = wfs_content_len(dir);
+    }
+    free(pages);
+
+    *length = written + wfs_record_len(sizeof(struct wfs_dir_index) + slots * sizeof(struct wfs_dir_slot));
+    return 0;
+}
+
+// Rewrite the log so it holds only the latest non-deleted entry of every inode, in their
+// original order, with extent files flattened by compact_extent_file() and paged directories
+// rewritten by compact_dir(). Live entries are first copied into the free space past head and the
+// superblock records the move before the old log is overwritten, so a crash leaves either
+// the old log or a move that wfs_compact_finish() completes at the next mount. When the
+// free space cannot hold the live entries they are staged in memory instead, which is not
+// crash-safe but is the only way left to reclaim space on a nearly full image. The log below
+// wfs_compact_base() is pinned by snapshots and left as it is; only the latest versions above
+// it are rewritten, right after it, along with the tombstones that hide pinned versions.
+int wfs_compact(struct wfs_sb *sb, size_t disk_size, struct wfs_compact_stats *stats) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(stats, 0, sizeof(struct wfs_compact_stats));
+
+    if (sb->version < WFS_VERSION_LARGE) {
+        fprintf(stderr, "Compaction needs a version %d image; open it with wfs_map()\n", WFS_VERSION_LARGE);
+        return -EINVAL;
+    }
+
+    uint64_t base = wfs_compact_base(sb);
+    struct wfs_log_entry *start_of_log = (struct wfs_log_entry *)((char *)sb + wfs_log_start(sb));
+    struct wfs_log_entry *unpinned = (struct wfs_log_entry *)((char *)sb + base);
+    struct wfs_log_entry *end_of_log = (struct wfs_log_entry *)((char *)sb + sb->head);
+    struct wfs_log_entry *current_entry;
+
+    // Latest entry for every inode, and whether one of its versions is pinned
+    uint64_t *latest = calloc(sb->next_inode, sizeof(uint64_t));
+    char *pinned = calloc(sb->next_inode, 1);
+    if (!latest || !pinned) {
+        free(latest);
+        free(pinned);
+        return -ENOMEM;
+    }
+
+    for (current_entry = start_of_log; current_entry < end_of_log; current_entry = wfs_scan_next(current_entry)) {
+        if (!wfs_is_version(current_entry)) {
+            continue;
+        }
+        if (current_entry->inode.inode_number >= sb->next_inode) {
+            fprintf(stderr, "Inode %u is past the allocation mark\n", current_entry->inode.inode_number);
+            free(latest);
+            free(pinned);
+            return -EINVAL;
+        }
+        latest[current_entry->inode.inode_number] = (char *)current_entry - (char *)sb;
+        pinned[current_entry->inode.inode_number] |= current_entry < unpinned;
+    }
+
+    // A deleted inode's tombstone is kept while an older version is pinned, or that version
+    // would be its latest again
+    for (uint32_t inode = 0; inode < sb->next_inode; inode++) {
+        if (latest[inode] >= base && !pinned[inode] && ((struct wfs_log_entry *)((char *)sb + latest[inode]))->inode.deleted) {
+            latest[inode] = 0;
+        }
+    }
+    free(pinned);
+
+    uint64_t live_bytes = 0;
+    for (current_entry = unpinned; current_entry < end_of_log; current_entry = wfs_scan_next(current_entry)) {
+        if (wfs_is_version(current_entry) && latest[current_entry->inode.inode_number] == (char *)current_entry - (char *)sb) {
+            live_bytes += compacted_len(sb, current_entry);
+            stats->live_entries++;
+        } else {
+            stats->dead_entries++;
+        }
+    }
+
+    stats->bytes_before = sb->head - wfs_log_start(sb);
+    stats->bytes_after = base - wfs_log_start(sb) + live_bytes;
+
+    // Flattening fills the holes of sparse extent files, so compaction does not always shrink.
+    // With shared chunks that is only known once the run is written.
+    if (stats->dead_entries == 0 || (!(sb->features & WFS_FEATURE_DEDUP) && live_bytes >= sb->head - base)) {
+        stats->bytes_after = stats->bytes_before;
+        free(latest);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        return 0;
+    }
+
+    char *staging = NULL;
+    if (sb->head + live_bytes > disk_size) {
+        staging = calloc(1, live_bytes);   // Padding between entries stays zeroed
+        if (!staging) {
+            free(latest);
+            return -ENOMEM;
+        }
+    }
+
+    // The run is written past head, so dirty_end covers it first, and its padding is zeroed
+    // here rather than taken on trust from the free space
+    if (!staging) {
+        int ret = wfs_mark_dirty(sb, sb->head + live_bytes);
+        if (ret != 0) {
+            free(latest);
+            return ret;
+        }
+        memset(end_of_log, 0, live_bytes);
+    }
+
+    // live_bytes is only an upper bound when chunks are shared; the run is as long as it is
+    char *run = staging ? staging : (char *)end_of_log;
+    char *dest = run;
+    struct compact_dedup dedup = {.run = run, .run_final = base};
+    for (current_entry = unpinned; current_entry < end_of_log; current_entry = wfs_scan_next(current_entry)) {
+        if (!wfs_is_version(current_entry) || latest[current_entry->inode.inode_number] != (char *)current_entry - (char *)sb) {
+            continue;
+        }
+
+        // Extents and pages point at where the run will finally sit, at the base
+        uint64_t final = base + (dest - run);
+        uint64_t length = compacted_len(sb, current_entry);
+        int failed = 0;
+        if (current_entry->inode.flags & WFS_INODE_EXTENTS) {
+            failed = compact_extent_file(sb, current_entry, dest, final,
+                                         (sb->features & WFS_FEATURE_DEDUP) ? &dedup : NULL, &length) != 0;
+        } else if (current_entry->inode.flags & WFS_INODE_PAGED) {
+            failed = compact_dir(sb, current_entry, dest, final, &length) != 0;
+        } else {
+            memcpy(dest, current_entry, wfs_entry_len(current_entry));
+        }
+        if (failed) {
+            if (!staging) {
+                memset(run, 0, dest + length - run); // Free space stays zeroed
+            }
+            free(latest);
+            free(staging);
+            wfs_dedup_free(&dedup.table);
+            return -EINVAL;
+        }
+        dest += length;
+    }
+    free(latest);
+    wfs_dedup_free(&dedup.table);
+
+    live_bytes = dest - run;
+    stats->bytes_after = base - wfs_log_start(sb) + live_bytes;
+    if (live_bytes >= sb->head - base) {
+        if (!staging) {
+            memset(run, 0, live_bytes);
+        }
+        free(staging);
+        stats->bytes_after = stats->bytes_before;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        return 0;
+    }
+
+    int ret = 0;
+    if (staging) {
+        uint64_t old_head = sb->head;
+        sb->checkpoint = 0;
+        memcpy(unpinned, staging, live_bytes);
+        sb->head = base + live_bytes;
+        sb->txn_start = sb->head;
+        memset((char *)sb + sb->head, 0, old_head - sb->head);
+        free(staging);
+        wfs_block_cache_clear();
+
+        ret = wfs_sync(sb, base, old_head);
+        if (ret == 0) {
+            ret = wfs_sync(sb, 0, WFS_SB_SIZE);
+        }
+        if (ret == 0) {
+            ret = lower_dirty_end(sb);
+        }
+    } else {
+        // Make the copy durable before recording the move
+        ret = wfs_sync(sb, sb->head, sb->head + live_bytes);
+        if (ret != 0) {
+            return ret;
+        }
+
+        sb->compact_len = live_bytes;
+        sb->compact_src = sb->head;
+        sb->checkpoint = 0;
+        ret = wfs_sync(sb, 0, WFS_SB_SIZE);
+        if (ret != 0) {
+            return ret;
+        }
+
+        ret = wfs_compact_finish(sb, disk_size);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return ret;
+}
+
+// XXH64, which checks a log at memory speed. Unaligned loads go through memcpy.
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t checksum_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t checksum_merge(uint64_t acc, uint64_t val) {
+    acc ^= checksum_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t wfs_checksum(const void *buf, size_t len, uint64_t seed) {
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do {
+            v1 = checksum_round(v1, read64(p));
+            v2 = checksum_round(v2, read64(p + 8));
+            v3 = checksum_round(v3, read64(p + 16));
+            v4 = checksum_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = checksum_merge(h, v1);
+        h = checksum_merge(h, v2);
+        h = checksum_merge(h, v3);
+        h = checksum_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= checksum_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= v * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// The fields a transaction's checksum is seeded with
+uint64_t wfs_commit_seed(const struct wfs_commit *commit) {
+    return commit->epoch * PRIME64_1 ^ commit->len;
+}
+
+// XXH64 of the chunk. Matches are compared byte for byte before they are used, so this only
+// has to spread chunks over the table.
+uint64_t wfs_fingerprint(const void *chunk) {
+    uint64_t fingerprint = wfs_checksum(chunk, WFS_DEDUP_CHUNK, 0);
+    return fingerprint ? fingerprint : 1;
+}
+
+// Open addressing with linear probing, kept at most half full
+uint64_t wfs_dedup_find(const struct wfs_dedup_table *table, uint64_t fingerprint) {
+    if (!table->slots) {
+        return 0;
+    }
+    for (size_t i = fingerprint & table->mask; table->slots[i].fingerprint != 0; i = (i + 1) & table->mask) {
+        if (table->slots[i].fingerprint == fingerprint) {
+            return table->slots[i].offset;
+        }
+    }
+    return 0;
+}
+
+int wfs_dedup_insert(struct wfs_dedup_table *table, uint64_t fingerprint, uint64_t offset) {
+    if (!table->slots || (table->used + 1) * 2 > table->mask + 1) {
+        size_t slot_count = table->slots ? (table->mask + 1) * 2 : 1024;
+        struct wfs_dedup_slot *slots = calloc(slot_count, sizeof(struct wfs_dedup_slot));
+        if (!slots) {
+            return -ENOMEM;
+        }
+        for (size_t i = 0; table->slots && i <= table->mask; i++) {
+            if (table->slots[i].fingerprint == 0) {
+                continue;
+            }
+            size_t j = table->slots[i].fingerprint & (slot_count - 1);
+            while (slots[j].fingerprint != 0) {
+                j = (j + 1) & (slot_count - 1);
+            }
+            slots[j] = table->slots[i];
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->mask = slot_count - 1;
+    }
+
+    size_t i = fingerprint & table->mask;
+    while (table->slots[i].fingerprint != 0) {
+        if (table->slots[i].fingerprint == fingerprint) {
+            return 0;
+        }
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i].fingerprint = fingerprint;
+    table->slots[i].offset = offset;
+    table->used++;
+    return 0;
+}
+
+void wfs_dedup_free(struct wfs_dedup_table *table) {
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Zero [from, to) of the image, writing only the pages that are not zero already, so clean
+// free space, or a sparse file's holes, is only read. Returns whether anything was written.
+static int zero_range(struct wfs_sb *sb, uint64_t from, uint64_t to) {
+    int zeroed = 0;
+    while (from < to) {
+        uint64_t next = (from / 4096 + 1) * 4096 < to ? (from / 4096 + 1) * 4096 : to;
+        char *bytes = (char *)sb + from;
+        if (bytes[0] != 0 || memcmp(bytes, bytes + 1, next - from - 1) != 0) {
+            memset(bytes, 0, next - from);
+            zeroed = 1;
+        }
+        from = next;
+    }
+    return zeroed;
+}
+
+int wfs_mark_dirty(struct wfs_sb *sb, uint64_t end) {
+    if (end <= __atomic_load_n(&sb->dirty_end, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_store_n(&sb->dirty_end, end, __ATOMIC_RELAXED);
+    return wfs_sync(sb, 0, WFS_SB_SIZE);
+}
+
+// Walk the transactions from start (txn_start, or the transaction of a checkpoint) in one
+// sequential pass and make head the end of the last one that verifies. That rolls forward
+// past a head the superblock had not caught up with, and drops a transaction that was torn
+// by a crash along with everything after it: none of those were acknowledged in strict mode,
+// where a commit waits for every earlier one. Everything past the new head up to dirty_end,
+// where a crash can have left bytes, is zeroed, so writers find free space as they expect it.
+// Commit records in logs from before version 8 have a shorter header (see upgrade_layout()),
+// so header_len says how long it is.
+static int recover_log(struct wfs_sb *sb, size_t disk_size, struct wfs_recover_stats *stats, size_t header_len, uint64_t start) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(stats, 0, sizeof(*stats));
+
+    if (sb->txn_start < wfs_log_start(sb) || sb->txn_start > disk_size) {
+        fprintf(stderr, "Invalid transaction start %lu\n", sb->txn_start);
+        return -EINVAL;
+    }
+
+    // Compaction can reset txn_start partway through a mount, so the first sequence number
+    // can be anything
+    size_t commit_len = header_len + sizeof(struct wfs_commit);
+    uint64_t offset = start;
+    uint64_t epoch = 0;
+    uint64_t seq = 0;
+    while (offset + commit_len <= disk_size) {
+        // Older commit records need not be aligned
+        struct wfs_log_entry *header = (struct wfs_log_entry *)((char *)sb + offset);
+        struct wfs_inode inode;
+        struct wfs_commit commit;
+        memcpy(&inode, header, sizeof(inode));
+        memcpy(&commit, (char *)header + header_len, sizeof(commit));
+        if (!(inode.flags & WFS_INODE_COMMIT) || inode.size != sizeof(struct wfs_commit) ||
+            (header_len == sizeof(struct wfs_log_entry) && header->length != commit_len) ||
+            commit.magic != WFS_COMMIT_MAGIC || commit.len > disk_size - offset - commit_len) {
+            break;
+        }
+        if (stats->transactions > 0 && (commit.epoch == epoch ? commit.seq != seq + 1 : commit.epoch < epoch || commit.seq != 1)) {
+            break;
+        }
+        if (wfs_checksum((char *)sb + offset + commit_len, commit.len, wfs_commit_seed(&commit)) != commit.checksum) {
+            break;
+        }
+
+        epoch = commit.epoch;
+        seq = commit.seq;
+        stats->transactions++;
+        offset += commit_len + commit.len;
+    }
+    stats->bytes_checked = offset - start;
+
+    // A checkpoint whose own transaction does not verify is no place to start from
+    if (start != sb->txn_start && stats->transactions == 0) {
+        return -EAGAIN;
+    }
+
+    // Torn bytes can be anywhere up to dirty_end, past head too
+    uint64_t dirty_end = sb->dirty_end > sb->head ? sb->dirty_end : sb->head;
+    if (sb->dirty_end == 0 || dirty_end > disk_size) {
+        dirty_end = disk_size;
+    }
+    if (offset < sb->head) {
+        stats->bytes_dropped = sb->head - offset;
+    }
+    int zeroed = zero_range(sb, offset, dirty_end);
+
+    if (offset != sb->head || zeroed || sb->dirty_end != offset) {
+        sb->head = offset;
+        sb->dirty_end = offset;
+        if (msync(sb, disk_size, MS_SYNC) == -1) {
+            perror("Error syncing changes");
+            return -EIO;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return 0;
+}
+
+// Transactions below a checkpoint were durable before it was, so they need no checking again
+int wfs_recover(struct wfs_sb *sb, size_t disk_size, struct wfs_recover_stats *stats) {
+    struct wfs_checkpoint *checkpoint = wfs_checkpoint_at(sb, sb->head);
+    if (checkpoint && checkpoint->head > sb->txn_start &&
+        recover_log(sb, disk_size, stats, sizeof(struct wfs_log_entry), checkpoint->head) == 0) {
+        return 0;
+    }
+    return recover_log(sb, disk_size, stats, sizeof(struct wfs_log_entry), sb->txn_start);
+}
+
+// Version 2 and 3 superblocks have the 64-bit fields in their zeroed reserved bytes, so they
+// are filled in place. Everything changed lies in the first sector, written in one go.
+static int upgrade_superblock(struct wfs_sb *sb, size_t disk_size) {
+    sb->head = sb->head32;
+    sb->compact_src = sb->compact_src32;
+    sb->compact_len = sb->compact_len32;
+    sb->disk_size = disk_size;
+    sb->head32 = 0;
+    sb->compact_src32 = 0;
+    sb->compact_len32 = 0;
+    sb->txn_start = sb->head;
+    sb->version = WFS_VERSION_FEATURES;     // upgrade_layout() takes it from there
+
+    if (msync(sb, WFS_SB_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+    return 0;
+}
+
+// Logs from before version 8 are laid out differently: an entry is the inode followed directly
+// by its data, with no length or padding, and a dentry is a 32-byte name and a 64-bit inode
+// number. Their entries are only byte-aligned, so what they hold is read with memcpy.
+#define V7_HEADER_LEN sizeof(struct wfs_inode)
+
+struct v7_dentry {
+    char name[MAX_FILE_NAME_LEN];
+    uint64_t inode_number;
+};
+
+static uint64_t v7_entry_len(const char *entry) {
+    struct wfs_inode inode;
+    memcpy(&inode, entry, sizeof(inode));
+    if (inode.flags & WFS_INODE_EXTENTS) {
+        struct wfs_extent_list list;
+        memcpy(&list, entry + V7_HEADER_LEN, sizeof(list));
+        return V7_HEADER_LEN + sizeof(struct wfs_extent_list) + (uint64_t)list.count * sizeof(struct wfs_extent);
+    }
+    if (inode.flags & WFS_INODE_PAGED) {
+        struct wfs_dir_index index;
+        memcpy(&index, entry + V7_HEADER_LEN, sizeof(index));
+        return V7_HEADER_LEN + sizeof(struct wfs_dir_index) + (uint64_t)index.count * sizeof(struct wfs_dir_slot);
+    }
+    return V7_HEADER_LEN + inode.size;
+}
+
+// Convert count old dentries at src to dest, or with dest NULL only count the bytes they
+// become. An unterminated name is cut short.
+static uint64_t v7_convert_dentries(const char *src, uint32_t count, char *dest) {
+    uint64_t written = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct v7_dentry old;
+        memcpy(&old, src + (uint64_t)i * sizeof(old), sizeof(old));
+        old.name[MAX_FILE_NAME_LEN - 1] = '\0';
+        if (dest) {
+            written += wfs_put_dentry((struct wfs_dentry *)(dest + written), old.name, old.inode_number);
+        } else {
+            written += wfs_dentry_len(strlen(old.name));
+        }
+    }
+    return written;
+}
+
+// Bytes of data[] the old entry has once converted
+static uint64_t v7_converted_size(const char *entry) {
+    struct wfs_inode inode;
+    memcpy(&inode, entry, sizeof(inode));
+    if (inode.flags & (WFS_INODE_EXTENTS | WFS_INODE_PAGED)) {
+        return v7_entry_len(entry) - V7_HEADER_LEN;
+    }
+    if (!S_ISDIR(inode.mode)) {
+        return inode.size;
+    }
+    if (inode.flags & WFS_INODE_DATA) {
+        struct wfs_dir_page page;
+        memcpy(&page, entry + V7_HEADER_LEN, sizeof(page));
+        return sizeof(struct wfs_dir_page) + v7_convert_dentries(entry + V7_HEADER_LEN + sizeof(page), page.count, NULL);
+    }
+    return v7_convert_dentries(entry + V7_HEADER_LEN, inode.size / sizeof(struct v7_dentry), NULL);
+}
+
+// A paged directory's size is now the bytes its names take up, which only its pages tell.
+// Sets *size from the old log's version at offset.
+static int v7_paged_size(struct wfs_sb *sb, uint64_t offset, uint32_t *size) {
+    struct wfs_dir_index index;
+    memcpy(&index, (char *)sb + offset + V7_HEADER_LEN, sizeof(index));
+    if (index.global_depth > WFS_DIR_MAX_GLOBAL_DEPTH) {
+        return -EINVAL;
+    }
+    uint32_t slots = 1u << index.global_depth;
+    uint64_t *pages = calloc(slots, sizeof(uint64_t));
+    if (!pages) {
+        return -ENOMEM;
+    }
+
+    // Oldest version first, like wfs_dir_slots()
+    uint64_t chain[WFS_MAX_DIR_DEPTH + 1];
+    int length = 0;
+    for (uint64_t version = offset; version != 0; version = index.prev) {
+        if (length > WFS_MAX_DIR_DEPTH || version < wfs_log_start(sb) || version >= sb->head) {
+            free(pages);
+            return -EINVAL;
+        }
+        chain[length++] = version;
+        memcpy(&index, (char *)sb + version + V7_HEADER_LEN, sizeof(index));
+    }
+    for (int i = length - 1; i >= 0; i--) {
+        memcpy(&index, (char *)sb + chain[i] + V7_HEADER_LEN, sizeof(index));
+        for (uint32_t j = 0; j < index.count; j++) {
+            struct wfs_dir_slot slot;
+            memcpy(&slot, (char *)sb + chain[i] + V7_HEADER_LEN + sizeof(index) + (uint64_t)j * sizeof(slot), sizeof(slot));
+            if (slot.slot >= slots || slot.page >= sb->head) {
+                free(pages);
+                return -EINVAL;
+            }
+            pages[slot.slot] = slot.page;
+        }
+    }
+
+    // Each page counts once, at the first slot it serves
+    *size = 0;
+    for (uint32_t slot = 0; slot < slots; slot++) {
+        if (pages[slot] == 0) {
+            continue;
+        }
+        struct wfs_dir_page page;
+        memcpy(&page, (char *)sb + pages[slot] + V7_HEADER_LEN, sizeof(page));
+        if (slot < (1u << page.local_depth)) {
+            *size += v7_convert_dentries((char *)sb + pages[slot] + V7_HEADER_LEN + sizeof(page), page.count, NULL);
+        }
+    }
+    free(pages);
+    return 0;
+}
+
+// Old entry offsets in log order, with where each one starts in the converted log
+struct v7_map {
+    uint64_t *old_offsets;
+    uint64_t *new_offsets;
+    uint64_t count;
+};
+
+// New offset of the entry at old offset, or 0 if no entry starts there
+static uint64_t v7_map_entry(const struct v7_map *map, uint64_t offset) {
+    uint64_t *found = bsearch(&offset, map->old_offsets, map->count, sizeof(uint64_t), compare_offsets);
+    return found ? map->new_offsets[found - map->old_offsets] : 0;
+}
+
+// New offset of a byte in the data of an old entry, or 0 if it is not in one
+static uint64_t v7_map_byte(struct wfs_sb *sb, const struct v7_map *map, uint64_t offset) {
+    uint64_t low = 0;
+    uint64_t high = map->count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (map->old_offsets[mid] <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return 0;
+    }
+    uint64_t entry = map->old_offsets[low - 1];
+    if (offset < entry + V7_HEADER_LEN || offset > entry + v7_entry_len((char *)sb + entry)) {
+        return 0;
+    }
+    return map->new_offsets[low - 1] + sizeof(struct wfs_log_entry) + (offset - entry - V7_HEADER_LEN);
+}
+
+// Write the current form of the old entry at dest. Offsets it holds are moved to where their
+// targets end up.
+static int v7_convert_entry(struct wfs_sb *sb, const struct v7_map *map, const char *old, struct wfs_log_entry *dest) {
+    memcpy(&dest->inode, old, sizeof(struct wfs_inode));
+    const char *data = old + V7_HEADER_LEN;
+
+    if (dest->inode.flags & WFS_INODE_EXTENTS) {
+        struct wfs_extent_list *list = (struct wfs_extent_list *)dest->data;
+        memcpy(list, data, v7_entry_len(old) - V7_HEADER_LEN);
+        if (list->prev != 0 && (list->prev = v7_map_entry(map, list->prev)) == 0) {
+            return -EINVAL;
+        }
+        for (uint32_t i = 0; i < list->count; i++) {
+            struct wfs_extent *extent = &list->extents[i];
+            uint64_t moved = extent->block & WFS_EXTENT_COMPRESSED ? v7_map_entry(map, extent->log_offset)
+                                                                   : v7_map_byte(sb, map, extent->log_offset);
+            if (moved == 0) {
+                return -EINVAL;
+            }
+            extent->log_offset = moved;
+        }
+    } else if (dest->inode.flags & WFS_INODE_PAGED) {
+        struct wfs_dir_index *index = (struct wfs_dir_index *)dest->data;
+        memcpy(index, data, v7_entry_len(old) - V7_HEADER_LEN);
+        if (index->prev != 0 && (index->prev = v7_map_entry(map, index->prev)) == 0) {
+            return -EINVAL;
+        }
+        for (uint32_t i = 0; i < index->count; i++) {
+            if (index->slots[i].page != 0 && (index->slots[i].page = v7_map_entry(map, index->slots[i].page)) == 0) {
+                return -EINVAL;
+            }
+        }
+    } else if (S_ISDIR(dest->inode.mode) && (dest->inode.flags & WFS_INODE_DATA)) {
+        struct wfs_dir_page *page = (struct wfs_dir_page *)dest->data;
+        memcpy(page, data, sizeof(struct wfs_dir_page));
+        dest->inode.size = sizeof(struct wfs_dir_page) + v7_convert_dentries(data + sizeof(struct wfs_dir_page), page->count, page->dentries);
+    } else if (S_ISDIR(dest->inode.mode)) {
+        dest->inode.size = v7_convert_dentries(data, dest->inode.size / sizeof(struct v7_dentry), dest->data);
+    } else {
+        memcpy(dest->data, data, dest->inode.size);
+    }
+    dest->length = wfs_content_len(dest);
+    return 0;
+}
+
+// Make the mapping, and unless it is private the image file, at least size bytes
+static int grow_map(int fd, struct wfs_sb **sb, size_t *disk_size, size_t size, int read_only) {
+    if (!read_only && ftruncate(fd, size) == -1) {
+        perror("Error growing disk file");
+        return -ENOSPC;
+    }
+    void *grown = mremap(*sb, *disk_size, size, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED) {
+        perror("Error remapping disk file");
+        return -ENOSPC;
+    }
+    *sb = grown;
+    *disk_size = size;
+    return 0;
+}
+
+// Version 7 logs are rewritten in the current layout, which changes the length of nearly every
+// entry and so every offset. Every entry but the commit records is converted in log order into
+// the free space past head, with the offsets in extent lists and directory indexes moved to
+// where their targets end up, and the superblock then records the copy as a pending
+// compaction that wfs_compact_finish() moves down, as for upgrade_short_superblock(). Only the
+// latest version of a paged directory gets its size worked out; superseded ones are only
+// read for their slots.
+static int upgrade_layout(int fd, struct wfs_sb **sbp, size_t *disk_size, int read_only) {
+    struct wfs_sb *sb = *sbp;
+    uint64_t start = wfs_log_start(sb);
+
+    // Transactions a crash cut short are dropped first, as at any open
+    struct wfs_recover_stats recovery;
+    int ret = recover_log(sb, *disk_size, &recovery, V7_HEADER_LEN, sb->txn_start);
+    if (ret != 0) {
+        return ret;
+    }
+
+    struct v7_map map = {0};
+    uint64_t capacity = 0;
+    uint64_t new_len = 0;
+    uint64_t *latest = calloc(sb->next_inode ? sb->next_inode : 1, sizeof(uint64_t));    // old offset
+    if (!latest) {
+        return -ENOMEM;
+    }
+    for (uint64_t offset = start; offset < sb->head; offset += v7_entry_len((char *)sb + offset)) {
+        struct wfs_inode inode;
+        memcpy(&inode, (char *)sb + offset, sizeof(inode));
+        if (sb->head - offset < V7_HEADER_LEN || v7_entry_len((char *)sb + offset) > sb->head - offset) {
+            fprintf(stderr, "Entry at %lu runs past head %lu\n", offset, sb->head);
+            ret = -EINVAL;
+            break;
+        }
+        if (inode.flags & WFS_INODE_COMMIT) {
+            continue;
+        }
+        if (!(inode.flags & WFS_INODE_DATA)) {
+            if (inode.inode_number >= sb->next_inode) {
+                fprintf(stderr, "Inode %u is past the allocation mark\n", inode.inode_number);
+                ret = -EINVAL;
+                break;
+            }
+            latest[inode.inode_number] = offset;
+        }
+
+        if (map.count == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            uint64_t *old_offsets = realloc(map.old_offsets, capacity * sizeof(uint64_t));
+            if (old_offsets) {
+                map.old_offsets = old_offsets;
+            }
+            uint64_t *new_offsets = realloc(map.new_offsets, capacity * sizeof(uint64_t));
+            if (new_offsets) {
+                map.new_offsets = new_offsets;
+            }
+            if (!old_offsets || !new_offsets) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+        map.old_offsets[map.count] = offset;
+        map.new_offsets[map.count] = start + new_len;
+        map.count++;
+        new_len += wfs_record_len(v7_converted_size((char *)sb + offset));
+    }
+
+    // The copy must not overlap where the log ends up
+    uint64_t old_len = sb->head - start;
+    uint64_t copy_offset = wfs_align(sb->head) > start + new_len ? wfs_align(sb->head) : start + new_len;
+    if (ret == 0 && copy_offset + new_len > *disk_size) {
+        ret = grow_map(fd, sbp, disk_size, copy_offset + new_len, read_only);
+        sb = *sbp;
+    }
+
+    if (ret == 0) {
+        char *copy = (char *)sb + copy_offset;
+        memset(copy, 0, new_len);
+        for (uint64_t i = 0; i < map.count && ret == 0; i++) {
+            const char *old = (char *)sb + map.old_offsets[i];
+            struct wfs_log_entry *entry = (struct wfs_log_entry *)(copy + (map.new_offsets[i] - start));
+            ret = v7_convert_entry(sb, &map, old, entry);
+            if (ret == 0 && (entry->inode.flags & WFS_INODE_PAGED) && latest[entry->inode.inode_number] == map.old_offsets[i]) {
+                ret = v7_paged_size(sb, map.old_offsets[i], &entry->inode.size);
+            }
+            if (ret != 0) {
+                fprintf(stderr, "Corrupt entry for inode %u at %lu\n", entry->inode.inode_number, map.old_offsets[i]);
+            }
+        }
+        if (ret != 0) {
+            memset(copy, 0, new_len);   // Free space stays zeroed
+        }
+    }
+    free(latest);
+    free(map.old_offsets);
+    free(map.new_offsets);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // Make the copy durable before recording the move
+    if (msync(sb, *disk_size, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+    sb->version = WFS_VERSION;
+    sb->compact_src = copy_offset;
+    sb->compact_len = new_len;
+    if (msync(sb, WFS_SB_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+    printf("Rewrote %lu entries: %.1f MB of log is now %.1f MB\n", map.count, old_len / 1e6, new_len / 1e6);
+
+    return wfs_compact_finish(sb, *disk_size);
+}
+
+// Legacy and version 1 superblocks are shorter than the current one, so the log has to move
+// out of its way. Those logs hold inode numbers but no offsets, so they can be moved as they
+// are: the log is copied to copy_offset past head, then the new superblock records the copy
+// as a pending compaction that wfs_compact_finish() moves down behind it. A crash leaves
+// either the old image or the recorded move.
+static int upgrade_short_superblock(struct wfs_sb *sb, size_t disk_size, uint64_t copy_offset) {
+    uint64_t start = wfs_log_start(sb);
+    uint64_t len = sb->head32 - start;
+
+    // Legacy images keep no allocation mark; recover it from the log
+    uint32_t next_inode = 1;
+    if (sb->version == WFS_VERSION_LEGACY) {
+        for (uint64_t offset = start; offset < sb->head32; offset += v7_entry_len((char *)sb + offset)) {
+            struct wfs_inode inode;
+            memcpy(&inode, (char *)sb + offset, sizeof(inode));
+            if (inode.inode_number >= next_inode) {
+                next_inode = inode.inode_number + 1;
+            }
+        }
+    } else {
+        next_inode = sb->next_inode;
+    }
+
+    memcpy((char *)sb + copy_offset, (char *)sb + start, len);
+    if (msync(sb, disk_size, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+
+    memset(sb, 0, WFS_SB_SIZE);
+    sb->magic = WFS_MAGIC;
+    sb->version = WFS_VERSION_FEATURES;     // upgrade_layout() takes it from there
+    sb->next_inode = next_inode;
+    sb->head = WFS_SB_SIZE + len;
+    sb->disk_size = disk_size;
+    sb->compact_len = len;
+    sb->compact_src = copy_offset;
+    if (msync(sb, WFS_SB_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing changes");
+        return -EIO;
+    }
+
+    return wfs_compact_finish(sb, disk_size);
+}
+
+// Map a read-only image. One in the current layout is mapped privately, so recovery and a
+// pending compaction only change the mapping. An older one is read into anonymous memory,
+// which the upgrades are then free to grow.
+static struct wfs_sb *map_private(int fd, size_t size, const struct wfs_sb *header, size_t file_size) {
+    if (header->version >= WFS_VERSION_ALIGNED) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+
+    struct wfs_sb *sb = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sb == MAP_FAILED) {
+        return sb;
+    }
+
+    // Only the log, and a compaction on its way down, hold anything
+    uint64_t used = header->version < WFS_VERSION_LARGE ? header->head32 : header->head;
+    if (header->version >= WFS_VERSION_LARGE && header->compact_src + header->compact_len > used) {
+        used = header->compact_src + header->compact_len;
+    }
+    if (used > file_size) {
+        used = file_size;
+    }
+    for (uint64_t done = 0; done < used;) {
+        ssize_t n = pread(fd, (char *)sb + done, used - done, done);
+        if (n <= 0) {
+            perror("Error reading disk file");
+            munmap(sb, size);
+            return MAP_FAILED;
+        }
+        done += n;
+    }
+    return sb;
+}
+
+// Map the whole image and bring it to the current version, finishing any compaction a crash
+// interrupted. Returns NULL after reporting the problem if the file is not a usable image.
+struct wfs_sb *wfs_map(int fd, size_t *disk_size, int read_only) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading disk size");
+        return NULL;
+    }
+
+    struct wfs_sb header;
+    if (st.st_size < WFS_SB_SIZE || pread(fd, &header, WFS_SB_SIZE, 0) != WFS_SB_SIZE) {
+        fprintf(stderr, "Disk file too small to hold a superblock\n");
+        return NULL;
+    }
+
+    if (header.magic != WFS_MAGIC || header.version > WFS_VERSION) {
+        fprintf(stderr, "Not a WFS image or unsupported version\n");
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    uint64_t copy_offset = 0;
+    if (header.version < 2) {
+        if (header.head32 < wfs_log_start(&header) || header.head32 > size) {
+            fprintf(stderr, "Invalid log head %u\n", header.head32);
+            return NULL;
+        }
+
+        // The copy must not overlap where the log ends up
+        uint64_t len = header.head32 - wfs_log_start(&header);
+        copy_offset = (header.head32 + 7) & ~7ul;
+        if (copy_offset < WFS_SB_SIZE + len) {
+            copy_offset = WFS_SB_SIZE + len;
+        }
+        if (copy_offset + len > size) {
+            size = copy_offset + len;
+            if (!read_only && ftruncate(fd, size) == -1) {
+                perror("Error growing disk file");
+                return NULL;
+            }
+        }
+    }
+
+    struct wfs_sb *sb = read_only ? map_private(fd, size, &header, st.st_size)
+                                  : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (sb == MAP_FAILED) {
+        perror("Error mapping disk file");
+        return NULL;
+    }
+
+    int ret = 0;
+    if (sb->version < WFS_VERSION) {
+        printf("Upgrading version %u image to version %d%s\n", sb->version, WFS_VERSION, read_only ? " in memory" : "");
+    }
+    if (sb->version < 2) {
+        ret = upgrade_short_superblock(sb, size, copy_offset);
+    } else if (sb->version < WFS_VERSION_LARGE) {
+        ret = upgrade_superblock(sb, size);
+    } else if (sb->version < WFS_VERSION_FEATURES) {
+        // Versions 5 to 7 only add formats that older logs never contain
+        if (sb->version < WFS_VERSION_COMMITS) {
+            sb->txn_start = sb->head;
+        }
+        sb->version = WFS_VERSION_FEATURES;
+        if (msync(sb, WFS_SB_SIZE, MS_SYNC) == -1) {
+            perror("Error syncing changes");
+            ret = -EIO;
+        }
+    }
+
+    // The file may have been extended by hand, e.g. with truncate -s
+    if (ret == 0 && sb->disk_size != size) {
+        sb->disk_size = size;
+    }
+
+    if (ret == 0 && (sb->head < wfs_log_start(sb) || sb->head > size)) {
+        fprintf(stderr, "Invalid log head %lu\n", sb->head);
+        ret = -EINVAL;
+    }
+
+    if (ret == 0) {
+        ret = wfs_compact_finish(sb, size);
+    }
+
+    if (ret == 0 && sb->version < WFS_VERSION_ALIGNED) {
+        ret = upgrade_layout(fd, &sb, &size, read_only);
+        if (ret == 0) {
+            sb->disk_size = size;
+        }
+    }
+
+    // Versions 9 and 10 only add superblock fields, in bytes older versions left zeroed
+    if (ret == 0 && sb->version < WFS_VERSION) {
+        sb->version = WFS_VERSION;
+        if (msync(sb, WFS_SB_SIZE, MS_SYNC) == -1) {
+            perror("Error syncing changes");
+            ret = -EIO;
+        }
+    }
+
+    struct wfs_recover_stats recovery;
+    if (ret == 0) {
+        ret = wfs_recover(sb, size, &recovery);
+    }
+
+    if (ret != 0) {
+        munmap(sb, size);
+        return NULL;
+    }
+
+    printf("Checked %lu transactions (%.1f MB) in %.3f ms", recovery.transactions, recovery.bytes_checked / 1e6, recovery.seconds * 1e3);
+    if (recovery.bytes_dropped > 0) {
+        printf(", dropped %lu bytes of incomplete transactions", recovery.bytes_dropped);
+    }
+    printf("\n");
+
+    *disk_size = size;
+    return sb;
+}
+
+int wfs_snapshot_add(struct wfs_sb *sb, uint64_t head, uint64_t root) {
+    int slot = -1;
+    uint32_t id = 0;
+    for (int i = 0; i < WFS_MAX_SNAPSHOTS; i++) {
+        if (sb->snapshots[i].id == 0) {
+            slot = slot == -1 ? i : slot;
+        } else if (sb->snapshots[i].id > id) {
+            id = sb->snapshots[i].id;
+        }
+    }
+    if (slot == -1) {
+        return -ENOSPC;
+    }
+
+    sb->snapshots[slot].head = head;
+    sb->snapshots[slot].root = root;
+    sb->snapshots[slot].time = time(NULL);
+    sb->snapshots[slot].id = id + 1;
+    return slot;
+}
+
+int wfs_snapshot_find(const struct wfs_sb *sb, uint32_t id) {
+    for (int i = 0; id != 0 && i < WFS_MAX_SNAPSHOTS; i++) {
+        if (sb->snapshots[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint64_t wfs_latest_version(struct wfs_sb *sb, uint32_t inode, uint64_t end) {
+    uint64_t latest = 0;
+    struct wfs_log_entry *current_entry = (struct wfs_log_entry *)((char *)sb + wfs_log_start(sb));
+    struct wfs_log_entry *end_of_log = (struct wfs_log_entry *)((char *)sb + end);
+    for (; current_entry < end_of_log; current_entry = wfs_scan_next(current_entry)) {
+        if (wfs_is_version(current_entry) && current_entry->inode.inode_number == inode) {
+            latest = (char *)current_entry - (char *)sb;
+        }
+    }
+    return latest;
+}
@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifndef MOUNT_WFS_H_
 #define MOUNT_WFS_H_
@@ -7,33 +8,429 @@
 #define MAX_FILE_NAME_LEN 32
 #define WFS_MAGIC 0xdeadbeef
 
+#define WFS_VERSION_LEGACY 0    // images from before the superblock carried a version
+#define WFS_VERSION 11
+#define WFS_VERSION_EXTENTS 3   // first version whose regular files store their data as extents
+#define WFS_VERSION_LARGE 4     // first version with 64-bit log offsets and a recorded image size
+#define WFS_VERSION_PAGED_DIRS 5    // first version whose large directories use hashed pages
+#define WFS_VERSION_COMMITS 6   // first version whose appends are checksummed transactions
+#define WFS_VERSION_FEATURES 7  // first version with a features word, e.g. for compression
+#define WFS_VERSION_ALIGNED 8   // first version with aligned, length-prefixed entries and short dentries
+#define WFS_VERSION_SNAPSHOTS 9 // first version with a snapshot table
+#define WFS_VERSION_CHECKPOINTS 10  // first version with inode table checkpoints
+#define WFS_VERSION_DIRTY_END 11    // first version that bounds what a crash can leave past head
+#define WFS_SB_SIZE 512         // version 2+ superblock size; unused bytes are zero
+
+// Snapshots (version 9+). A snapshot is a log position: the filesystem as it was then is every
+// inode's latest version below it. Compaction leaves the log below the newest snapshot as it
+// is (see wfs_compact_base()), so those versions and everything they point at stay where they
+// are, and taking a snapshot copies nothing. root is the root directory's version at the time.
+#define WFS_MAX_SNAPSHOTS 12
+
+struct wfs_snapshot {
+    uint32_t id;            // 0 for an unused slot
+    uint32_t reserved;
+    uint64_t head;
+    uint64_t root;
+    uint64_t time;          // when it was taken, in seconds since the epoch
+};
+
+// Older images are converted to the current version by wfs_map() before anything else reads
+// them, so only the upgrade looks at the 32-bit fields.
 struct wfs_sb {
     uint32_t magic;
-    uint32_t head;
+    uint32_t head32;        // log head before version 4
+    uint32_t version;       // on legacy images this word is the root inode number, always 0
+    uint32_t next_inode;    // lowest inode number never handed out
+
+    // Version 2-3
+    uint32_t compact_src32;
+    uint32_t compact_len32;
+
+    // Version 4+
+    uint64_t head;
+    uint64_t disk_size;     // bytes in the image file; grows with the log
+    uint64_t compact_src;   // nonzero while a compaction is moving [compact_src, compact_src + compact_len)
+    uint64_t compact_len;   // down to the start of the log
+
+    // Version 6+
+    uint64_t txn_start;     // log below this was written by mkfs, compaction or an upgrade and
+                            // is not in transactions; everything from here up is
+    uint64_t epoch;         // bumped by every mount, so transactions left past a torn one by an
+                            // earlier mount never pass as newer ones
+
+    // Version 7+
+    uint64_t features;      // WFS_FEATURE_* chosen by mkfs.wfs
+
+    // Version 9+
+    struct wfs_snapshot snapshots[WFS_MAX_SNAPSHOTS];
+
+    // Version 10+
+    uint64_t checkpoint;    // offset of the latest checkpoint record, 0 if none
+
+    // Version 11+
+    uint64_t dirty_end;     // free space from here up is zero even after a crash (see
+                            // wfs_mark_dirty()); 0 if that is not known
+    char reserved[WFS_SB_SIZE - 6 * sizeof(uint32_t) - 9 * sizeof(uint64_t) - WFS_MAX_SNAPSHOTS * sizeof(struct wfs_snapshot)];
 };
 
+#define WFS_FEATURE_COMPRESS 0x1    // file data is written as compressed blocks
+#define WFS_FEATURE_DEDUP 0x2       // files share identical chunks of data (see WFS_DEDUP_CHUNK)
+
 struct wfs_inode {
-    unsigned int inode_number;
-    unsigned int deleted;       // 1 if deleted, 0 otherwise
-    unsigned int mode;          // type. S_IFDIR if the inode represents a directory or S_IFREG if it's for a file
-    unsigned int uid;           // user id
-    unsigned int gid;           // group id
-    unsigned int flags;         // flags
-    unsigned int size;          // size in bytes
-    unsigned int atime;         // last access time
-    unsigned int mtime;         // last modify time
-    unsigned int ctime;         // inode change time (the last time any field of inode is modified)
-    unsigned int links;         // number of hard links to this file (this can always be set to 1)
+    uint32_t inode_number;
+    uint32_t deleted;           // 1 if deleted, 0 otherwise
+    uint32_t mode;              // type. S_IFDIR if the inode represents a directory or S_IFREG if it's for a file
+    uint32_t uid;               // user id
+    uint32_t gid;               // group id
+    uint32_t flags;             // flags
+    uint32_t size;              // size in bytes
+    uint32_t atime;             // last access time
+    uint32_t mtime;             // last modify time
+    uint32_t ctime;             // inode change time (the last time any field of inode is modified)
+    uint32_t links;             // number of hard links to this file (this can always be set to 1)
 };
 
-struct wfs_dentry {
-    char name[MAX_FILE_NAME_LEN];
-    unsigned long inode_number;
-};
+#define WFS_MAX_FILE_SIZE UINT32_MAX    // inode.size is 32 bits, so no file ends past this
+
+// inode.flags, which also tell what kind of record an entry is
+#define WFS_INODE_EXTENTS 0x1   // data[] is a struct wfs_extent_list rather than the file bytes
+#define WFS_INODE_DATA 0x2      // bytes referenced by versions of inode_number (file data or a
+                                // directory page), not a version of it
+#define WFS_INODE_PAGED 0x4     // directory whose data[] is a struct wfs_dir_index rather than dentries
+#define WFS_INODE_COMMIT 0x8    // transaction header, data[] is a struct wfs_commit; not an inode
+#define WFS_INODE_COMPRESSED 0x10   // with WFS_INODE_DATA: data[] is a struct wfs_block
+#define WFS_INODE_CHECKPOINT 0x20   // data[] is a struct wfs_checkpoint; not an inode
+
+// Entries (version 8+) start on WFS_ALIGN boundaries and record how many bytes they take up,
+// so the log can be walked without looking at what they hold and everything in data[] is
+// naturally aligned. Unused bytes up to the next entry are zero.
+#define WFS_ALIGN 8
 
 struct wfs_log_entry {
     struct wfs_inode inode;
+    uint32_t length;        // bytes from this entry to the next, a multiple of WFS_ALIGN
     char data[];
 };
 
+static inline uint32_t wfs_align(uint64_t len) {
+    return (len + WFS_ALIGN - 1) & ~(uint64_t)(WFS_ALIGN - 1);
+}
+
+// Bytes an entry with data_len bytes of data[] takes up
+static inline uint32_t wfs_record_len(uint64_t data_len) {
+    return wfs_align(sizeof(struct wfs_log_entry) + data_len);
+}
+
+// A directory's data[] (or a page's) is its dentries one after another, each taking up only
+// the bytes its name needs. inode.size is the bytes they take up.
+struct wfs_dentry {
+    uint32_t inode_number;
+    uint8_t name_len;       // bytes of name before its NUL, less than MAX_FILE_NAME_LEN
+    char name[];            // NUL-terminated and zero-padded to the next dentry
+};
+
+static inline uint32_t wfs_dentry_len(size_t name_len) {
+    return wfs_align(offsetof(struct wfs_dentry, name) + name_len + 1);
+}
+
+static inline struct wfs_dentry *wfs_next_dentry(struct wfs_dentry *dentry) {
+    return (struct wfs_dentry *)((char *)dentry + wfs_dentry_len(dentry->name_len));
+}
+
+// File data (version 3+). A write appends the new bytes as a WFS_INODE_DATA record and then a
+// new version of the file whose extent list covers only those bytes, linked through prev to
+// the version it updates. Reads overlay the chain oldest first. Once a chain reaches
+// WFS_MAX_EXTENT_DEPTH the next write stores the merged extent list of the whole file instead.
+#define WFS_MAX_EXTENT_DEPTH 16
+
+struct wfs_extent {
+    uint64_t file_offset;
+    uint64_t log_offset;    // image offset of the first byte, or of a compressed block's record
+    uint32_t length;
+    uint32_t block;         // 0, or WFS_EXTENT_COMPRESSED | where the extent starts in the
+                            // bytes the block decompresses to
+};
+
+// Compressed data (WFS_FEATURE_COMPRESS). Writes are cut into blocks of at most WFS_BLOCK_SIZE
+// bytes, and each is stored as a WFS_INODE_DATA | WFS_INODE_COMPRESSED record if that is
+// smaller, in the LZ4 block format. The file's inode.size stays its logical size; a record's
+// is what it takes up in the log. An extent over part of a block keeps pointing at the whole
+// record, so trimming one moves block rather than log_offset.
+#define WFS_BLOCK_SIZE 65536
+#define WFS_EXTENT_COMPRESSED 0x80000000u
+
+struct wfs_block {
+    uint32_t length;        // bytes the block decompresses to
+    uint32_t reserved;
+    char bytes[];
+};
+
+// Advance extent by skip bytes of file data, e.g. to drop its front
+static inline void wfs_extent_skip(struct wfs_extent *extent, uint64_t skip) {
+    extent->file_offset += skip;
+    extent->length -= skip;
+    if (extent->block & WFS_EXTENT_COMPRESSED) {
+        extent->block += skip;
+    } else {
+        extent->log_offset += skip;
+    }
+}
+
+// Deduplicated data (WFS_FEATURE_DEDUP). File data is fingerprinted in WFS_DEDUP_CHUNK chunks
+// at multiples of the chunk size in the file, and a write or compaction that finds a chunk's
+// bytes already in the log points an extent at them instead of storing them again, so an
+// extent may lie in a data record of another file. Fingerprints live in a wfs_dedup_table
+// kept in memory; a match is only used once the bytes have been compared.
+#define WFS_DEDUP_CHUNK 4096
+
+struct wfs_dedup_slot {
+    uint64_t fingerprint;   // 0 for an empty slot
+    uint64_t offset;        // log offset of the chunk's first byte
+};
+
+struct wfs_dedup_table {
+    struct wfs_dedup_slot *slots;
+    size_t mask;            // slot count - 1, a power of two less one
+    size_t used;
+};
+
+struct wfs_extent_list {
+    uint64_t prev;          // offset of the previous version of the file, 0 if this list is complete
+    uint32_t depth;         // versions below this one in the chain
+    uint32_t count;
+    struct wfs_extent extents[];
+};
+
+// Directories (version 5+). A directory keeps its dentries inline in data[] until it holds
+// more than WFS_DIR_INLINE_MAX names. After that they live in pages, WFS_INODE_DATA records
+// holding a struct wfs_dir_page, found by extendible hashing: a name belongs to the slot given
+// by the low global_depth bits of wfs_name_hash(), and a page with local_depth d serves every
+// slot that shares its low d bits. A page past WFS_DIR_PAGE_MAX names is split in two on the
+// next insert, doubling the slots if it was the only page for its slot.
+//
+// An insert appends only the changed page(s) and a version whose index lists the slots that
+// changed, linked through prev to the version before it like an extent chain. Once the chain
+// reaches WFS_MAX_DIR_DEPTH, or the slots double, the next version lists every slot instead.
+#define WFS_DIR_INLINE_MAX 64
+#define WFS_DIR_PAGE_MAX 64
+#define WFS_DIR_MAX_GLOBAL_DEPTH 16     // pages grow past WFS_DIR_PAGE_MAX rather than split further
+#define WFS_MAX_DIR_DEPTH 16
+
+struct wfs_dir_slot {
+    uint32_t slot;
+    uint32_t reserved;
+    uint64_t page;          // image offset of the page record, 0 if no name maps to the slot
+};
+
+struct wfs_dir_index {
+    uint64_t prev;          // offset of the previous version, 0 if slots lists every slot in order
+    uint32_t depth;         // versions below this one in the chain
+    uint32_t count;         // slots listed
+    uint32_t global_depth;  // the directory has 1 << global_depth slots
+    uint32_t entries;       // names in the directory
+    struct wfs_dir_slot slots[];
+};
+
+struct wfs_dir_page {
+    uint32_t local_depth;   // hash bits shared by every name in the page
+    uint32_t count;
+    char dentries[];        // count struct wfs_dentry
+};
+
+// Transactions (version 6+). Every append past txn_start is one transaction: a commit record
+// followed by len bytes of entries, e.g. a new file, the directory page naming it and the new
+// directory version. The checksum covers those entries and is seeded with the epoch and the
+// length, so a transaction that was only partly written never verifies, and sequence numbers
+// run on by one within an epoch. wfs_recover() walks them at open time and sets head to the
+// end of the last one that verifies.
+#define WFS_COMMIT_MAGIC 0x7766636d     // "mcfw"
+#define WFS_COMMIT_LEN (sizeof(struct wfs_log_entry) + sizeof(struct wfs_commit))
+
+struct wfs_commit {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t epoch;         // superblock epoch of the mount that wrote it
+    uint64_t seq;           // 1 for the first transaction a mount commits, then counting up
+    uint64_t len;           // bytes of entries that follow
+    uint64_t checksum;      // wfs_checksum() of the entries
+};
+
+// Checkpoints (version 10+). mount.wfs appends its inode table as a WFS_INODE_CHECKPOINT
+// record in a transaction of its own, and once that is durable points superblock.checkpoint at
+// it. Opening the image then only verifies transactions from there on, and the table only has
+// to be brought up to date from head. Compaction moves the entries it names, so it clears
+// superblock.checkpoint, as does anything that changes which part of the log is compacted.
+struct wfs_checkpoint {
+    uint64_t head;          // start of its own transaction; the table covers the log below
+    uint64_t dead_bytes;    // mount.wfs's count of garbage above wfs_compact_base() then
+    uint32_t count;         // offsets[] entries
+    uint32_t next_inode;
+    uint64_t offsets[];     // inode -> its latest version below head, 0 if none
+};
+
+// The checkpoint the superblock points at, or NULL if there is none that covers the log
+// below end
+static inline struct wfs_checkpoint *wfs_checkpoint_at(const struct wfs_sb *sb, uint64_t end) {
+    if (sb->version < WFS_VERSION_CHECKPOINTS || sb->checkpoint == 0 || sb->checkpoint + sizeof(struct wfs_log_entry) > sb->head) {
+        return NULL;
+    }
+    struct wfs_log_entry *entry = (struct wfs_log_entry *)((char *)sb + sb->checkpoint);
+    struct wfs_checkpoint *checkpoint = (struct wfs_checkpoint *)entry->data;
+    if (entry->inode.flags != WFS_INODE_CHECKPOINT || entry->length > sb->head - sb->checkpoint ||
+        entry->length != wfs_record_len(entry->inode.size) || entry->inode.size < sizeof(struct wfs_checkpoint) ||
+        entry->inode.size != sizeof(struct wfs_checkpoint) + (uint64_t)checkpoint->count * sizeof(uint64_t) ||
+        checkpoint->head > end || checkpoint->head > sb->checkpoint) {
+        return NULL;
+    }
+    return checkpoint;
+}
+
+// Offset of the first log entry. Older superblocks are shorter, so their log starts earlier.
+static inline uint64_t wfs_log_start(const struct wfs_sb *sb) {
+    switch (sb->version) {
+    case WFS_VERSION_LEGACY:
+        return offsetof(struct wfs_sb, version);
+    case 1:
+        return offsetof(struct wfs_sb, compact_src);
+    default:
+        return sizeof(struct wfs_sb);
+    }
+}
+
+// Where compaction starts: the log below the newest snapshot is kept as it is
+static inline uint64_t wfs_compact_base(const struct wfs_sb *sb) {
+    uint64_t base = wfs_log_start(sb);
+    for (int i = 0; sb->version >= WFS_VERSION_SNAPSHOTS && i < WFS_MAX_SNAPSHOTS; i++) {
+        if (sb->snapshots[i].id != 0 && sb->snapshots[i].head > base) {
+            base = sb->snapshots[i].head;
+        }
+    }
+    return base;
+}
+
+// The length an entry's contents call for, which writers store in entry->length once they
+// have filled it in. inode.size is always the file size, which only matches the length of
+// data[] when the entry holds the bytes inline.
+static inline uint32_t wfs_content_len(const struct wfs_log_entry *entry) {
+    if (entry->inode.flags & WFS_INODE_EXTENTS) {
+        const struct wfs_extent_list *list = (const struct wfs_extent_list *)entry->data;
+        return wfs_record_len(sizeof(struct wfs_extent_list) + list->count * sizeof(struct wfs_extent));
+    }
+    if (entry->inode.flags & WFS_INODE_PAGED) {
+        const struct wfs_dir_index *index = (const struct wfs_dir_index *)entry->data;
+        return wfs_record_len(sizeof(struct wfs_dir_index) + index->count * sizeof(struct wfs_dir_slot));
+    }
+    return wfs_record_len(entry->inode.size);
+}
+
+// Bytes an entry takes up in the log
+static inline uint32_t wfs_entry_len(const struct wfs_log_entry *entry) {
+    return entry->length;
+}
+
+static inline struct wfs_log_entry *wfs_next_entry(struct wfs_log_entry *entry) {
+    return (struct wfs_log_entry *)((char *)entry + wfs_entry_len(entry));
+}
+
+// Whole-log walks (index builds, compaction, fsck) cross a page every few dozen entries, and
+// each page's TLB and cache misses would stall the walk in turn. Prefetching a page ahead
+// overlaps them with it; a prefetch never faults, so one past head or the mapping is harmless.
+// fsck.wfs scans a 290 MB log in the page cache in about 52 ms rather than 65; read from
+// disk, the scan waits on I/O either way.
+#define WFS_SCAN_AHEAD 4096
+
+static inline struct wfs_log_entry *wfs_scan_next(struct wfs_log_entry *entry) {
+    __builtin_prefetch((char *)entry + WFS_SCAN_AHEAD);
+    return wfs_next_entry(entry);
+}
+
+// Whether entry is a version of its inode, rather than bytes one refers to, a commit record or
+// a checkpoint
+static inline int wfs_is_version(const struct wfs_log_entry *entry) {
+    return !(entry->inode.flags & (WFS_INODE_DATA | WFS_INODE_COMMIT | WFS_INODE_CHECKPOINT));
+}
+
+// File data (wfs.c), shared by mount.wfs and compaction
+int wfs_file_read(struct wfs_sb *sb, struct wfs_log_entry *entry, char *buf, size_t size, off_t offset);
+int wfs_collect_extents(struct wfs_sb *sb, struct wfs_log_entry *entry, struct wfs_extent **extents, uint32_t *count);
+void wfs_overlay_extent(struct wfs_extent *list, uint32_t *count, const struct wfs_extent *extent);
+
+// Compressed blocks (wfs.c). wfs_compress() returns 0 if src does not fit in cap bytes;
+// wfs_decompress() returns the decompressed length or -EINVAL if src is corrupt.
+size_t wfs_compress(const char *src, size_t len, char *dst, size_t cap);
+int wfs_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+// Reads of compressed extents go through a small cache of decompressed blocks keyed by record
+// offset, which compaction empties since it moves records.
+int wfs_block_read(struct wfs_sb *sb, const struct wfs_extent *extent, uint64_t skip, char *buf, size_t size);
+void wfs_block_cache_clear(void);
+void wfs_block_cache_stats(uint64_t *hits, uint64_t *misses);
+
+// Fingerprint index (wfs.c). wfs_fingerprint() hashes one WFS_DEDUP_CHUNK and is never 0;
+// wfs_dedup_find() returns the offset recorded for it or 0, and wfs_dedup_insert() keeps the
+// first offset recorded for a fingerprint.
+uint64_t wfs_fingerprint(const void *chunk);
+uint64_t wfs_dedup_find(const struct wfs_dedup_table *table, uint64_t fingerprint);
+int wfs_dedup_insert(struct wfs_dedup_table *table, uint64_t fingerprint, uint64_t offset);
+void wfs_dedup_free(struct wfs_dedup_table *table);
+
+// Directories (wfs.c), shared by mount.wfs and compaction
+uint32_t wfs_name_hash(const char *name);
+int wfs_dir_lookup(struct wfs_sb *sb, struct wfs_log_entry *dir, const char *name, uint32_t *inode);
+uint32_t wfs_put_dentry(struct wfs_dentry *dest, const char *name, uint32_t inode_number);
+uint32_t wfs_dir_count(struct wfs_log_entry *dir);
+int wfs_dir_find_page(struct wfs_sb *sb, struct wfs_log_entry *dir, uint32_t slot, uint64_t *page);
+int wfs_dir_slots(struct wfs_sb *sb, struct wfs_log_entry *dir, uint64_t *pages);
+
+// Transactions (wfs.c)
+uint64_t wfs_checksum(const void *buf, size_t len, uint64_t seed);
+uint64_t wfs_commit_seed(const struct wfs_commit *commit);
+
+struct wfs_recover_stats {
+    uint64_t bytes_checked;     // transaction bytes verified
+    uint64_t bytes_dropped;     // bytes below the old head that failed to verify
+    uint64_t transactions;
+    double seconds;
+};
+
+int wfs_recover(struct wfs_sb *sb, size_t disk_size, struct wfs_recover_stats *stats);
+
+// Free space past head is zero, as mkfs.wfs leaves it, and writers rely on that for padding.
+// Anything about to write past dirty_end first moves it on with wfs_mark_dirty(), which makes
+// the new value durable, so after a crash only [head, dirty_end) can hold torn bytes, and
+// wfs_recover() zeroes them.
+int wfs_mark_dirty(struct wfs_sb *sb, uint64_t end);
+
+// What wfs_mark_dirty() and compaction change in a mounted image they make durable with
+// wfs_sync(), which msyncs the pages of [start, end). That is all a shared mapping needs; a
+// program that maps the image privately and writes the file itself sets wfs_sync_hook.
+extern int (*wfs_sync_hook)(struct wfs_sb *sb, uint64_t start, uint64_t end);
+int wfs_sync(struct wfs_sb *sb, uint64_t start, uint64_t end);
+
+// Opening an image (wfs.c), shared by mount.wfs and compact.wfs. Runs wfs_recover(). A
+// read_only image is mapped privately, so an older one is brought up to date in memory and
+// the file is never written.
+struct wfs_sb *wfs_map(int fd, size_t *disk_size, int read_only);
+
+// Snapshots (wfs.c). wfs_snapshot_add() records one at head, numbered one past the highest
+// id in the table, and returns its slot or -ENOSPC if every slot is taken; wfs_snapshot_find()
+// returns the slot of id or -1. The caller syncs the superblock. wfs_latest_version() scans
+// the log below end for the offset of inode's latest version, 0 if there is none.
+int wfs_snapshot_add(struct wfs_sb *sb, uint64_t head, uint64_t root);
+int wfs_snapshot_find(const struct wfs_sb *sb, uint32_t id);
+uint64_t wfs_latest_version(struct wfs_sb *sb, uint32_t inode, uint64_t end);
+
+// Log compaction (wfs.c), shared by mount.wfs and compact.wfs
+struct wfs_compact_stats {
+    uint64_t bytes_before;      // log bytes before compaction
+    uint64_t bytes_after;       // log bytes after compaction
+    uint32_t live_entries;
+    uint32_t dead_entries;
+    double seconds;             // wall time spent compacting
+};
+
+int wfs_compact(struct wfs_sb *sb, size_t disk_size, struct wfs_compact_stats *stats);
+int wfs_compact_finish(struct wfs_sb *sb, size_t disk_size);
+
 #endif